@@ -6,10 +6,19 @@
 #define UNTITLED_RAYTRACING_H
 
 #include <vector>
+#include <cstdint>
 #include <cmath>
 #include <memory>
+#include <algorithm>
 
 #include "imgui.h" //for color macros
+#include "raytracing_sampling.h"
+
+class ByteWriter;
+class Bvh;
+class SceneReplicas;
+class VisibilityCache;
+struct SurfaceTextures;
 
 struct Color {
     float red = 0, green = 0, blue = 0;
@@ -56,6 +65,11 @@ struct Color {
     }
 };
 
+// Rec. 709 weights, how bright a color looks
+inline float Luminance(const Color& color) {
+    return 0.2126f * color.red + 0.7152f * color.green + 0.0722f * color.blue;
+}
+
 struct Vec3 {
     float x = 0, y = 0, z = 0;
     [[nodiscard]] Vec3 operator-(const Vec3& other) const {
@@ -112,28 +126,220 @@ struct Vec3 {
     }
 };
 
+// Axis aligned bounding box, empty by default
+struct Aabb {
+    Vec3 min {INFINITY, INFINITY, INFINITY};
+    Vec3 max {-INFINITY, -INFINITY, -INFINITY};
+
+    void Extend(const Vec3& point) {
+        min = Vec3 {Min(min.x, point.x), Min(min.y, point.y), Min(min.z, point.z)};
+        max = Vec3 {Max(max.x, point.x), Max(max.y, point.y), Max(max.z, point.z)};
+    }
+
+    // extending by an empty box keeps the box as is
+    void Extend(const Aabb& other) {
+        min = Vec3 {Min(min.x, other.min.x), Min(min.y, other.min.y), Min(min.z, other.min.z)};
+        max = Vec3 {Max(max.x, other.max.x), Max(max.y, other.max.y), Max(max.z, other.max.z)};
+    }
+
+    [[nodiscard]] bool Empty() const {
+        return min.x > max.x || min.y > max.y || min.z > max.z;
+    }
+
+    // boxes touching on a side overlap
+    [[nodiscard]] bool Overlaps(const Aabb& other) const {
+        return min.x <= other.max.x && other.min.x <= max.x
+            && min.y <= other.max.y && other.min.y <= max.y
+            && min.z <= other.max.z && other.min.z <= max.z;
+    }
+
+    // unbounded primitives (planes) have infinite boxes
+    [[nodiscard]] bool Finite() const {
+        return std::isfinite(min.x) && std::isfinite(min.y) && std::isfinite(min.z)
+            && std::isfinite(max.x) && std::isfinite(max.y) && std::isfinite(max.z);
+    }
+
+    [[nodiscard]] Vec3 Center() const {
+        return (min + max) * 0.5f;
+    }
+
+    // half of the surface area
+    [[nodiscard]] float Area() const {
+        const Vec3 size = max - min;
+        return size.x * size.y + size.y * size.z + size.z * size.x;
+    }
+
+    [[nodiscard]] bool Contains(const Vec3& point, float eps) const {
+        return point.x >= min.x - eps && point.x <= max.x + eps
+            && point.y >= min.y - eps && point.y <= max.y + eps
+            && point.z >= min.z - eps && point.z <= max.z + eps;
+    }
+
+    // Slab test for start + t * ray, t in [t_min, t_max], inv_ray is 1 / ray per component
+    // t_near is the entry point clamped to t_min
+    bool Intersect(const Vec3& start, const Vec3& inv_ray, float t_min, float t_max, float* t_near) const {
+        const float tx1 = (min.x - start.x) * inv_ray.x, tx2 = (max.x - start.x) * inv_ray.x;
+        const float ty1 = (min.y - start.y) * inv_ray.y, ty2 = (max.y - start.y) * inv_ray.y;
+        const float tz1 = (min.z - start.z) * inv_ray.z, tz2 = (max.z - start.z) * inv_ray.z;
+        // NaN appears only when start lies exactly on a slab of a parallel ray,
+        // Bvh pads its boxes so that this doesn't happen next to the surfaces inside them
+        t_min = Max(t_min, Max(Min(tx1, tx2), Max(Min(ty1, ty2), Min(tz1, tz2))));
+        t_max = Min(t_max, Min(Max(tx1, tx2), Min(Max(ty1, ty2), Max(tz1, tz2))));
+        *t_near = t_min;
+        return t_min <= t_max;
+    }
+
+private:
+    // unlike fminf/fmaxf these compile to single instructions
+    static float Min(float a, float b) {
+        return a < b ? a : b;
+    }
+
+    static float Max(float a, float b) {
+        return a > b ? a : b;
+    }
+};
+
 struct Material {
     Color diffuse; //=ambient
     Color specular;
     float power = 0;
 };
 
+// Which terms of the Phong model a material has, shading kernels are specialized for every class
+enum class MaterialClass : int {
+    Black,   // reflects nothing
+    Diffuse, // no specular color: no highlights and no reflected rays
+    Mirror,  // no diffuse color: no ambient or diffuse light
+    Phong
+};
+
+MaterialClass Classify(const Material& material);
+
+// Point of a texture, (0, 0) is the top left corner of the image and (1, 1) the bottom right one
+struct TexCoord {
+    float u = 0, v = 0;
+};
+
+// What a ray found on a primitive, Primitive::Intersect finds the surface and Primitive::Complete describes it,
+// so that shading takes the normal and material from the hit instead of searching for the surface again
+struct Hit {
+    float t = INFINITY; // ray parameter, INFINITY if nothing was hit
+    int primitive = -1; // index into the primitives of the scene, set by whoever searches them
+    // surface of a compound primitive: index of its sphere, triangle or primitive, 0 for simple primitives
+    int part = 0;
+    // filled in by Primitive::Complete
+    Vec3 normal;
+    TexCoord uv;
+    const Material* material = nullptr;
+    float footprint = 0; // width of the cone of the ray that found the hit at the hit, set by whoever searches
+};
+
+// Width of the area a ray stands for, width at the start growing by spread per unit of the ray parameter
+// Primitives with levels of detail pick the coarsest one whose missing details are narrower than the cone,
+// the default cone of width 0 always gets the finest level
+struct RayCone {
+    float width = 0;
+    float spread = 0;
+
+    [[nodiscard]] float At(float t) const { return width + spread * t; }
+};
+
+// Rays leaving a part of a compound primitive ignore the other parts of it closer than this to their start,
+// shadow rays ending on one ignore them closer than this to their end, parts sharing an edge would
+// shadow or reflect each other there otherwise
+constexpr float self_hit_distance = 1e-2f;
+
 class Primitive {
 public:
     virtual Vec3 Normal(const Vec3& intersection) const = 0;
+    // closest root not behind start if there is one, solids containing start give their exit
     virtual bool Intersection(const Vec3& start, const Vec3& ray, float* result) const = 0;
     virtual ~Primitive() = default;
     virtual const Material& material() const = 0;
+    // material at a point of the surface, differs from material() for primitives made of several materials
+    virtual const Material& MaterialAt(const Vec3& point) const { return material(); }
+
+    // Sets t and part of hit (not primitive) to the surface start + t * ray meets, roots are those of Intersection
+    // skipped_part is the part the ray leaves or ends on, it isn't hit, other parts are hit only
+    // self_hit_distance away from the start. cone picks the level of detail of primitives that have them
+    virtual bool Intersect(const Vec3& start, const Vec3& ray, Hit* hit, int skipped_part = -1,
+                           const RayCone& cone = RayCone {}) const {
+        float t;
+        if (skipped_part == 0 || !Intersection(start, ray, &t)) return false;
+        hit->t = t;
+        hit->part = 0;
+        return true;
+    }
+    // Intersect for count rays sharing a cone in one call, hits[k].t is INFINITY for rays k that miss
+    virtual void IntersectMany(const Vec3* starts, const Vec3* rays, int count, Hit* hits,
+                               int skipped_part = -1, const RayCone& cone = RayCone {}) const {
+        for (int k = 0; k < count; k++) {
+            if (!Intersect(starts[k], rays[k], hits + k, skipped_part, cone)) hits[k].t = INFINITY;
+        }
+    }
+    // fills in normal, uv and material of hit found by Intersect at point
+    virtual void Complete(const Vec3& point, Hit* hit) const {
+        hit->normal = Normal(point);
+        hit->material = &MaterialAt(point);
+    }
+    // surfaces the primitive is made of, hits tell them apart by part
+    [[nodiscard]] virtual int parts() const { return 1; }
+
+    // material of a completed hit with textures applied, footprint is the width of the area seen through
+    // a sample at the hit when looking along ray, textures are filtered over it
+    virtual Material SurfaceMaterial(const Hit& hit, const Vec3& ray, float footprint) const {
+        return *hit.material;
+    }
+    // writes type tag and parameters, see raytracing_scene_io.h
+    virtual void Serialize(ByteWriter& out) const = 0;
+    virtual Aabb Bounds() const = 0;
+    // distance from point to the surface, used to find which part of a compound primitive was hit
+    virtual float Distance(const Vec3& point) const = 0;
 };
 
-class Sphere : public Primitive {
+// Base of primitives made of a single surface, Intersect and IntersectMany call Shape::Intersection
+// without virtual dispatch
+template <typename Shape>
+class SimplePrimitive : public Primitive {
+public:
+    bool Intersect(const Vec3& start, const Vec3& ray, Hit* hit, int skipped_part, const RayCone&) const final {
+        float t;
+        if (skipped_part == 0 || !static_cast<const Shape*>(this)->Shape::Intersection(start, ray, &t)) return false;
+        hit->t = t;
+        hit->part = 0;
+        return true;
+    }
+
+    void IntersectMany(const Vec3* starts, const Vec3* rays, int count, Hit* hits, int skipped_part,
+                       const RayCone&) const final {
+        const Shape& shape = *static_cast<const Shape*>(this);
+        for (int k = 0; k < count; k++) {
+            float t;
+            hits[k].t = skipped_part != 0 && shape.Shape::Intersection(starts[k], rays[k], &t) ? t : INFINITY;
+            hits[k].part = 0;
+        }
+    }
+};
+
+class Sphere : public SimplePrimitive<Sphere> {
 private:
     Vec3 center;
     float radius = 0;
     Material _material;
+    std::shared_ptr<const SurfaceTextures> textures;
 public:
     Sphere(const Vec3& center, float radius, const Material& material): center {center}, radius {radius}, _material {material} {}
     [[nodiscard]] const Material& material() const override { return _material; }
+    [[nodiscard]] Vec3 Center() const { return center; }
+    [[nodiscard]] float Radius() const { return radius; }
+    [[nodiscard]] const std::shared_ptr<const SurfaceTextures>& surface_textures() const { return textures; }
+    void Serialize(ByteWriter& out) const override;
+
+    // wraps textures around the sphere with u along the equator and v from the top (+y) to the bottom pole
+    void SetTextures(std::shared_ptr<const SurfaceTextures> surface_textures) { textures = std::move(surface_textures); }
+    void Complete(const Vec3& point, Hit* hit) const override;
+    [[nodiscard]] Material SurfaceMaterial(const Hit& hit, const Vec3& ray, float footprint) const override;
 
     bool Intersection(const Vec3 &start, const Vec3 &ray, float *result) const override {
         const Vec3& o = start - center;
@@ -141,25 +347,39 @@ public:
         const float quad_discr = (o * v) * (o * v) - (v * v) * ((o * o) - radius * radius);
         if (quad_discr < 0) return false;
 
-        *result = (-(o * v) - sqrtf(quad_discr)) / (v * v);
+        const float near_root = (-(o * v) - sqrtf(quad_discr)) / (v * v);
+        const float far_root = (-(o * v) + sqrtf(quad_discr)) / (v * v);
+        *result = near_root >= 0 || far_root < 0 ? near_root : far_root;
         return true;
     }
 
     [[nodiscard]] Vec3 Normal(const Vec3 &intersection) const override {
         return (intersection - center).norm();
     }
+
+    [[nodiscard]] Aabb Bounds() const override {
+        const Vec3 extent {radius, radius, radius};
+        return Aabb {center - extent, center + extent};
+    }
+
+    [[nodiscard]] float Distance(const Vec3& point) const override {
+        return fabsf((point - center).length() - radius);
+    }
 };
 
 // returns k for which (start + k * ray, normal) = 0
 float OrthogonalEquation(const Vec3& start, const Vec3& ray, const Vec3& normal);
 
-class Triangle : public Primitive {
+class Triangle : public SimplePrimitive<Triangle> {
 private:
     Vec3 a, b, c;
     Vec3 normal;
     Vec3 ab_normal, bc_normal, ca_normal;
     Material _material;
     bool exclude_line;
+    std::shared_ptr<const SurfaceTextures> textures;
+    TexCoord uv[3]; // of a, b, c
+    float uv_scale = 0; // texture coordinates per unit of length on the triangle
 public:
     // a, b, c are clockwise
     // normal is (c - a) x (b - a)
@@ -172,6 +392,18 @@ public:
             _material {material},
             exclude_line {exclude_line} {}
     [[nodiscard]] const Material& material() const override { return _material; }
+    // corner i of a, b, c and its texture coordinates
+    [[nodiscard]] Vec3 Corner(int i) const { return i == 0 ? a : i == 1 ? b : c; }
+    [[nodiscard]] const TexCoord& CornerUv(int i) const { return uv[i]; }
+    [[nodiscard]] const std::shared_ptr<const SurfaceTextures>& surface_textures() const { return textures; }
+    [[nodiscard]] bool excludes_line() const { return exclude_line; }
+    void Serialize(ByteWriter& out) const override;
+
+    // texture coordinates are interpolated from the ones of the corners
+    void SetTextures(std::shared_ptr<const SurfaceTextures> surface_textures,
+                     const TexCoord& uv_a, const TexCoord& uv_b, const TexCoord& uv_c);
+    void Complete(const Vec3& point, Hit* hit) const override;
+    [[nodiscard]] Material SurfaceMaterial(const Hit& hit, const Vec3& ray, float footprint) const override;
 
     bool Intersection(const Vec3 &start, const Vec3 &ray, float *result) const override {
         const float k = -((start - a) * normal) / (normal * ray);
@@ -189,13 +421,184 @@ public:
     [[nodiscard]] Vec3 Normal(const Vec3 &intersection) const override {
         return normal;
     }
+
+    [[nodiscard]] Aabb Bounds() const override {
+        Aabb bounds;
+        bounds.Extend(a);
+        bounds.Extend(b);
+        bounds.Extend(c);
+        return bounds;
+    }
+
+    [[nodiscard]] float Distance(const Vec3& point) const override {
+        return fabsf((point - a) * normal);
+    }
+};
+
+// Infinite plane through point, it has no bounds, so the hierarchy tests it with every ray
+class Plane : public SimplePrimitive<Plane> {
+private:
+    Vec3 point;
+    Vec3 normal;
+    Material _material;
+public:
+    Plane(const Vec3& point, const Vec3& normal, const Material& material):
+            point {point}, normal {normal.norm()}, _material {material} {}
+    [[nodiscard]] const Material& material() const override { return _material; }
+    void Serialize(ByteWriter& out) const override;
+
+    bool Intersection(const Vec3 &start, const Vec3 &ray, float *result) const override {
+        const float denominator = normal * ray;
+        if (denominator == 0) return false;
+        *result = ((point - start) * normal) / denominator;
+        return true;
+    }
+
+    [[nodiscard]] Vec3 Normal(const Vec3 &intersection) const override {
+        return normal;
+    }
+
+    [[nodiscard]] Aabb Bounds() const override {
+        return Aabb {Vec3 {-INFINITY, -INFINITY, -INFINITY}, Vec3 {INFINITY, INFINITY, INFINITY}};
+    }
+
+    [[nodiscard]] float Distance(const Vec3& point) const override {
+        return fabsf((point - this->point) * normal);
+    }
+};
+
+// Parallelogram corner + s * u + t * v, s, t in [0, 1], normal is u x v
+// One plane test and two dot products instead of two triangles, and no diagonal to hit twice
+class Quad : public SimplePrimitive<Quad> {
+private:
+    Vec3 corner;
+    Vec3 u, v;
+    Vec3 normal;
+    // (s, t) of a point p in the plane are ((p - corner) * u_dual, (p - corner) * v_dual)
+    Vec3 u_dual, v_dual;
+    Material _material;
+public:
+    Quad(const Vec3& corner, const Vec3& u, const Vec3& v, const Material& material):
+            corner {corner}, u {u}, v {v},
+            normal {u.cross(v).norm()},
+            _material {material} {
+        const Vec3 u_orthogonal = v.cross(normal);
+        const Vec3 v_orthogonal = normal.cross(u);
+        u_dual = u_orthogonal * (1 / (u * u_orthogonal));
+        v_dual = v_orthogonal * (1 / (v * v_orthogonal));
+    }
+    [[nodiscard]] const Material& material() const override { return _material; }
+    void Serialize(ByteWriter& out) const override;
+
+    bool Intersection(const Vec3 &start, const Vec3 &ray, float *result) const override {
+        const float denominator = normal * ray;
+        if (denominator == 0) return false;
+        const float k = ((corner - start) * normal) / denominator;
+        const Vec3 offset = start + ray * k - corner;
+        const float s = offset * u_dual;
+        if (s < 0 || s > 1) return false;
+        const float t = offset * v_dual;
+        if (t < 0 || t > 1) return false;
+        *result = k;
+        return true;
+    }
+
+    [[nodiscard]] Vec3 Normal(const Vec3 &intersection) const override {
+        return normal;
+    }
+
+    [[nodiscard]] Aabb Bounds() const override {
+        Aabb bounds;
+        bounds.Extend(corner);
+        bounds.Extend(corner + u);
+        bounds.Extend(corner + v);
+        bounds.Extend(corner + u + v);
+        return bounds;
+    }
+
+    [[nodiscard]] float Distance(const Vec3& point) const override {
+        return fabsf((point - corner) * normal);
+    }
 };
 
+// Solid axis aligned box with outward normals
+class AABox : public SimplePrimitive<AABox> {
+private:
+    Aabb box;
+    Material _material;
+public:
+    AABox(const Vec3& min, const Vec3& max, const Material& material): box {min, max}, _material {material} {}
+    [[nodiscard]] const Material& material() const override { return _material; }
+    void Serialize(ByteWriter& out) const override;
+
+    // entry point, or the exit when start is inside like the roots of Sphere
+    bool Intersection(const Vec3 &start, const Vec3 &ray, float *result) const override {
+        const Vec3 inv_ray {1 / ray.x, 1 / ray.y, 1 / ray.z};
+        if (!box.Intersect(start, inv_ray, -INFINITY, INFINITY, result)) return false;
+        if (*result >= 0) return true;
+        // the exit is where the reversed ray enters
+        float reversed_entry;
+        box.Intersect(start, inv_ray * -1, -INFINITY, INFINITY, &reversed_entry);
+        if (-reversed_entry >= 0) *result = -reversed_entry;
+        return true;
+    }
+
+    // normal of the face closest to intersection
+    [[nodiscard]] Vec3 Normal(const Vec3 &intersection) const override {
+        const float distances[6] = {
+                intersection.x - box.min.x, box.max.x - intersection.x,
+                intersection.y - box.min.y, box.max.y - intersection.y,
+                intersection.z - box.min.z, box.max.z - intersection.z
+        };
+        int face = 0;
+        for (int i = 1; i < 6; i++) {
+            if (fabsf(distances[i]) < fabsf(distances[face])) face = i;
+        }
+        const float sign = face % 2 ? 1.0f : -1.0f;
+        return face < 2 ? Vec3 {sign, 0, 0} : (face < 4 ? Vec3 {0, sign, 0} : Vec3 {0, 0, sign});
+    }
+
+    [[nodiscard]] Aabb Bounds() const override {
+        return box;
+    }
+
+    [[nodiscard]] float Distance(const Vec3& point) const override {
+        const Vec3 center = box.Center();
+        const Vec3 half = (box.max - box.min) * 0.5f;
+        const Vec3 q {fabsf(point.x - center.x) - half.x, fabsf(point.y - center.y) - half.y,
+                      fabsf(point.z - center.z) - half.z};
+        const Vec3 outside {std::max(q.x, 0.0f), std::max(q.y, 0.0f), std::max(q.z, 0.0f)};
+        const float inside = std::min(std::max(q.x, std::max(q.y, q.z)), 0.0f);
+        return fabsf(outside.length() + inside);
+    }
+};
+
+enum class LightShape : int {
+    Point = 0,
+    Sphere = 1,
+    Rectangle = 2,
+};
+
+// Area lights spread color over their surface and are sampled with
+// up to `samples` stratified shadow rays
 struct Light {
-    Vec3 position;
+    Vec3 position; // center of area lights
     Color color;
+    LightShape shape = LightShape::Point;
+    float radius = 0; // sphere
+    Vec3 u, v; // rectangle spans position + u * [-1, 1] + v * [-1, 1]
+    int samples = 16;
 };
 
+inline Light SphereLight(const Vec3& center, float radius, const Color& color, int samples = 16) {
+    return Light {center, color, LightShape::Sphere, radius, Vec3 {}, Vec3 {}, samples};
+}
+
+inline Light RectangleLight(const Vec3& center, const Vec3& half_u, const Vec3& half_v,
+                            const Color& color, int samples = 16) {
+    return Light {center, color, LightShape::Rectangle, 0, half_u, half_v, samples};
+}
+
 struct Camera {
     Camera(const Vec3& eye,
            const Vec3& view,
@@ -204,6 +607,7 @@ struct Camera {
            int sw, int sh){
         this->zn = zn;
         this->zf = zf;
+        this->near_clip = zn;
         this->sw = sw;
         this->sh = sh;
         this->z = view - eye;
@@ -216,17 +620,177 @@ struct Camera {
     Vec3 z;
     Vec3 right;
     Vec3 up;
+    // zn is the depth of the image plane, where pixels are 1 apart, primary hits are clipped to depths
+    // [near_clip, zf]. near_clip starts as zn and stays put when a preview scales zn with the resolution
     float zn, zf;
+    float near_clip;
     int sw, sh;
 };
 
+enum class BvhBuilder : int {
+    Sah = 0,  // binned surface area heuristic, faster traversal
+    Lbvh = 1, // Morton order splits, faster build
+};
+
+enum class NumaPolicy : int {
+    Off = 0,
+    Local = 1,      // threads pinned and spread over nodes, frame buffers first touched by the rows' threads
+    Replicated = 2, // Local with a copy of the scene and hierarchy on every node
+};
+
+enum class Integrator : int {
+    Whitted = 0,     // mirror reflections and direct light, ambient is a constant term
+    PathTracing = 1, // Monte Carlo global illumination, samples per pixel trade noise for time
+};
+
+struct RenderSettings {
+    int samples = 2; // per pixel side, samples * samples rays per pixel
+    SamplePattern pattern = SamplePattern::Grid;
+    uint32_t seed = 0;
+    BvhBuilder builder = BvhBuilder::Sah;
+    int denoise = 0; // passes of the edge aware filter after resolve, 0 keeps pixels as traced
+    NumaPolicy numa = NumaPolicy::Off;
+    bool fast_math = false; // approximate square roots and powers, see raytracing_fastmath.h
+    Integrator integrator = Integrator::Whitted;
+
+    [[nodiscard]] int samples_per_pixel() const { return samples * samples; }
+};
+
+// Timings of a render in seconds
+struct RenderStats {
+    double build = 0; // acceleration structure
+    double trace = 0;
+    double resolve = 0;
+    int nodes = 0; // of the acceleration structure
+};
+
+// Primary hit of a pixel, recorded while tracing to find pixels affected by scene edits
+struct PixelHit {
+    static constexpr int background = -1;
+    static constexpr int mixed = -2; // samples of the pixel hit different primitives
+
+    Vec3 position; // hit of the first sample that found a surface
+    Vec3 normal;
+    float footprint = 0; // size of the pixel around position
+    int primitive = background;
+    bool reflected = false; // some sample continued after a reflection that contributes to it
+};
+
+// Work spent on a pixel by all of its samples, intersection tests count primitives of the scene,
+// not the parts of instances and clouds
+struct PixelCost {
+    uint32_t intersections = 0;
+    uint32_t shadow_rays = 0;
+    uint32_t bounces = 0; // reflected rays traced
+    float nanoseconds = 0;
+};
+
+// Rectangle of pixels
+struct Tile {
+    int x, y;
+    int width, height;
+};
+
+// Traces rows [row_begin, row_end) into intensities, which holds
+// settings.samples_per_pixel() colors for each of camera.sw * (row_end - row_begin) pixels
+// Negative components mark samples that hit the background
+// Rows are split between threads in contiguous static chunks, like FirstTouchArray splits them
+void TraceRows(const Camera& camera,
+               const std::vector<Light>& light_sources,
+               const std::vector<std::unique_ptr<Primitive>>& primitives,
+               const Bvh& bvh, // built over primitives
+               int row_begin, int row_end,
+               Color* intensities,
+               int depth,
+               const Color& ambient,
+               const RenderSettings& settings,
+               PixelHit* hits = nullptr, // a hit for each traced pixel if not null
+               const SceneReplicas* replicas = nullptr, // threads trace the copy of their node if not null
+               PixelCost* costs = nullptr, // laid out like hits
+               const VisibilityCache* visibility = nullptr // made for light_sources and primitives if not null
+               );
+
+// Same as TraceRows for pixels of tiles, intensities and hits are laid out as for the whole frame
+void TraceTiles(const Camera& camera,
+                const std::vector<Light>& light_sources,
+                const std::vector<std::unique_ptr<Primitive>>& primitives,
+                const Bvh& bvh,
+                const std::vector<Tile>& tiles,
+                Color* intensities,
+                int depth,
+                const Color& ambient,
+                const RenderSettings& settings,
+                PixelHit* hits = nullptr,
+                PixelCost* costs = nullptr,
+                const VisibilityCache* visibility = nullptr
+                );
+
+// Tile of one of several frames traced together
+struct ViewTile {
+    int view;
+    Tile tile;
+};
+
+// Same as TraceTiles for tiles of several frames in one parallel loop, tile.view indexes cameras,
+// intensities and hits, which may be null or hold null for frames traced without hits
+void TraceViewTiles(const std::vector<Camera>& cameras,
+                    const std::vector<Light>& light_sources,
+                    const std::vector<std::unique_ptr<Primitive>>& primitives,
+                    const Bvh& bvh,
+                    const std::vector<ViewTile>& tiles,
+                    Color* const* intensities,
+                    int depth,
+                    const Color& ambient,
+                    const RenderSettings& settings,
+                    PixelHit* const* hits = nullptr
+                    );
+
+// Averages samples of every pixel, components are scaled to [0, 1] by the maximum over the whole frame
+// Path traced samples are too noisy for that, their averages are scaled by a high percentile and clipped
+void ResolvePixels(const Color* intensities,
+                   int pixel_count,
+                   int samples_per_pixel,
+                   Color* pixels,
+                   const Color& background,
+                   Integrator integrator = Integrator::Whitted
+                   );
+
+// Maps traced intensities of the whole frame to rgba pixels
+void ResolveImage(const Color* intensities,
+                  int pixel_count,
+                  int samples_per_pixel,
+                  int* image,
+                  const Color& background,
+                  Integrator integrator = Integrator::Whitted
+                  );
+
 void Raytracing(const Camera& camera,
                 const std::vector<Light>& light_sources,
                 const std::vector<std::unique_ptr<Primitive>>& primitives,
                 int* image, //sw x sh,
                 int depth = 1,
                 const Color& background = Color {0, 0, 0},
-                const Color& ambient = Color {1, 1, 1}
+                const Color& ambient = Color {1, 1, 1},
+                const RenderSettings& settings = RenderSettings {},
+                RenderStats* stats = nullptr,
+                PixelCost* costs = nullptr, // sw x sh, filled if not null
+                // shadows of point lights are taken from it where they are known, it's filled in as it goes
+                const VisibilityCache* visibility = nullptr
+                );
+
+// Same as Raytracing with bvh built over primitives beforehand, stats->build is left as is
+void Raytracing(const Camera& camera,
+                const std::vector<Light>& light_sources,
+                const std::vector<std::unique_ptr<Primitive>>& primitives,
+                const Bvh& bvh,
+                int* image, //sw x sh,
+                int depth,
+                const Color& background,
+                const Color& ambient,
+                const RenderSettings& settings,
+                RenderStats* stats = nullptr,
+                PixelCost* costs = nullptr,
+                const VisibilityCache* visibility = nullptr
                 );
 
 #endif //UNTITLED_RAYTRACING_H
@@ -0,0 +1,316 @@
+//
+// Created by numi on 6/9/22.
+//
+
+#ifndef UNTITLED_RAYTRACING_BVH_H
+#define UNTITLED_RAYTRACING_BVH_H
+
+#include <vector>
+#include <memory>
+
+#include "raytracing.h"
+
+class ByteReader;
+
+struct BvhNode {
+    Aabb bounds;
+    int first = 0; // leaf: first item in Bvh::items, inner node: index of the left child, right one follows it
+    int count = 0; // number of items of a leaf, 0 for inner nodes
+};
+
+// How much of a node box a query covers
+enum class Overlap {
+    None,
+    Partial,
+    Full
+};
+
+// Subtrees picked out of a Bvh by Bvh::Cut, traversals starting at them only see the items below them
+struct BvhCut {
+    static constexpr int max_nodes = 32;
+    int nodes[max_nodes];
+    int count = 0;
+};
+
+// Bounding volume hierarchy over item boxes, items are indices into the array the boxes came from
+// Items with infinite boxes are kept aside and visited by every query
+class Bvh {
+private:
+    std::vector<BvhNode> _nodes;
+    std::vector<int> _items;
+    std::vector<int> _unbounded;
+
+    static constexpr int max_depth = 64;
+    static constexpr int max_leaf_size = 8;
+    // subtrees with fewer items are built by a single thread
+    static constexpr int parallel_items = 16384;
+    // cost of intersecting an item relative to testing a node box
+    float item_cost = 1;
+
+    // Items [begin, end) under node, descendants of the node take the 2 * (end - begin) - 2 slots
+    // starting at children, so subtrees are independent and the layout doesn't depend on threads
+    struct Subtree {
+        int node;
+        int children;
+        int begin, end;
+        int depth;
+    };
+
+    // in the first phase (deferred isn't null) large subtrees are split with parallel loops,
+    // and the parts smaller than parallel_items are added to deferred to be built by one thread each
+    void BuildSah(const Subtree& subtree, const std::vector<Aabb>& boxes, std::vector<Subtree>* deferred);
+    void BuildLbvh(const Subtree& subtree, const std::vector<uint32_t>& codes, const std::vector<Aabb>& boxes,
+                   std::vector<Subtree>* deferred);
+    // makes subtree.node an inner node with items [begin, middle) on the left
+    void Branch(const Subtree& subtree, int middle, Subtree children[2]);
+    void Compact();
+
+    template <typename Visit>
+    void TraverseFrom(const int* roots, int root_count, const Vec3& start, const Vec3& ray,
+                      float t_min, float t_max, Visit&& visit) const {
+        for (int item: _unbounded) {
+            if (!visit(item, &t_max)) return;
+        }
+        TraverseLeavesFrom(roots, root_count, start, ray, t_min, t_max, [&](int first, int count, float* leaf_t_max) {
+            for (int i = first; i < first + count; i++) {
+                if (!visit(_items[i], leaf_t_max)) return false;
+            }
+            return true;
+        });
+    }
+
+    // roots are visited in order, at most BvhCut::max_nodes of them
+    template <typename Visit>
+    void TraverseLeavesFrom(const int* roots, int root_count, const Vec3& start, const Vec3& ray,
+                            float t_min, float t_max, Visit&& visit) const {
+        if (_nodes.empty()) return;
+
+        const Vec3 inv_ray {1 / ray.x, 1 / ray.y, 1 / ray.z};
+        int stack[max_depth + BvhCut::max_nodes];
+        int stack_size = 0;
+        for (int i = root_count - 1; i >= 0; i--) {
+            stack[stack_size++] = roots[i];
+        }
+        int node_index = 0;
+        float t_near;
+
+        while (true) {
+            // nodes on the stack may have become farther than t_max, they are retested when popped
+            bool found = false;
+            while (stack_size > 0) {
+                node_index = stack[--stack_size];
+                if (_nodes[node_index].bounds.Intersect(start, inv_ray, t_min, t_max, &t_near)) {
+                    found = true;
+                    break;
+                }
+            }
+            if (!found) return;
+
+            while (true) {
+                const BvhNode& node = _nodes[node_index];
+                if (node.count > 0) {
+                    if (!visit(node.first, node.count, &t_max)) return;
+                    break;
+                }
+                float t_left, t_right;
+                const bool left = _nodes[node.first].bounds.Intersect(start, inv_ray, t_min, t_max, &t_left);
+                const bool right = _nodes[node.first + 1].bounds.Intersect(start, inv_ray, t_min, t_max, &t_right);
+                if (left && right) {
+                    const bool left_first = t_left <= t_right;
+                    stack[stack_size++] = left_first ? node.first + 1 : node.first;
+                    node_index = left_first ? node.first : node.first + 1;
+                } else if (left || right) {
+                    node_index = left ? node.first : node.first + 1;
+                } else {
+                    break;
+                }
+            }
+        }
+    }
+public:
+    static constexpr int max_packet = 256;
+
+    Bvh() = default;
+    // cheap items (item_cost below 1) make the surface area heuristic keep fuller leaves
+    explicit Bvh(const std::vector<Aabb>& bounds, BvhBuilder builder = BvhBuilder::Sah, float item_cost = 1);
+    explicit Bvh(const std::vector<std::unique_ptr<Primitive>>& primitives, BvhBuilder builder = BvhBuilder::Sah);
+
+    [[nodiscard]] const std::vector<BvhNode>& nodes() const { return _nodes; }
+    [[nodiscard]] const std::vector<int>& items() const { return _items; }
+    [[nodiscard]] const std::vector<int>& unbounded() const { return _unbounded; }
+
+    // nodes and items as they are, so that a hierarchy can be stored next to its items
+    void Serialize(ByteWriter& out) const;
+    // false if in doesn't hold a valid hierarchy over item_count items
+    bool Deserialize(ByteReader& in, int item_count);
+
+    [[nodiscard]] Aabb Bounds() const {
+        return _nodes.empty() ? Aabb {} : _nodes[0].bounds;
+    }
+
+    // Calls visit(item, &t_max) for items whose leaves are crossed by start + t * ray, t in [t_min, t_max],
+    // nearer nodes first. visit may lower t_max to skip farther nodes and returns false to stop
+    template <typename Visit>
+    void Traverse(const Vec3& start, const Vec3& ray, float t_min, float t_max, Visit&& visit) const {
+        const int root = 0;
+        TraverseFrom(&root, 1, start, ray, t_min, t_max, visit);
+    }
+
+    // Same as Traverse for the items under the nodes of cut, unbounded items are visited as well
+    template <typename Visit>
+    void Traverse(const BvhCut& cut, const Vec3& start, const Vec3& ray, float t_min, float t_max,
+                  Visit&& visit) const {
+        TraverseFrom(cut.nodes, cut.count, start, ray, t_min, t_max, visit);
+    }
+
+    // Same as Traverse for whole leaves: visit(first, count, &t_max) gets the range of items() in a leaf,
+    // unbounded items are not visited
+    template <typename Visit>
+    void TraverseLeaves(const Vec3& start, const Vec3& ray, float t_min, float t_max, Visit&& visit) const {
+        const int root = 0;
+        TraverseLeavesFrom(&root, 1, start, ray, t_min, t_max, visit);
+    }
+
+    // Fills cut with nodes covering the items in boxes classify(box) doesn't return Overlap::None for.
+    // Nodes are split into their children, shallower ones first, while classify returns Overlap::Partial for them
+    // and cut has room, so the cut is as tight as max_nodes allows
+    template <typename Classify>
+    void Cut(Classify&& classify, BvhCut* cut) const {
+        constexpr int size = BvhCut::max_nodes;
+        cut->count = 0;
+        if (_nodes.empty()) return;
+
+        // nodes waiting to be classified, they and the cut never take more than size slots together
+        int queue[size];
+        int head = 0, queued = 0;
+        queue[queued++] = 0;
+        while (queued > 0) {
+            const int index = queue[head];
+            head = (head + 1) % size;
+            queued--;
+            const BvhNode& node = _nodes[index];
+            const Overlap overlap = classify(node.bounds);
+            if (overlap == Overlap::None) continue;
+            if (overlap == Overlap::Partial && node.count == 0 && cut->count + queued + 2 <= size) {
+                queue[(head + queued++) % size] = node.first;
+                queue[(head + queued++) % size] = node.first + 1;
+                continue;
+            }
+            cut->nodes[cut->count++] = index;
+        }
+    }
+
+    // Any-hit query for a packet of up to max_packet rays sharing one traversal:
+    // calls visit(item, starts, rays, n, finished) with the n rays that are not done yet packed in order,
+    // visit sets finished[j] for the j-th of them when it is done and returns whether it finished any
+    // done has count flags, rays already done on input are skipped
+    template <typename Visit>
+    void TraversePacket(const Vec3* starts, const Vec3* rays, int count, float t_min, float t_max,
+                        bool* done, Visit&& visit) const {
+        // kept per thread, Vec3 arrays on the stack would be zeroed on every call, which costs more
+        // than the small packets of soft shadows take to trace
+        struct Packet {
+            Vec3 starts[max_packet];
+            Vec3 rays[max_packet];
+            Vec3 inv_rays[max_packet];
+            int ids[max_packet];
+            bool finished[max_packet];
+        };
+        thread_local Packet packet;
+        Vec3* const active_starts = packet.starts;
+        Vec3* const active_rays = packet.rays;
+        Vec3* const inv_rays = packet.inv_rays;
+        int* const ids = packet.ids;
+        bool* const finished = packet.finished;
+        int active = 0;
+        for (int k = 0; k < count; k++) {
+            if (done[k]) continue;
+            active_starts[active] = starts[k];
+            active_rays[active] = rays[k];
+            inv_rays[active] = Vec3 {1 / rays[k].x, 1 / rays[k].y, 1 / rays[k].z};
+            ids[active] = k;
+            finished[active] = false;
+            active++;
+        }
+        // rays visit finished leave the packet
+        auto visit_item = [&](int item) {
+            if (!visit(item, (const Vec3*) active_starts, (const Vec3*) active_rays, active, finished)) return;
+            int left = 0;
+            for (int j = 0; j < active; j++) {
+                if (finished[j]) {
+                    done[ids[j]] = true;
+                    continue;
+                }
+                active_starts[left] = active_starts[j];
+                active_rays[left] = active_rays[j];
+                inv_rays[left] = inv_rays[j];
+                ids[left] = ids[j];
+                finished[left] = false;
+                left++;
+            }
+            active = left;
+        };
+
+        for (int i = 0; i < _unbounded.size() && active > 0; i++) {
+            visit_item(_unbounded[i]);
+        }
+        if (_nodes.empty() || active == 0) return;
+
+        int stack[2 * max_depth];
+        int stack_size = 0;
+        stack[stack_size++] = 0;
+        while (stack_size > 0 && active > 0) {
+            const BvhNode& node = _nodes[stack[--stack_size]];
+            bool hit = false;
+            float t_near;
+            for (int j = 0; j < active && !hit; j++) {
+                hit = node.bounds.Intersect(active_starts[j], inv_rays[j], t_min, t_max, &t_near);
+            }
+            if (!hit) continue;
+
+            if (node.count == 0) {
+                stack[stack_size++] = node.first + 1;
+                stack[stack_size++] = node.first;
+                continue;
+            }
+            for (int i = node.first; i < node.first + node.count && active > 0; i++) {
+                visit_item(_items[i]);
+            }
+        }
+    }
+
+    // Calls visit(item) for items whose leaves contain point (boxes grown by eps)
+    template <typename Visit>
+    void VisitPoint(const Vec3& point, float eps, Visit&& visit) const {
+        for (int item: _unbounded) {
+            visit(item);
+        }
+        VisitPointLeaves(point, eps, [&](int first, int count) {
+            for (int i = first; i < first + count; i++) {
+                visit(_items[i]);
+            }
+        });
+    }
+
+    // Calls visit(first, count) for ranges of items() in leaves containing point, skips unbounded items
+    template <typename Visit>
+    void VisitPointLeaves(const Vec3& point, float eps, Visit&& visit) const {
+        if (_nodes.empty()) return;
+
+        int stack[2 * max_depth];
+        int stack_size = 0;
+        stack[stack_size++] = 0;
+        while (stack_size > 0) {
+            const BvhNode& node = _nodes[stack[--stack_size]];
+            if (!node.bounds.Contains(point, eps)) continue;
+            if (node.count == 0) {
+                stack[stack_size++] = node.first + 1;
+                stack[stack_size++] = node.first;
+                continue;
+            }
+            visit(node.first, node.count);
+        }
+    }
+};
+
+#endif //UNTITLED_RAYTRACING_BVH_H
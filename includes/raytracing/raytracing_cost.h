@@ -0,0 +1,35 @@
+//
+// Created by numi on 6/18/22.
+//
+
+#ifndef UNTITLED_RAYTRACING_COST_H
+#define UNTITLED_RAYTRACING_COST_H
+
+#include <string>
+
+#include "raytracing.h"
+
+enum class CostMetric : int {
+    Nanoseconds,
+    Intersections,
+    ShadowRays,
+    Bounces
+};
+
+float CostValue(const PixelCost& cost, CostMetric metric);
+
+// False color image of metric, blue for free pixels through cyan, green and yellow to red,
+// values are scaled by the 99th percentile so that a few outliers don't flatten the rest
+void CostHeatmap(const PixelCost* costs, int pixel_count, CostMetric metric, int* heatmap);
+
+// Heatmap over image with weight opacity in [0, 1], both rgba ints
+void BlendHeatmap(const int* image, const int* heatmap, int pixel_count, float opacity, int* result);
+
+// Writes path_prefix.ppm with the heatmap of metric and path_prefix.csv with all metrics,
+// one line per pixel, returns false and reports to stderr on failure
+bool SaveCostMap(const std::string& path_prefix,
+                 const PixelCost* costs,
+                 int width, int height,
+                 CostMetric metric);
+
+#endif //UNTITLED_RAYTRACING_COST_H
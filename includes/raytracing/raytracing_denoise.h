@@ -0,0 +1,26 @@
+//
+// Created by numi on 6/12/22.
+//
+
+#ifndef UNTITLED_RAYTRACING_DENOISE_H
+#define UNTITLED_RAYTRACING_DENOISE_H
+
+#include "raytracing.h"
+
+// Edge avoiding a-trous wavelet filter: pass i blurs pixels with a 5 x 5 B-spline kernel
+// whose taps are 2^i pixels apart, taps are weighted down across edges found from
+// primary hits (primitive, normal, distance from the tangent plane) and pixel colors
+// Background pixels are kept as they are
+void Denoise(int width, int height, const PixelHit* hits, Color* pixels, int passes);
+
+// ResolvePixels, Denoise and conversion to rgba, hits are those of the whole frame
+void ResolveDenoisedImage(const Color* intensities,
+                          const PixelHit* hits,
+                          int width, int height,
+                          int samples_per_pixel,
+                          int* image,
+                          const Color& background,
+                          int passes,
+                          Integrator integrator = Integrator::Whitted);
+
+#endif //UNTITLED_RAYTRACING_DENOISE_H
@@ -0,0 +1,40 @@
+//
+// Created by numi on 6/2/22.
+//
+
+#ifndef UNTITLED_RAYTRACING_DISTRIBUTED_H
+#define UNTITLED_RAYTRACING_DISTRIBUTED_H
+
+#include <string>
+
+#include "raytracing.h"
+
+// command line flag that makes an executable serve as a render worker,
+// followed by the descriptor of its socket to the coordinator
+constexpr const char* render_worker_flag = "--render-worker";
+
+struct DistributedOptions {
+    int workers = 0;
+    int tile_rows = 16;
+    // started as `worker_executable --render-worker <fd>`
+    std::string worker_executable = "/proc/self/exe";
+};
+
+// Same image as Raytracing, but rows are split into tiles traced by worker processes
+// The result doesn't depend on the number of workers or on the order tiles are finished in
+// Falls back to Raytracing if workers can't be started
+void RaytracingDistributed(const Camera& camera,
+                           const std::vector<Light>& light_sources,
+                           const std::vector<std::unique_ptr<Primitive>>& primitives,
+                           int* image, //sw x sh
+                           const DistributedOptions& options,
+                           int depth = 1,
+                           const Color& background = Color {0, 0, 0},
+                           const Color& ambient = Color {1, 1, 1},
+                           const RenderSettings& settings = RenderSettings {}
+                           );
+
+// Serves tiles requested through fd until the coordinator closes it, returns exit code
+int RunRenderWorker(int fd);
+
+#endif //UNTITLED_RAYTRACING_DISTRIBUTED_H
@@ -0,0 +1,75 @@
+//
+// Created by numi on 6/20/22.
+//
+
+#ifndef UNTITLED_RAYTRACING_FASTMATH_H
+#define UNTITLED_RAYTRACING_FASTMATH_H
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include "raytracing.h"
+
+// Approximations used by kernels when RenderSettings::fast_math is set
+
+// 1 / sqrt(x) for x > 0, relative error below 1e-6 with SSE and 5e-6 without it
+inline float FastRsqrt(float x) {
+#ifdef __SSE__
+    const float estimate = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+    // one Newton step doubles the 12 bits of the estimate
+    return estimate * (1.5f - 0.5f * x * estimate * estimate);
+#else
+    uint32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    bits = 0x5F375A86 - (bits >> 1);
+    float estimate;
+    memcpy(&estimate, &bits, sizeof(estimate));
+    estimate *= 1.5f - 0.5f * x * estimate * estimate;
+    return estimate * (1.5f - 0.5f * x * estimate * estimate);
+#endif
+}
+
+// x^power by squaring when power is a whole number up to max_int_power, powf otherwise
+constexpr int max_int_power = 1024;
+
+inline float FastPow(float x, float power) {
+    const int n = (int) power;
+    if ((float) n != power || n < 0 || n > max_int_power) return powf(x, power);
+    float result = 1;
+    for (int e = n; e > 0; e >>= 1) {
+        if (e & 1) result *= x;
+        x *= x;
+    }
+    return result;
+}
+
+// vector / length(vector)
+inline Vec3 FastNorm(const Vec3& vector) {
+    return vector * FastRsqrt(vector * vector);
+}
+
+// Difference between a fast and a precise render of the same frame
+struct FastMathReport {
+    double precise_seconds = 0; // tracing and resolving, the hierarchy is shared
+    double fast_seconds = 0;
+    int max_error = 0; // largest difference of a channel in 0..255
+    double mean_error = 0; // per channel
+    int differing_pixels = 0; // with any channel off by more than 1
+};
+
+// Renders the frame in both modes and compares the images, settings.fast_math is ignored
+FastMathReport ValidateFastMath(const Camera& camera,
+                                const std::vector<Light>& light_sources,
+                                const std::vector<std::unique_ptr<Primitive>>& primitives,
+                                int depth,
+                                const Color& background,
+                                const Color& ambient,
+                                const RenderSettings& settings);
+
+#endif //UNTITLED_RAYTRACING_FASTMATH_H
@@ -0,0 +1,33 @@
+//
+// Created by numi on 6/23/22.
+//
+
+#ifndef UNTITLED_RAYTRACING_FRUSTUM_H
+#define UNTITLED_RAYTRACING_FRUSTUM_H
+
+#include "raytracing.h"
+#include "raytracing_bvh.h"
+
+// Side of the square tiles of pixels whose primary rays share one culled set of primitives
+constexpr int cull_tile_size = 16;
+
+// Part of the view seen through a tile of the image between depths near_clip and zf along camera.z,
+// no far plane if zf isn't past near_clip
+class Frustum {
+private:
+    static constexpr int plane_count = 6;
+    // points p inside have normals[i] * p <= offsets[i] for all planes
+    Vec3 normals[plane_count];
+    float offsets[plane_count];
+public:
+    Frustum(const Camera& camera, const Tile& tile);
+
+    // conservative, boxes next to the edges of the frustum may be reported as overlapping it
+    [[nodiscard]] Overlap Classify(const Aabb& box) const;
+};
+
+// Nodes of bvh holding every bounded primitive that may be hit by primary rays of tile,
+// unbounded primitives aren't culled
+void CullTile(const Camera& camera, const Tile& tile, const Bvh& bvh, BvhCut* cut);
+
+#endif //UNTITLED_RAYTRACING_FRUSTUM_H
@@ -0,0 +1,87 @@
+//
+// Created by numi on 6/10/22.
+//
+
+#ifndef UNTITLED_RAYTRACING_INCREMENTAL_H
+#define UNTITLED_RAYTRACING_INCREMENTAL_H
+
+#include <vector>
+#include <memory>
+
+#include "raytracing.h"
+#include "raytracing_bvh.h"
+
+// Keeps sample intensities and primary hits of the last frame, so that after editing a few
+// primitives or lights only tiles whose pixels can see the change are traced again
+// Changes have to be reported before the next Render, anything else falls back to a full frame
+class RenderCache {
+private:
+    struct PrimitiveChange {
+        int index;
+        Aabb old_bounds;
+    };
+
+    struct LightChange {
+        int index;
+        Light old_light;
+    };
+
+    bool valid = false;
+    Camera camera {Vec3 {}, Vec3 {0, 0, 1}, Vec3 {0, 1, 0}, 0, 0, 0, 0};
+    RenderSettings settings;
+    int depth = 0;
+    Color ambient;
+    size_t light_count = 0;
+    size_t primitive_count = 0;
+    const VisibilityCache* visibility = nullptr;
+
+    Bvh bvh;
+    std::vector<Color> intensities;
+    std::vector<PixelHit> hits;
+    std::vector<PixelCost> costs;
+    std::vector<PrimitiveChange> primitive_changes;
+    std::vector<LightChange> light_changes;
+    int traced_tiles = 0;
+
+    void MarkPrimitive(const PrimitiveChange& change,
+                       const std::vector<Light>& light_sources,
+                       const std::vector<std::unique_ptr<Primitive>>& primitives,
+                       std::vector<bool>& dirty) const;
+    void MarkLight(const LightChange& change, const Light& new_light, std::vector<bool>& dirty) const;
+public:
+    static constexpr int tile_size = 16;
+
+    // same arguments and image as Raytracing, frames with another visibility cache are traced in full
+    void Render(const Camera& camera,
+                const std::vector<Light>& light_sources,
+                const std::vector<std::unique_ptr<Primitive>>& primitives,
+                int* image,
+                int depth = 1,
+                const Color& background = Color {0, 0, 0},
+                const Color& ambient = Color {1, 1, 1},
+                const RenderSettings& settings = RenderSettings {},
+                RenderStats* stats = nullptr,
+                const VisibilityCache* visibility = nullptr);
+
+    // primitive index was edited in place, old_bounds are its bounds before the edit
+    void PrimitiveChanged(int index, const Aabb& old_bounds) {
+        primitive_changes.push_back(PrimitiveChange {index, old_bounds});
+    }
+
+    // light index was edited in place, old_light is its value before the edit
+    void LightChanged(int index, const Light& old_light) {
+        light_changes.push_back(LightChange {index, old_light});
+    }
+
+    void InvalidateAll() {
+        valid = false;
+    }
+
+    // tiles traced by the last Render
+    [[nodiscard]] int last_traced_tiles() const { return traced_tiles; }
+
+    // cost of every pixel of the frame the last time it was traced, sw x sh
+    [[nodiscard]] const std::vector<PixelCost>& pixel_costs() const { return costs; }
+};
+
+#endif //UNTITLED_RAYTRACING_INCREMENTAL_H
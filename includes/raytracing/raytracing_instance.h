@@ -0,0 +1,145 @@
+//
+// Created by numi on 6/9/22.
+//
+
+#ifndef UNTITLED_RAYTRACING_INSTANCE_H
+#define UNTITLED_RAYTRACING_INSTANCE_H
+
+#include <vector>
+#include <memory>
+
+#include "raytracing.h"
+#include "raytracing_bvh.h"
+
+// Affine map point -> linear * point + translation, linear is stored by rows
+struct Transform {
+    Vec3 x {1, 0, 0};
+    Vec3 y {0, 1, 0};
+    Vec3 z {0, 0, 1};
+    Vec3 translation;
+
+    [[nodiscard]] Vec3 Vector(const Vec3& vec) const {
+        return Vec3 {x * vec, y * vec, z * vec};
+    }
+
+    [[nodiscard]] Vec3 Point(const Vec3& point) const {
+        return Vector(point) + translation;
+    }
+
+    // multiplies by the transposed linear part, maps local normals to world ones
+    // when called on the world to local transform
+    [[nodiscard]] Vec3 TransposedVector(const Vec3& vec) const {
+        return x * vec.x + y * vec.y + z * vec.z;
+    }
+
+    // this after other
+    [[nodiscard]] Transform operator*(const Transform& other) const {
+        const Vec3 column_x = Vector(other.Vector(Vec3 {1, 0, 0}));
+        const Vec3 column_y = Vector(other.Vector(Vec3 {0, 1, 0}));
+        const Vec3 column_z = Vector(other.Vector(Vec3 {0, 0, 1}));
+        return FromBasis(column_x, column_y, column_z, Point(other.translation));
+    }
+
+    [[nodiscard]] Transform Inverse() const;
+
+    // maps unit axes to the given vectors and the origin to origin
+    static Transform FromBasis(const Vec3& axis_x, const Vec3& axis_y, const Vec3& axis_z, const Vec3& origin) {
+        return Transform {
+                Vec3 {axis_x.x, axis_y.x, axis_z.x},
+                Vec3 {axis_x.y, axis_y.y, axis_z.y},
+                Vec3 {axis_x.z, axis_y.z, axis_z.z},
+                origin
+        };
+    }
+
+    static Transform Translation(const Vec3& offset) {
+        return Transform {Vec3 {1, 0, 0}, Vec3 {0, 1, 0}, Vec3 {0, 0, 1}, offset};
+    }
+
+    static Transform Scale(float factor) {
+        return Transform {Vec3 {factor, 0, 0}, Vec3 {0, factor, 0}, Vec3 {0, 0, factor}, Vec3 {}};
+    }
+
+    // rotation around the unit axis by angle in radians
+    static Transform Rotation(const Vec3& axis, float angle);
+};
+
+// Geometry shared by instances: primitives in local space with their own hierarchy
+// Materials of the primitives are not used, each instance has its own
+// Coarser levels of detail stand in for the primitives when rays are wider than the details they miss
+class Geometry {
+public:
+    // simplified version of the geometry, error is the size of the largest detail it misses in local units
+    struct Level {
+        std::shared_ptr<const Geometry> geometry;
+        float error = 0;
+    };
+private:
+    std::vector<std::unique_ptr<Primitive>> _primitives;
+    Bvh _bvh;
+    std::vector<Level> _levels;
+    // parts of level i, 0 being this geometry, are numbered from first_parts[i] on, the last entry ends them
+    std::vector<int> first_parts;
+    Aabb _bounds; // of all levels, simplified ones may reach a little past the primitives
+public:
+    // levels go from the finest to the coarsest, their own levels are not used
+    explicit Geometry(std::vector<std::unique_ptr<Primitive>> primitives, std::vector<Level> levels = {});
+
+    [[nodiscard]] const std::vector<std::unique_ptr<Primitive>>& primitives() const { return _primitives; }
+    [[nodiscard]] const std::vector<Level>& levels() const { return _levels; }
+    [[nodiscard]] Aabb Bounds() const { return _bounds; }
+
+    // level 0 is this geometry, the simplified ones follow
+    [[nodiscard]] int level_count() const { return (int) _levels.size() + 1; }
+    [[nodiscard]] const Geometry& LevelGeometry(int level) const {
+        return level == 0 ? *this : *_levels[level - 1].geometry;
+    }
+    // parts number the primitives of all levels one after another
+    [[nodiscard]] int parts() const { return first_parts.back(); }
+    [[nodiscard]] int first_part(int level) const { return first_parts[level]; }
+    [[nodiscard]] int LevelOf(int part) const;
+    // Coarsest level whose error is below width, u in [0, 1) moves the thresholds by up to half an octave
+    // either way, so that rays around a threshold mix both levels instead of switching all at once
+    [[nodiscard]] int Select(float width, float u) const;
+
+    // closest non-negative intersection like FindPrimitive
+    bool Intersection(const Vec3& start, const Vec3& ray, float* result) const;
+    // closest intersection from t_min on with hit->part set to the index of the primitive, skipped_part isn't hit
+    bool Intersect(const Vec3& start, const Vec3& ray, float t_min, int skipped_part, Hit* hit) const;
+    // primitive whose surface is the closest to point, point is expected to be on the surface
+    [[nodiscard]] const Primitive* Closest(const Vec3& point) const;
+};
+
+// Shared geometry placed into the scene through an affine transform
+// Rays are moved into geometry space instead of copying the primitives, the ray parameter
+// is preserved by the affine map, so intersections are comparable with other primitives
+class Instance : public Primitive {
+private:
+    std::shared_ptr<const Geometry> _geometry;
+    Transform to_world;
+    Transform to_local;
+    Material _material;
+    float stretch; // largest axis stretch of to_world, local widths are at least world widths divided by it
+public:
+    Instance(std::shared_ptr<const Geometry> geometry, const Transform& transform, const Material& material);
+
+    [[nodiscard]] const Material& material() const override { return _material; }
+    [[nodiscard]] const std::shared_ptr<const Geometry>& geometry() const { return _geometry; }
+    [[nodiscard]] const Transform& transform() const { return to_world; }
+    void Serialize(ByteWriter& out) const override;
+
+    bool Intersection(const Vec3 &start, const Vec3 &ray, float *result) const override {
+        return _geometry->Intersection(to_local.Point(start), to_local.Vector(ray), result);
+    }
+
+    // parts are the primitives of the levels of the geometry, rays leaving a part stay on its level
+    bool Intersect(const Vec3& start, const Vec3& ray, Hit* hit, int skipped_part, const RayCone& cone) const override;
+    void Complete(const Vec3& point, Hit* hit) const override;
+    [[nodiscard]] int parts() const override { return _geometry->parts(); }
+
+    [[nodiscard]] Vec3 Normal(const Vec3 &intersection) const override;
+    [[nodiscard]] Aabb Bounds() const override;
+    [[nodiscard]] float Distance(const Vec3& point) const override;
+};
+
+#endif //UNTITLED_RAYTRACING_INSTANCE_H
@@ -0,0 +1,68 @@
+//
+// Created by numi on 6/23/22.
+//
+
+#ifndef UNTITLED_RAYTRACING_LOADER_H
+#define UNTITLED_RAYTRACING_LOADER_H
+
+#include <vector>
+#include <memory>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#include "raytracing.h"
+#include "raytracing_bvh.h"
+
+// Part of a scene made or read by one loading step, appended to what came before it
+using LoadStep = std::function<void(std::vector<Light>* light_sources,
+                                    std::vector<std::unique_ptr<Primitive>>* primitives)>;
+
+// Runs loading steps one after another on a background thread, so that the scene can be shown
+// while it loads
+// Finished steps are handed over by Update, which also starts a hierarchy over everything handed over
+// so far on the same thread. The hierarchy is swapped in by a later Update once it is complete, until
+// then the one before it covers the primitives handed over before
+class SceneLoader {
+private:
+    struct Chunk {
+        std::vector<Light> light_sources;
+        std::vector<std::unique_ptr<Primitive>> primitives;
+    };
+
+    std::vector<LoadStep> steps;
+    const BvhBuilder builder;
+    std::mutex mutex;
+    std::condition_variable changed;
+    size_t next_step = 0;
+    size_t loaded_steps = 0;
+    std::deque<Chunk> finished; // loaded but not handed over yet
+    bool stopping = false;
+    // primitives of the caller the hierarchy is built for, they are not changed until it is swapped in
+    const std::vector<std::unique_ptr<Primitive>>* build_primitives = nullptr;
+    bool building = false;
+    std::unique_ptr<Bvh> built;
+    std::thread thread;
+
+    void Run();
+public:
+    SceneLoader(std::vector<LoadStep> steps, BvhBuilder builder = BvhBuilder::Sah);
+    // waits for the step running now, the ones after it are dropped
+    ~SceneLoader();
+
+    // Called between frames, appends lights and primitives of the steps finished since the last call,
+    // or replaces bvh with the one over everything appended once it is built
+    // Returns true if bvh was replaced, primitives must not change while a hierarchy is being built for them
+    bool Update(std::vector<Light>* light_sources, std::vector<std::unique_ptr<Primitive>>* primitives, Bvh* bvh);
+    // all steps are finished, handed over and covered by the last hierarchy swapped in
+    [[nodiscard]] bool done();
+};
+
+// Runs steps on the calling thread, for tools that need the whole scene before doing anything
+void LoadNow(const std::vector<LoadStep>& steps,
+             std::vector<Light>* light_sources,
+             std::vector<std::unique_ptr<Primitive>>* primitives);
+
+#endif //UNTITLED_RAYTRACING_LOADER_H
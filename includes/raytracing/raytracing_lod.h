@@ -0,0 +1,31 @@
+//
+// Created by numi on 6/23/22.
+//
+
+#ifndef UNTITLED_RAYTRACING_LOD_H
+#define UNTITLED_RAYTRACING_LOD_H
+
+#include <vector>
+#include <memory>
+
+#include "raytracing.h"
+#include "raytracing_instance.h"
+
+// Primitives clustered on a grid of cells of size cell: triangle corners in the same cell are welded at their
+// average and triangles left without area dropped, spheres with centers in the same cell, alone or in clouds,
+// are merged into one of the same volume, other primitives are copied
+std::vector<std::unique_ptr<Primitive>> Simplify(const std::vector<std::unique_ptr<Primitive>>& primitives,
+                                                 float cell);
+
+// Up to max_levels coarser versions of primitives for Geometry, each on cells twice as large as the one before
+// The first cells are twice the average size of the triangles and spheres, levels that hardly remove
+// anything are skipped
+std::vector<Geometry::Level> SimplifiedLevels(const std::vector<std::unique_ptr<Primitive>>& primitives,
+                                              int max_levels = 4);
+
+// Gives instances of geometry without levels and with at least min_parts parts SimplifiedLevels,
+// instances that shared a geometry share the one that replaces it. Smaller geometry costs too little
+// to trace for coarser levels to pay off. LoadScene and --save-scene call it, files then keep the levels
+void AddSimplifiedLevels(std::vector<std::unique_ptr<Primitive>>* primitives, size_t min_parts = 1024);
+
+#endif //UNTITLED_RAYTRACING_LOD_H
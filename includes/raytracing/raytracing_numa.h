@@ -0,0 +1,98 @@
+//
+// Created by numi on 6/16/22.
+//
+
+#ifndef UNTITLED_RAYTRACING_NUMA_H
+#define UNTITLED_RAYTRACING_NUMA_H
+
+#include <vector>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <sched.h>
+
+#include "raytracing.h"
+#include "raytracing_bvh.h"
+
+// Nodes are read from sysfs once, a machine without it is a single node
+int NumaNodeCount();
+// node of the cpu the calling thread runs on
+int CurrentNumaNode();
+
+// Binds the calling thread of an OpenMP team to a cpu while it is in scope, so that it stays next to
+// the memory it touched, the affinity the thread had before is restored at the end of the parallel region
+// Threads of a team are spread evenly over the cpus ordered by node
+// Nothing is done unless pin is set, when OpenMP binds threads itself (OMP_PROC_BIND or OMP_PLACES are set),
+// or for teams of one thread, which the render service runs side by side and would all stack on one cpu
+class TeamThreadPin {
+private:
+    cpu_set_t previous {};
+    bool pinned = false;
+public:
+    explicit TeamThreadPin(bool pin);
+    ~TeamThreadPin();
+    TeamThreadPin(const TeamThreadPin&) = delete;
+    TeamThreadPin& operator=(const TeamThreadPin&) = delete;
+};
+
+// Array of rows whose elements are constructed by the threads of a static parallel loop over rows,
+// the loop TraceRows uses, so that the pages of rows end up on the node of the thread tracing them
+template <typename T>
+class FirstTouchArray {
+private:
+    static_assert(std::is_trivially_destructible_v<T>);
+    T* _data = nullptr;
+    size_t _size = 0;
+public:
+    FirstTouchArray(int rows, size_t row_size, bool pin) {
+        _size = (size_t) rows * row_size;
+        if (_size == 0) return;
+        // allocating doesn't touch the pages
+        _data = static_cast<T*>(::operator new(_size * sizeof(T)));
+
+        T* const data = _data;
+        #pragma omp parallel
+        {
+            const TeamThreadPin pinned(pin);
+            #pragma omp for schedule(static)
+            for (int row = 0; row < rows; row++) {
+                for (size_t i = row * row_size; i < (row + 1) * row_size; i++) {
+                    new (data + i) T {};
+                }
+            }
+        }
+    }
+
+    ~FirstTouchArray() {
+        ::operator delete(_data);
+    }
+
+    FirstTouchArray(const FirstTouchArray&) = delete;
+    FirstTouchArray& operator=(const FirstTouchArray&) = delete;
+
+    T* data() { return _data; }
+    [[nodiscard]] size_t size() const { return _size; }
+    [[nodiscard]] bool empty() const { return _size == 0; }
+};
+
+// Copies of a scene and its hierarchy, each made by a thread running on the node it belongs to,
+// primitives keep their indices
+class SceneReplicas {
+public:
+    struct Replica {
+        std::vector<Light> light_sources;
+        std::vector<std::unique_ptr<Primitive>> primitives;
+        Bvh bvh;
+    };
+private:
+    std::vector<std::unique_ptr<Replica>> replicas; // by node, null if no thread ran on the node
+public:
+    SceneReplicas(const std::vector<Light>& light_sources,
+                  const std::vector<std::unique_ptr<Primitive>>& primitives,
+                  const Bvh& bvh);
+
+    // copy of the node of the calling thread, null if there isn't one
+    [[nodiscard]] const Replica* Local() const;
+};
+
+#endif //UNTITLED_RAYTRACING_NUMA_H
@@ -0,0 +1,38 @@
+//
+// Created by numi on 6/13/22.
+//
+
+#ifndef UNTITLED_RAYTRACING_PREVIEW_H
+#define UNTITLED_RAYTRACING_PREVIEW_H
+
+#include "raytracing.h"
+
+// Camera and settings of a preview frame, its sw x sh is scale times the full frame
+struct PreviewFrame {
+    Camera camera;
+    RenderSettings settings;
+    float scale;
+};
+
+// Picks resolution and samples of interactive frames so that they take about target_time
+// Cost of a frame is modelled as a fixed part (acceleration structure) plus a part
+// proportional to the number of traced samples, both measured from previous frames
+class PreviewController {
+private:
+    float scale = 0.25f;
+    int samples = 1;
+    double fixed_cost = 0; // seconds per frame
+    double sample_cost = 0; // seconds per sample, 0 until the first frame is measured
+public:
+    float target_time = 1.0f / 30;
+    float min_scale = 0.125f;
+    bool fast_math = true; // preview frames use the approximations even if the full frame doesn't
+
+    // the full frame camera scaled down, samples are at most those of settings
+    [[nodiscard]] PreviewFrame Plan(const Camera& camera, const RenderSettings& settings) const;
+
+    // learns costs from the stats of a rendered frame and picks the next resolution
+    void Update(const PreviewFrame& frame, const RenderStats& stats, const RenderSettings& settings);
+};
+
+#endif //UNTITLED_RAYTRACING_PREVIEW_H
@@ -0,0 +1,36 @@
+//
+// Created by numi on 6/17/22.
+//
+
+#ifndef UNTITLED_RAYTRACING_PROGRESSIVE_H
+#define UNTITLED_RAYTRACING_PROGRESSIVE_H
+
+#include <vector>
+#include <memory>
+
+#include "raytracing.h"
+
+struct BudgetReport {
+    int tiles = 0;
+    int refined_tiles = 0; // traced with all samples and the full depth
+    bool complete = false; // image is the same as Raytracing gives
+};
+
+// Renders within budget seconds of wall clock time, counted from the call
+// Every pixel is first traced with one sample and no reflections, whatever the budget,
+// then tiles are refined to the full depth and then to all samples, tiles with the most
+// contrast in the first pass go first at every step
+// When time runs out image holds the best result so far, tiles being traced are finished first
+BudgetReport RaytracingWithin(double budget,
+                              const Camera& camera,
+                              const std::vector<Light>& light_sources,
+                              const std::vector<std::unique_ptr<Primitive>>& primitives,
+                              int* image, //sw x sh
+                              int depth = 1,
+                              const Color& background = Color {0, 0, 0},
+                              const Color& ambient = Color {1, 1, 1},
+                              const RenderSettings& settings = RenderSettings {},
+                              RenderStats* stats = nullptr
+                              );
+
+#endif //UNTITLED_RAYTRACING_PROGRESSIVE_H
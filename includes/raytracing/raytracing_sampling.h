@@ -0,0 +1,111 @@
+//
+// Created by numi on 6/4/22.
+//
+
+#ifndef UNTITLED_RAYTRACING_SAMPLING_H
+#define UNTITLED_RAYTRACING_SAMPLING_H
+
+#include <cstdint>
+
+// All random numbers of a render are pure functions of (seed, pixel, sample, bounce, counter),
+// so images don't depend on thread count, scheduling or tile order
+
+enum class SamplePattern : int {
+    Grid = 0,   // regular n x n grid, no randomness
+    Random = 1,
+    Sobol = 2,
+    R2 = 3,
+};
+
+struct SampleKey {
+    uint32_t seed = 0;
+    uint32_t pixel = 0; // y * width + x of the full frame
+    uint32_t sample = 0; // index of the sample inside the pixel
+};
+
+// PCG output permutation used as a 32-bit hash
+inline uint32_t PcgHash(uint32_t value) {
+    const uint32_t state = value * 747796405u + 2891336453u;
+    const uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+// [0, 1) with 24 bits of precision, so the result is never rounded up to 1
+inline float UintToFloat(uint32_t value) {
+    return (float) (value >> 8) * (1.0f / 16777216.0f);
+}
+
+// Counter-based generator: the n-th number is hash(key, n), no state is shared between samples
+class SampleRng {
+private:
+    uint32_t _key;
+    uint32_t _counter = 0;
+public:
+    SampleRng(const SampleKey& key, uint32_t bounce):
+            _key {PcgHash(PcgHash(PcgHash(PcgHash(key.seed) + key.pixel) + key.sample) + bounce)} {}
+
+    uint32_t NextUint() {
+        return PcgHash(_key ^ PcgHash(_counter++));
+    }
+
+    float Next() {
+        return UintToFloat(NextUint());
+    }
+};
+
+// first two dimensions of the Sobol sequence
+inline uint32_t VanDerCorput(uint32_t index) {
+    index = (index << 16u) | (index >> 16u);
+    index = ((index & 0x00ff00ffu) << 8u) | ((index & 0xff00ff00u) >> 8u);
+    index = ((index & 0x0f0f0f0fu) << 4u) | ((index & 0xf0f0f0f0u) >> 4u);
+    index = ((index & 0x33333333u) << 2u) | ((index & 0xccccccccu) >> 2u);
+    index = ((index & 0x55555555u) << 1u) | ((index & 0xaaaaaaaau) >> 1u);
+    return index;
+}
+
+inline uint32_t Sobol2(uint32_t index) {
+    uint32_t result = 0;
+    for (uint32_t v = 1u << 31u; index; index >>= 1u, v ^= v >> 1u) {
+        if (index & 1u) result ^= v;
+    }
+    return result;
+}
+
+inline float Fraction(float value) {
+    return value - (float) (int) value;
+}
+
+// Point in [0, 1)^2 for sample key.sample out of grid_size x grid_size samples of a pixel
+// Low discrepancy sequences are randomized per pixel, so neighbouring pixels don't share the same pattern:
+// Sobol points get an XOR digital shift, which keeps them a (0, 2)-sequence, R2 points a Cranley-Patterson rotation
+inline void SamplePoint(SamplePattern pattern, const SampleKey& key, int grid_size, float* u, float* v) {
+    switch (pattern) {
+        case SamplePattern::Grid:
+            *u = ((float) (key.sample % grid_size) + 0.5f) / (float) grid_size;
+            *v = ((float) (key.sample / grid_size) + 0.5f) / (float) grid_size;
+            return;
+        case SamplePattern::Random: {
+            SampleRng rng(key, 0);
+            *u = rng.Next();
+            *v = rng.Next();
+            return;
+        }
+        case SamplePattern::Sobol: {
+            const uint32_t rotation = PcgHash(PcgHash(key.seed) + key.pixel);
+            *u = UintToFloat(VanDerCorput(key.sample) ^ rotation);
+            *v = UintToFloat(Sobol2(key.sample) ^ PcgHash(rotation));
+            return;
+        }
+        case SamplePattern::R2: {
+            // generalized golden ratio sequence, 1 / phi_2 and 1 / phi_2^2
+            const uint32_t rotation = PcgHash(PcgHash(key.seed) + key.pixel);
+            const float a1 = 0.7548776662f, a2 = 0.5698402910f;
+            *u = Fraction(UintToFloat(rotation) + a1 * (float) key.sample);
+            *v = Fraction(UintToFloat(PcgHash(rotation)) + a2 * (float) key.sample);
+            return;
+        }
+    }
+    *u = *v = 0.5f;
+}
+
+#endif //UNTITLED_RAYTRACING_SAMPLING_H
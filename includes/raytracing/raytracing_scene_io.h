@@ -0,0 +1,145 @@
+//
+// Created by numi on 6/2/22.
+//
+
+#ifndef UNTITLED_RAYTRACING_SCENE_IO_H
+#define UNTITLED_RAYTRACING_SCENE_IO_H
+
+#include <vector>
+#include <memory>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <unordered_map>
+
+#include "raytracing.h"
+
+// Binary scene format shared by workers of one render, all processes are expected
+// to run on machines with the same byte order and float layout
+class ByteWriter {
+private:
+    std::vector<char> _data;
+    std::unordered_map<const void*, uint32_t> _shared_ids;
+public:
+    template <typename T>
+    void Write(const T& value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        WriteBytes(&value, sizeof(T));
+    }
+
+    void WriteBytes(const void* bytes, size_t size) {
+        const size_t offset = _data.size();
+        _data.resize(offset + size);
+        memcpy(_data.data() + offset, bytes, size);
+    }
+
+    // Objects shared by several primitives are written once, later references only store the id
+    // Returns the id of object, first is set when the object has to be written after it
+    uint32_t SharedId(const void* object, bool* first) {
+        const auto [it, inserted] = _shared_ids.emplace(object, (uint32_t) _shared_ids.size());
+        *first = inserted;
+        return it->second;
+    }
+
+    [[nodiscard]] const std::vector<char>& data() const { return _data; }
+};
+
+// Reads values written by ByteWriter, every Read fails after the first failure
+class ByteReader {
+private:
+    const char* _position;
+    const char* _end;
+    bool _ok = true;
+    std::vector<std::shared_ptr<const void>> _shared;
+    uint32_t _announced = 0; // ids of shared objects read so far
+public:
+    ByteReader(const char* data, size_t size): _position {data}, _end {data + size} {}
+
+    template <typename T>
+    bool Read(T* value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        return ReadBytes(value, sizeof(T));
+    }
+
+    bool ReadBytes(void* bytes, size_t size) {
+        if (!_ok || (size_t) (_end - _position) < size) {
+            _ok = false;
+            return false;
+        }
+        memcpy(bytes, _position, size);
+        _position += size;
+        return true;
+    }
+
+    // ByteWriter gives out ids in the order objects are first written, so the id of an object
+    // written here has to be the next one. Ids come from the data and would size _shared otherwise
+    bool NewShared(uint32_t id) {
+        if (!_ok || id != _announced) {
+            _ok = false;
+            return false;
+        }
+        _announced++;
+        return true;
+    }
+
+    // id has to be one NewShared accepted
+    void SetShared(uint32_t id, std::shared_ptr<const void> object) {
+        if (id >= _announced) return;
+        if (id >= _shared.size()) _shared.resize(id + 1);
+        _shared[id] = std::move(object);
+    }
+
+    [[nodiscard]] std::shared_ptr<const void> Shared(uint32_t id) const {
+        return id < _shared.size() ? _shared[id] : nullptr;
+    }
+
+    [[nodiscard]] bool ok() const { return _ok; }
+    [[nodiscard]] bool at_end() const { return _position == _end; }
+    // bytes left to read, lengths read from the data are checked against it before anything is allocated
+    [[nodiscard]] size_t remaining() const { return (size_t) (_end - _position); }
+};
+
+enum class PrimitiveTag : uint8_t {
+    Sphere = 1,
+    Triangle = 2,
+    Instance = 3,
+    Plane = 4,
+    Quad = 5,
+    AABox = 6,
+    SphereCloud = 7,
+    StreamedMesh = 8,
+};
+
+void SerializeCamera(ByteWriter& out, const Camera& camera);
+bool DeserializeCamera(ByteReader& in, Camera* camera);
+
+void SerializeScene(ByteWriter& out,
+                    const std::vector<Light>& light_sources,
+                    const std::vector<std::unique_ptr<Primitive>>& primitives
+                    );
+
+// Appends lights and primitives read from in, returns false on malformed data
+bool DeserializeScene(ByteReader& in,
+                      std::vector<Light>* light_sources,
+                      std::vector<std::unique_ptr<Primitive>>* primitives
+                      );
+
+std::unique_ptr<Primitive> DeserializePrimitive(ByteReader& in);
+
+// Scene files hold what SerializeScene writes, both return false and report to stderr on failure
+bool SaveScene(const std::string& path,
+               const std::vector<Light>& light_sources,
+               const std::vector<std::unique_ptr<Primitive>>& primitives
+               );
+bool LoadScene(const std::string& path,
+               std::vector<Light>* light_sources,
+               std::vector<std::unique_ptr<Primitive>>* primitives
+               );
+
+// Binary PPM of an image of rgba ints as Raytracing makes them, alpha is dropped
+bool SavePpm(const std::string& path, const int* image, int width, int height);
+// Reads a binary PPM into rgba ints like the ones SavePpm writes, returns false and reports to stderr on failure
+bool LoadPpm(const std::string& path, std::vector<int>* image, int* width, int* height);
+
+#endif //UNTITLED_RAYTRACING_SCENE_IO_H
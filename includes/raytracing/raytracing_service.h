@@ -0,0 +1,107 @@
+//
+// Created by numi on 6/14/22.
+//
+
+#ifndef UNTITLED_RAYTRACING_SERVICE_H
+#define UNTITLED_RAYTRACING_SERVICE_H
+
+#include <string>
+#include <memory>
+#include <deque>
+#include <vector>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <unordered_map>
+
+#include "raytracing.h"
+#include "raytracing_bvh.h"
+
+// One image of a scene file, written to output_path as binary PPM
+struct RenderRequest {
+    std::string scene_path;
+    std::string output_path;
+    Vec3 eye {0, 0, 0};
+    Vec3 view {0, 0, 1};
+    Vec3 up {0, 1, 0};
+    int width = 320;
+    int height = 240;
+    float zn = 320; // in pixels like Camera::zn
+    float zf = 10000;
+    int depth = 1;
+    Color background {0, 0, 0};
+    Color ambient {0.01, 0.01, 0.01};
+    RenderSettings settings;
+
+    [[nodiscard]] Camera camera() const {
+        return Camera {eye, view, up, zn, zf, width, height};
+    }
+};
+
+struct RenderResult {
+    bool ok = false;
+    std::string error;
+    bool scene_cached = false; // scene and acceleration structure were already resident
+    double seconds = 0; // from the start of the job to the written image
+};
+
+// Parses "render scene=<path> out=<path> [key=value ...]", keys are the fields of RenderRequest
+// and of its settings, vectors and colors are written as x,y,z
+// Sizes are bounded: width and height up to 16384, depth up to 32 bounces, samples up to 64 per side,
+// denoise up to 8 passes
+bool ParseRenderRequest(const std::string& line, RenderRequest* request, std::string* error);
+
+// Keeps scenes loaded from files together with their hierarchies, and runs render jobs on
+// persistent threads, so that OpenMP teams are created once
+// Small jobs take one thread each and run side by side, large ones take all threads
+// Jobs start in submission order, a scene file is loaded again once it has been modified
+class RenderService {
+private:
+    struct CachedScene {
+        std::vector<Light> light_sources;
+        std::vector<std::unique_ptr<Primitive>> primitives;
+        long long modified = 0; // of the file it was loaded from
+        std::once_flag built[2];
+        Bvh bvh[2]; // by BvhBuilder
+    };
+
+    struct Job {
+        RenderRequest request;
+        int threads;
+        std::promise<RenderResult> result;
+    };
+
+    const int threads;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<Job> queue;
+    int free_threads;
+    bool stopping = false;
+    std::vector<std::thread> runners;
+    std::unordered_map<std::string, std::shared_ptr<CachedScene>> scenes;
+
+    void Run();
+    RenderResult Render(const RenderRequest& request);
+    // scene of path, loaded if it isn't resident or its file changed, nullptr if it can't be loaded
+    std::shared_ptr<CachedScene> Scene(const std::string& path, bool* cached);
+public:
+    // jobs with at most this many samples per frame run on a single thread
+    static constexpr int small_job_samples = 1 << 18;
+
+    explicit RenderService(int threads);
+    ~RenderService();
+    RenderService(const RenderService&) = delete;
+    RenderService& operator=(const RenderService&) = delete;
+
+    std::future<RenderResult> Submit(const RenderRequest& request);
+    // drops the scene of path, jobs already running keep their copy
+    void Unload(const std::string& path);
+};
+
+// Serves requests of lines through a Unix domain socket at socket_path until "shutdown",
+// a reply line is "ok <seconds> <cached|loaded>" or "error <message>"
+// Other commands are "unload scene=<path>" and "shutdown", returns exit code
+int RunRenderDaemon(const std::string& socket_path, int threads);
+
+#endif //UNTITLED_RAYTRACING_SERVICE_H
@@ -0,0 +1,102 @@
+//
+// Created by numi on 6/11/22.
+//
+
+#ifndef UNTITLED_RAYTRACING_SPHERE_CLOUD_H
+#define UNTITLED_RAYTRACING_SPHERE_CLOUD_H
+
+#include <vector>
+#include <memory>
+#include <string>
+#include <cstdint>
+
+#include "raytracing.h"
+#include "raytracing_bvh.h"
+
+enum class CloudStorage : uint8_t {
+    Float = 0,     // 16 bytes per sphere
+    Quantized = 1, // 8 bytes per sphere, 16 bits per coordinate relative to the cloud bounds
+};
+
+// Millions of spheres as one primitive: centers and radii are stored by components,
+// materials by index into a shared palette, no per sphere objects or virtual calls
+// Spheres are reordered so that every leaf of the hierarchy is a contiguous range,
+// leaves are intersected several spheres at a time
+class SphereCloud : public Primitive {
+public:
+    // components of the spheres in storage order, only the arrays of the storage are filled
+    struct Particles {
+        CloudStorage storage = CloudStorage::Float;
+        std::vector<float> x, y, z, radius;
+        std::vector<uint16_t> qx, qy, qz, qradius;
+        // quantized values map to origin + q * scale, radii to q * radius_scale
+        Vec3 origin, scale;
+        float radius_scale = 0;
+        std::vector<uint16_t> material;
+
+        [[nodiscard]] int size() const { return (int) material.size(); }
+    };
+private:
+    // spheres tested at once by the intersection kernel
+    static constexpr int kernel_width = 8;
+
+    Particles particles;
+    std::vector<Material> materials;
+    Bvh bvh;
+    float point_eps;
+    uint32_t id; // tells clouds apart in the per thread cache of the last hit
+
+    void Load(int first, int count, float* x, float* y, float* z, float* radius) const;
+    // closest intersection from t_min on and the sphere it is on, -1 if there is none, skipped isn't hit
+    [[nodiscard]] float Nearest(const Vec3& start, const Vec3& ray, float t_min, int skipped, int* index) const;
+    // sphere whose surface is the closest to point
+    [[nodiscard]] int Closest(const Vec3& point) const;
+public:
+    // material_indices may be empty, then all spheres use materials[0]
+    SphereCloud(const std::vector<Vec3>& centers,
+                const std::vector<float>& radii,
+                const std::vector<uint16_t>& material_indices,
+                std::vector<Material> materials,
+                CloudStorage storage = CloudStorage::Quantized);
+    SphereCloud(Particles particles, std::vector<Material> materials);
+
+    [[nodiscard]] const Material& material() const override { return materials[0]; }
+    [[nodiscard]] const Material& MaterialAt(const Vec3& point) const override;
+    void Serialize(ByteWriter& out) const override;
+
+    // closest non-negative intersection among the spheres
+    bool Intersection(const Vec3& start, const Vec3& ray, float* result) const override;
+    // parts are the spheres in storage order
+    bool Intersect(const Vec3& start, const Vec3& ray, Hit* hit, int skipped_part, const RayCone& cone) const override;
+    void Complete(const Vec3& point, Hit* hit) const override;
+    [[nodiscard]] int parts() const override { return size(); }
+    [[nodiscard]] Vec3 Normal(const Vec3& intersection) const override;
+    [[nodiscard]] Aabb Bounds() const override { return bvh.Bounds(); }
+    [[nodiscard]] float Distance(const Vec3& point) const override;
+
+    [[nodiscard]] int size() const { return particles.size(); }
+    [[nodiscard]] const Particles& data() const { return particles; }
+    // center and radius of sphere i in storage order
+    void SphereAt(int i, Vec3* center, float* radius) const {
+        Load(i, 1, &center->x, &center->y, &center->z, radius);
+    }
+    [[nodiscard]] const std::vector<Material>& palette() const { return materials; }
+};
+
+// Layout of fixed size records of a flat binary particle file, offsets are in bytes,
+// coordinates and radii are 32 bit floats, material indices 16 bit integers
+struct ParticleFileLayout {
+    int record_size = 16;
+    int x = 0, y = 4, z = 8;
+    int radius = 12; // -1 uses default_radius for all spheres
+    int material = -1; // -1 uses material 0 for all spheres
+    float default_radius = 1;
+};
+
+// Reads all records of path, returns nullptr if the file can't be read
+std::unique_ptr<SphereCloud> LoadSphereCloud(const std::string& path,
+                                             const ParticleFileLayout& layout,
+                                             std::vector<Material> materials,
+                                             CloudStorage storage = CloudStorage::Quantized);
+
+#endif //UNTITLED_RAYTRACING_SPHERE_CLOUD_H
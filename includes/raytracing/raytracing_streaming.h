@@ -0,0 +1,125 @@
+//
+// Created by numi on 6/19/22.
+//
+
+#ifndef UNTITLED_RAYTRACING_STREAMING_H
+#define UNTITLED_RAYTRACING_STREAMING_H
+
+#include <vector>
+#include <memory>
+#include <string>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+#include <type_traits>
+
+#include "raytracing.h"
+#include "raytracing_bvh.h"
+
+// Triangle record of a streamed mesh file, a, b, c are clockwise like the ones of Triangle
+struct StreamedTriangle {
+    Vec3 a, b, c;
+    uint32_t material = 0; // index into the palette of the mesh
+};
+static_assert(std::is_trivially_copyable_v<StreamedTriangle>);
+
+// Triangle mesh that stays in a memory mapped file, only the chunk table is kept in memory
+// Triangles are grouped into spatially coherent chunks stored with their hierarchies, a chunk is
+// paged in the first time a ray enters its bounds, least recently used chunks are dropped to keep the
+// resident chunks under memory_budget bytes
+// Rays test resident chunks first and page in the others only if they are still closer than the hit
+class StreamedMesh : public Primitive {
+public:
+    struct ChunkInfo {
+        Aabb bounds;
+        uint64_t offset = 0; // of the first triangle in the file, page aligned
+        uint32_t count = 0;
+        uint32_t bytes = 0; // of the triangles and the hierarchy over them that follows
+    };
+private:
+    struct Chunk;
+    struct Slot {
+        std::shared_ptr<const Chunk> chunk; // accessed with atomic_load and atomic_store
+        std::atomic<uint64_t> last_use {0};
+        bool loading = false;
+    };
+
+    std::string _path;
+    const char* map = nullptr;
+    size_t map_size = 0;
+    std::vector<Material> materials;
+    std::vector<ChunkInfo> chunks;
+    std::vector<uint32_t> first_triangles; // part of the first triangle of every chunk, then the triangle count
+    Bvh chunk_bvh;
+    size_t memory_budget;
+    float point_eps;
+    uint32_t id;
+
+    mutable std::unique_ptr<Slot[]> slots;
+    mutable std::mutex mutex; // guards loading flags and resident_bytes
+    mutable std::condition_variable chunk_loaded;
+    mutable size_t resident_bytes = 0;
+    mutable std::atomic<uint64_t> clock {0};
+    mutable std::atomic<uint64_t> loads {0};
+
+    // the chunk if it is resident, never blocks
+    [[nodiscard]] std::shared_ptr<const Chunk> Resident(int chunk) const;
+    // pages the chunk in if needed, threads asking for a chunk being loaded wait for that load
+    [[nodiscard]] std::shared_ptr<const Chunk> Acquire(int chunk) const;
+    // drops least recently used chunks other than kept until the budget is met, mutex is held
+    void Evict(int kept) const;
+    // closest hit from t_min on among the triangles of chunk other than skipped, lowers *min and sets *hit
+    bool IntersectChunk(const Chunk& chunk, const Vec3& start, const Vec3& ray, float t_min, int skipped,
+                        float* min, int* hit) const;
+    // triangle whose plane is the closest to point, its chunk is returned in holder
+    [[nodiscard]] const StreamedTriangle* Closest(const Vec3& point, std::shared_ptr<const Chunk>* holder) const;
+public:
+    // map holds map_size bytes mapped from path, the mesh unmaps it
+    StreamedMesh(std::string path,
+                 const char* map, size_t map_size,
+                 std::vector<Material> materials,
+                 std::vector<ChunkInfo> chunks,
+                 size_t memory_budget);
+    ~StreamedMesh() override;
+
+    StreamedMesh(const StreamedMesh&) = delete;
+    StreamedMesh& operator=(const StreamedMesh&) = delete;
+
+    [[nodiscard]] const Material& material() const override { return materials[0]; }
+    [[nodiscard]] const Material& MaterialAt(const Vec3& point) const override;
+    // writes the path and the budget, the file has to be reachable wherever the scene is read
+    void Serialize(ByteWriter& out) const override;
+
+    bool Intersection(const Vec3& start, const Vec3& ray, float* result) const override;
+    // parts number the triangles chunk after chunk
+    bool Intersect(const Vec3& start, const Vec3& ray, Hit* hit, int skipped_part, const RayCone& cone) const override;
+    void Complete(const Vec3& point, Hit* hit) const override;
+    [[nodiscard]] int parts() const override { return first_triangles.empty() ? 0 : (int) first_triangles.back(); }
+    [[nodiscard]] Vec3 Normal(const Vec3& intersection) const override;
+    [[nodiscard]] Aabb Bounds() const override { return chunk_bvh.Bounds(); }
+    [[nodiscard]] float Distance(const Vec3& point) const override;
+
+    [[nodiscard]] const std::string& path() const { return _path; }
+    [[nodiscard]] size_t budget() const { return memory_budget; }
+    [[nodiscard]] int chunk_count() const { return (int) chunks.size(); }
+    // bytes of triangles and hierarchies of resident chunks
+    [[nodiscard]] size_t resident() const;
+    // chunks paged in so far
+    [[nodiscard]] uint64_t chunk_loads() const { return loads; }
+};
+
+constexpr size_t default_stream_budget = 256 << 20;
+
+// Maps a file written by WriteStreamedMesh, returns nullptr and reports to stderr on failure
+std::unique_ptr<StreamedMesh> OpenStreamedMesh(const std::string& path, size_t memory_budget = default_stream_budget);
+
+// Splits triangles into chunks of about chunk_triangles along the leaf order of a hierarchy over them
+// and writes them with materials, returns false and reports to stderr on failure
+// All triangles are in memory here, conversion is meant to run once on a machine that can hold them
+bool WriteStreamedMesh(const std::string& path,
+                       const std::vector<StreamedTriangle>& triangles,
+                       const std::vector<Material>& materials,
+                       int chunk_triangles = 4096);
+
+#endif //UNTITLED_RAYTRACING_STREAMING_H
@@ -0,0 +1,135 @@
+//
+// Created by numi on 6/21/22.
+//
+
+#ifndef UNTITLED_RAYTRACING_TEXTURE_H
+#define UNTITLED_RAYTRACING_TEXTURE_H
+
+#include <vector>
+#include <memory>
+#include <string>
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <unordered_map>
+
+#include "raytracing.h"
+
+// Texels per side of a tile, a tile of rgba bytes is one 4 KiB page
+constexpr int texture_tile_size = 32;
+
+// Square block of texels stored in Morton order, so that texels close in the image are close in memory
+// in both directions, rgba packed like the pixels of Raytracing
+struct TextureTile {
+    uint32_t texels[texture_tile_size * texture_tile_size];
+};
+
+// Tiles of all textures using the cache, least recently used tiles are dropped to keep them under budget bytes
+// Tiles are found by a key made of the texture id and the tile index, keys of tiles a thread used last
+// are remembered by the thread, so most lookups take no lock
+class TextureCache {
+private:
+    static constexpr int shard_count = 16;
+    struct Entry {
+        std::shared_ptr<const TextureTile> tile;
+        std::list<uint64_t>::iterator lru;
+    };
+    // shards have their own lock and own share of the budget
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<uint64_t, Entry> entries;
+        std::list<uint64_t> lru; // most recently used first
+    };
+
+    size_t budget;
+    mutable Shard shards[shard_count];
+    mutable std::atomic<uint64_t> loads {0};
+public:
+    explicit TextureCache(size_t budget);
+
+    TextureCache(const TextureCache&) = delete;
+    TextureCache& operator=(const TextureCache&) = delete;
+
+    // the tile if it is cached, calls load(tile) to read it otherwise
+    // threads missing the same tile at once may both load it, the first one inserted is kept
+    template <typename Load>
+    std::shared_ptr<const TextureTile> Acquire(uint64_t key, Load&& load) const {
+        if (auto tile = Find(key)) return tile;
+        auto tile = std::make_shared<TextureTile>();
+        load(tile.get());
+        loads++;
+        return Insert(key, std::move(tile));
+    }
+
+    [[nodiscard]] size_t memory_budget() const { return budget; }
+    // bytes of cached tiles
+    [[nodiscard]] size_t resident() const;
+    // tiles read so far
+    [[nodiscard]] uint64_t tile_loads() const { return loads; }
+
+private:
+    [[nodiscard]] std::shared_ptr<const TextureTile> Find(uint64_t key) const;
+    std::shared_ptr<const TextureTile> Insert(uint64_t key, std::shared_ptr<const TextureTile> tile) const;
+};
+
+constexpr size_t default_texture_budget = 64 << 20;
+
+// Cache shared by textures opened without one, budget is default_texture_budget
+const std::shared_ptr<TextureCache>& DefaultTextureCache();
+
+// Mip mapped image in a file written by WriteTexture, tiles are read when sampling first reaches them
+class Texture {
+public:
+    struct Level {
+        uint32_t width = 0, height = 0;
+        uint32_t tiles_x = 0, tiles_y = 0; // tiles are stored row by row
+        uint64_t offset = 0; // of the first tile in the file, page aligned
+    };
+private:
+    std::string _path;
+    int fd;
+    std::vector<Level> levels;
+    std::vector<uint32_t> first_tiles; // index of the first tile of every level among all tiles
+    std::shared_ptr<TextureCache> cache;
+    uint32_t id;
+
+    // rgba of texel (x, y) of level, coordinates wrap around
+    [[nodiscard]] uint32_t Texel(int level, int x, int y) const;
+    [[nodiscard]] Color Bilinear(int level, float u, float v) const;
+public:
+    // fd is open for reading, the texture closes it
+    Texture(std::string path, int fd, std::vector<Level> levels, std::shared_ptr<TextureCache> cache);
+    ~Texture();
+
+    Texture(const Texture&) = delete;
+    Texture& operator=(const Texture&) = delete;
+
+    // Trilinear sample at (u, v) averaging texels over a footprint wide square of texture coordinates,
+    // the texture repeats outside [0, 1]
+    [[nodiscard]] Color Sample(float u, float v, float footprint) const;
+
+    [[nodiscard]] const std::string& path() const { return _path; }
+    [[nodiscard]] int width() const { return (int) levels[0].width; }
+    [[nodiscard]] int height() const { return (int) levels[0].height; }
+    [[nodiscard]] int level_count() const { return (int) levels.size(); }
+    [[nodiscard]] const std::shared_ptr<TextureCache>& texture_cache() const { return cache; }
+};
+
+// Opens a file written by WriteTexture, returns nullptr and reports to stderr on failure
+std::shared_ptr<Texture> OpenTexture(const std::string& path,
+                                     std::shared_ptr<TextureCache> cache = DefaultTextureCache());
+
+// Writes width x height rgba pixels (as Raytracing and LoadPpm make them) with all their mip levels,
+// returns false and reports to stderr on failure
+bool WriteTexture(const std::string& path, const int* image, int width, int height);
+
+// Image maps of a surface, texels scale the colors of its material, missing maps leave them as they are
+struct SurfaceTextures {
+    std::shared_ptr<const Texture> diffuse;
+    std::shared_ptr<const Texture> specular;
+
+    [[nodiscard]] Material Apply(const Material& material, const TexCoord& uv, float footprint) const;
+};
+
+#endif //UNTITLED_RAYTRACING_TEXTURE_H
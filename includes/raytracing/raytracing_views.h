@@ -0,0 +1,52 @@
+//
+// Created by numi on 6/15/22.
+//
+
+#ifndef UNTITLED_RAYTRACING_VIEWS_H
+#define UNTITLED_RAYTRACING_VIEWS_H
+
+#include <vector>
+#include <memory>
+
+#include "raytracing.h"
+
+// One of the frames of a multi-view render
+struct View {
+    Camera camera;
+    int* image; // camera.sw x camera.sh
+};
+
+// Renders several views of one scene (turntables, cubemap faces, stereo pairs), every image is
+// the same as Raytracing gives for its camera
+// The hierarchy is built once, tiles of all views are interleaved in one parallel loop,
+// so small views don't leave threads idle, and sample buffers are kept between calls
+class MultiViewRenderer {
+private:
+    std::vector<Color> intensities;
+    std::vector<PixelHit> hits;
+    std::vector<ViewTile> tiles;
+public:
+    static constexpr int tile_size = 16;
+
+    void Render(const std::vector<View>& views,
+                const std::vector<Light>& light_sources,
+                const std::vector<std::unique_ptr<Primitive>>& primitives,
+                int depth = 1,
+                const Color& background = Color {0, 0, 0},
+                const Color& ambient = Color {1, 1, 1},
+                const RenderSettings& settings = RenderSettings {},
+                RenderStats* stats = nullptr);
+
+    // with bvh built over primitives beforehand, stats->build is left as is
+    void Render(const std::vector<View>& views,
+                const std::vector<Light>& light_sources,
+                const std::vector<std::unique_ptr<Primitive>>& primitives,
+                const Bvh& bvh,
+                int depth,
+                const Color& background,
+                const Color& ambient,
+                const RenderSettings& settings,
+                RenderStats* stats = nullptr);
+};
+
+#endif //UNTITLED_RAYTRACING_VIEWS_H
@@ -0,0 +1,138 @@
+//
+// Created by numi on 6/22/22.
+//
+
+#ifndef UNTITLED_RAYTRACING_VISIBILITY_H
+#define UNTITLED_RAYTRACING_VISIBILITY_H
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+
+#include "raytracing.h"
+#include "raytracing_bvh.h"
+
+// Shadow answers for point lights of a static scene, kept at the corners of a grid of cells over the scene
+// A corner is stored per primitive and tested ignoring that primitive, as IsHidden does for points on it
+// Corners are filled in by renders the first time shading reaches their cells and stay valid while
+// the lights and primitives are unchanged, so frames from other viewpoints reuse them
+// Points whose cell corners disagree lie near a shadow boundary and are left to exact shadow rays
+// Corners can't see occluders narrower than a cell, so a light counts as visible only if no other
+// primitive's bounds reach into the volume between the cell and the light, which makes it exact
+// Hidden answers still come from agreeing corners, light through gaps narrower than a cell is missed
+class VisibilityCache {
+public:
+    // lights past this index always get shadow rays, bit 63 of an entry marks it as filled in
+    static constexpr int max_lights = 63;
+private:
+    static constexpr uint64_t ready = 1ull << 63;
+    static constexpr int coordinate_bits = 14;
+    // the top bit of a key tells cell entries, which hold the clear lights of a cell, from corners
+    static constexpr uint64_t cell_entry = 1ull << 63;
+    static constexpr int primitive_bits = 63 - 3 * coordinate_bits;
+    // pieces of the volume between a cell and a light tested for occluders
+    static constexpr int sweep_steps = 8;
+    // slots probed before an entry is given up on, the point then gets exact shadow rays
+    static constexpr int max_probes = 32;
+
+    std::vector<Light> lights;
+    std::vector<Aabb> bounds;
+    // planes of triangles and planes, normals are 0 for other primitives
+    std::vector<Vec3> plane_points;
+    std::vector<Vec3> plane_normals;
+    Bvh occluders; // over bounds
+    Vec3 origin;
+    float inv_cell = 0;
+    int resolution = 0;
+    uint64_t point_lights = 0; // bits of the lights the cache answers for
+
+    size_t slot_mask;
+    std::unique_ptr<std::atomic<uint64_t>[]> keys;
+    std::unique_ptr<std::atomic<uint64_t>[]> values;
+    mutable std::atomic<uint64_t> filled {0};
+
+    // hidden lights of corner key, false if it isn't stored and can't be
+    template <typename Trace>
+    bool Corner(uint64_t key, const Vec3& position, Trace&& trace, uint64_t* hidden) const {
+        size_t slot = (size_t) PcgHash((uint32_t) key ^ PcgHash((uint32_t) (key >> 32))) & slot_mask;
+        for (int probe = 0; probe < max_probes; probe++, slot = (slot + 1) & slot_mask) {
+            uint64_t stored = keys[slot].load(std::memory_order_acquire);
+            if (stored == 0) {
+                if (keys[slot].compare_exchange_strong(stored, key, std::memory_order_acq_rel)) {
+                    *hidden = trace(position);
+                    values[slot].store(*hidden | ready, std::memory_order_release);
+                    filled++;
+                    return true;
+                }
+                // another thread took the slot, stored holds its key now
+            }
+            if (stored == key) {
+                // a corner another thread is still tracing isn't waited for
+                const uint64_t value = values[slot].load(std::memory_order_acquire);
+                *hidden = value & ~ready;
+                return (value & ready) != 0;
+            }
+        }
+        return false;
+    }
+
+    // Point lights whose volume swept from the part of cell x, y, z in the bounds of primitive holds
+    // no other primitive. Primitive itself is left out, the cache only answers for points of simple
+    // primitives and IsHidden skips them for their own points
+    [[nodiscard]] uint64_t ClearLights(uint64_t x, uint64_t y, uint64_t z, int primitive) const;
+public:
+    // resolution is the number of cells along the longest side of the bounds of finite primitives,
+    // capacity is the number of corners that can be stored, rounded up to a power of 2
+    VisibilityCache(const std::vector<Light>& light_sources,
+                    const std::vector<std::unique_ptr<Primitive>>& primitives,
+                    int resolution = 256,
+                    size_t capacity = 1 << 21);
+
+    VisibilityCache(const VisibilityCache&) = delete;
+    VisibilityCache& operator=(const VisibilityCache&) = delete;
+
+    // true if the cache was made for these lights and primitives as they are now
+    [[nodiscard]] bool Matches(const std::vector<Light>& light_sources,
+                               const std::vector<std::unique_ptr<Primitive>>& primitives) const;
+
+    // Sets bit i of known for point lights i that nothing can hide from the part of primitives[primitive] in the
+    // cell of point, or that are hidden at all corners of the cell, bit i of hidden tells if they are hidden.
+    // trace(corner) returns the mask of point lights hidden from corner and is called for corners seen for the first time
+    template <typename Trace>
+    void Lookup(const Vec3& point, int primitive, Trace&& trace, uint64_t* known, uint64_t* hidden) const {
+        *known = 0;
+        *hidden = 0;
+        if (resolution == 0 || (uint64_t) primitive + 1 >= (1ull << primitive_bits)) return;
+        const Vec3 cell = (point - origin) * inv_cell;
+        if (!(cell.x >= 0 && cell.y >= 0 && cell.z >= 0)) return;
+        const float limit = (float) resolution;
+        if (!(cell.x < limit && cell.y < limit && cell.z < limit)) return;
+
+        const uint64_t x = (uint64_t) cell.x, y = (uint64_t) cell.y, z = (uint64_t) cell.z;
+        const uint64_t cell_key = cell_entry | (((uint64_t) primitive + 1) << (3 * coordinate_bits))
+                | (x << (2 * coordinate_bits)) | (y << coordinate_bits) | z;
+        uint64_t clear;
+        if (!Corner(cell_key, point, [&](const Vec3&) { return ClearLights(x, y, z, primitive); }, &clear)) return;
+
+        uint64_t all_hidden = ~0ull;
+        for (int corner = 0; corner < 8; corner++) {
+            const uint64_t cx = x + (corner & 1), cy = y + ((corner >> 1) & 1), cz = z + (corner >> 2);
+            const uint64_t key = (((uint64_t) primitive + 1) << (3 * coordinate_bits))
+                    | (cx << (2 * coordinate_bits)) | (cy << coordinate_bits) | cz;
+            const Vec3 position = origin + Vec3 {(float) cx, (float) cy, (float) cz} / inv_cell;
+            uint64_t corner_hidden;
+            if (!Corner(key, position, trace, &corner_hidden)) return;
+            all_hidden &= corner_hidden;
+        }
+        // agreeing lit corners are only a guess, a thin occluder may cast its shadow between them
+        *known = (clear | all_hidden) & point_lights;
+        *hidden = all_hidden & ~clear & *known;
+    }
+
+    // corners stored so far
+    [[nodiscard]] uint64_t corners() const { return filled; }
+    [[nodiscard]] size_t capacity() const { return slot_mask + 1; }
+};
+
+#endif //UNTITLED_RAYTRACING_VISIBILITY_H
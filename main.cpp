@@ -3,6 +3,7 @@
 #include <GLFW/glfw3.h>
 
 #include <iostream>
+#include <cstring>
 #include <omp.h>
 
 #include "imgui.h"
@@ -10,6 +11,18 @@
 #include "imgui_impl_opengl3.h"
 
 #include "raytracing.h"
+#include "raytracing_distributed.h"
+#include "raytracing_incremental.h"
+#include "raytracing_sphere_cloud.h"
+#include "raytracing_preview.h"
+#include "raytracing_scene_io.h"
+#include "raytracing_cost.h"
+#include "raytracing_streaming.h"
+#include "raytracing_fastmath.h"
+#include "raytracing_texture.h"
+#include "raytracing_visibility.h"
+#include "raytracing_loader.h"
+#include "raytracing_lod.h"
 
 void error_callback(int error, const char* description) {
     std::cerr << "Error: " << description << '\n';
@@ -52,6 +65,31 @@ struct Scene {
     float zoom_factor = 1.0;
     float azimuth = 0.0;
     float attitude = 0.0;
+    int workers = 0; // render worker processes, 0 renders in this process
+    RenderSettings settings;
+    RenderCache cache; // last frame, edits made through the GUI re-render only affected tiles
+    int selected_light = 0;
+    // while the camera moves frames are rendered at a resolution that keeps up with target_time,
+    // the full frame follows once it stays still for settle_time
+    bool live_preview = false;
+    PreviewController preview;
+    float settle_time = 0.25f;
+    double last_move = 0;
+    bool refine = false;
+    // top left part of the texture filled by the last frame
+    int shown_width = image_width;
+    int shown_height = image_height;
+    // false color cost of every pixel over full frames rendered in this process
+    bool show_costs = false;
+    CostMetric cost_metric = CostMetric::Nanoseconds;
+    float cost_opacity = 0.6f;
+    // shadows of point lights kept between frames, made again once lights or primitives change
+    bool cache_shadows = false;
+    std::unique_ptr<VisibilityCache> visibility;
+    // primitives are handed over in chunks while the window is already open, frames rendered until
+    // the last chunk arrives use the hierarchy of the loader, it is dropped once everything is in
+    std::unique_ptr<SceneLoader> loader;
+    Bvh loaded_bvh;
 
     [[nodiscard]] Camera camera() const {
         const float radius = (view - eye).length();
@@ -91,13 +129,13 @@ struct Box {
     }
 };
 
+// a, b, c, d are clockwise corners of a parallelogram
 void FillSquare(std::vector<std::unique_ptr<Primitive>>& primitives,
                 const Material& material,
-                const Vec3& a, const Vec3& b, const Vec3& c, const Vec3& d,
-                bool first_exclude = false
+                const Vec3& a, const Vec3& b, const Vec3& c, const Vec3& d
 ) {
-    primitives.push_back(std::make_unique<Triangle>(a, b, c, material, first_exclude));
-    primitives.push_back(std::make_unique<Triangle>(a, c, d, material, !first_exclude));
+    // normal is (d - a) x (b - a) like the one of Triangle(a, b, c)
+    primitives.push_back(std::make_unique<Quad>(a, d - a, b - a, material));
 }
 
 // Fills a box opened from front plane (orthogonal to z, with minimum z)
@@ -131,8 +169,7 @@ void FillBoxScene(std::vector<std::unique_ptr<Primitive>>& primitives,
                front_low_left,
                front_up_left,
                back_up_left,
-               back_low_left,
-               true
+               back_low_left
     );
     // Water tank
     FillSquare(primitives,
@@ -273,6 +310,121 @@ void FillScene(
                       });
 }
 
+// The shadow cache of the scene as it is now, nullptr if shadows aren't cached
+const VisibilityCache* Visibility(Scene& scene) {
+    if (!scene.cache_shadows) {
+        scene.visibility.reset();
+        return nullptr;
+    }
+    if (!scene.visibility || !scene.visibility->Matches(scene.sources, scene.primitives)) {
+        scene.visibility = std::make_unique<VisibilityCache>(scene.sources, scene.primitives);
+    }
+    return scene.visibility.get();
+}
+
+void Render(Scene& scene, int* image, RenderStats* stats = nullptr) {
+    if (scene.loader && scene.workers == 0) {
+        // the render cache would build a hierarchy of its own on this thread
+        scene.cache.InvalidateAll();
+        Raytracing(scene.camera(),
+                   scene.sources,
+                   scene.primitives,
+                   scene.loaded_bvh,
+                   image,
+                   scene.depth,
+                   scene.background,
+                   scene.ambient,
+                   scene.settings,
+                   stats,
+                   nullptr,
+                   Visibility(scene)
+        );
+        return;
+    }
+    if (scene.workers > 0) {
+        scene.cache.InvalidateAll();
+        DistributedOptions options;
+        options.workers = scene.workers;
+        RaytracingDistributed(scene.camera(),
+                              scene.sources,
+                              scene.primitives,
+                              image,
+                              options,
+                              scene.depth,
+                              scene.background,
+                              scene.ambient,
+                              scene.settings
+        );
+        return;
+    }
+    scene.cache.Render(scene.camera(),
+                       scene.sources,
+                       scene.primitives,
+                       image,
+                       scene.depth,
+                       scene.background,
+                       scene.ambient,
+                       scene.settings,
+                       stats,
+                       Visibility(scene)
+    );
+}
+
+void RenderPreview(Scene& scene, int* image) {
+    const PreviewFrame frame = scene.preview.Plan(scene.camera(), scene.settings);
+    RenderStats stats;
+    if (scene.loader) {
+        Raytracing(frame.camera,
+                   scene.sources,
+                   scene.primitives,
+                   scene.loaded_bvh,
+                   image,
+                   scene.depth,
+                   scene.background,
+                   scene.ambient,
+                   frame.settings,
+                   &stats,
+                   nullptr,
+                   Visibility(scene)
+        );
+    } else {
+        Raytracing(frame.camera,
+                   scene.sources,
+                   scene.primitives,
+                   image,
+                   scene.depth,
+                   scene.background,
+                   scene.ambient,
+                   frame.settings,
+                   &stats,
+                   nullptr,
+                   Visibility(scene)
+        );
+    }
+    scene.preview.Update(frame, stats, scene.settings);
+    scene.shown_width = frame.camera.sw;
+    scene.shown_height = frame.camera.sh;
+}
+
+// Uploads a full frame, with the cost heatmap over it if it is shown and there are costs for it
+void ShowFrame(const Scene& scene, GLuint texture_id, int* image) {
+    const int pixel_count = image_width * image_height;
+    const std::vector<PixelCost>& costs = scene.cache.pixel_costs();
+    if (!scene.show_costs || scene.workers > 0 || costs.size() != pixel_count) {
+        UpdateTexture(texture_id, image, image_width, image_height);
+        return;
+    }
+    std::vector<int> overlay(pixel_count);
+    CostHeatmap(costs.data(), pixel_count, scene.cost_metric, overlay.data());
+    BlendHeatmap(image, overlay.data(), pixel_count, scene.cost_opacity, overlay.data());
+    UpdateTexture(texture_id, overlay.data(), image_width, image_height);
+}
+
+void PrintStats(const RenderStats& stats) {
+    std::cout << "build " << stats.build << " (" << stats.nodes << " nodes), trace " << stats.trace
+              << ", resolve " << stats.resolve << '\n';
+}
+
 void AppGUI(Scene& scene, GLuint texture_id, int* image) {
     ImGui::SetNextWindowSize(ImVec2 {});
     ImGui::SetNextWindowPos(ImVec2 {});
@@ -281,36 +433,110 @@ void AppGUI(Scene& scene, GLuint texture_id, int* image) {
     ImGui::BeginGroup();
 
     ImGui::PushItemWidth(-image_width);
-    ImGui::InputFloat("Znear", &scene.zn);
-    ImGui::InputFloat("Zoom factor", &scene.zoom_factor);
-    ImGui::InputFloat("Azimuth", &scene.azimuth);
-    ImGui::InputFloat("Attitude", &scene.attitude);
+    bool camera_moved = ImGui::InputFloat("Znear", &scene.zn);
+    camera_moved |= ImGui::InputFloat("Zfar", &scene.zf);
+    camera_moved |= ImGui::DragFloat("Zoom factor", &scene.zoom_factor, 0.01f, 0.01f, 100.0f);
+    camera_moved |= ImGui::DragFloat("Azimuth", &scene.azimuth);
+    camera_moved |= ImGui::DragFloat("Attitude", &scene.attitude);
     ImGui::InputInt("Depth", &scene.depth);
+    ImGui::InputInt("Samples", &scene.settings.samples);
+    ImGui::Combo("Sampling", (int*) &scene.settings.pattern, "Grid\0Random\0Sobol\0R2\0");
+    ImGui::InputInt("Seed", (int*) &scene.settings.seed);
+    ImGui::Combo("BVH", (int*) &scene.settings.builder, "SAH\0LBVH\0");
+    ImGui::InputInt("Denoise", &scene.settings.denoise);
+    ImGui::Combo("NUMA", (int*) &scene.settings.numa, "Off\0Local\0Replicated\0");
+    ImGui::Checkbox("Fast math", &scene.settings.fast_math);
+    ImGui::Combo("Integrator", (int*) &scene.settings.integrator, "Whitted\0Path tracing\0");
+    ImGui::Checkbox("Shadow cache", &scene.cache_shadows);
+    if (scene.settings.samples < 1) scene.settings.samples = 1;
+    if (scene.settings.denoise < 0) scene.settings.denoise = 0;
+    ImGui::Checkbox("Live preview", &scene.live_preview);
+    ImGui::InputFloat("Frame time", &scene.preview.target_time);
+    if (scene.preview.target_time < 0.001f) scene.preview.target_time = 0.001f;
+    bool overlay_changed = ImGui::Checkbox("Cost heatmap", &scene.show_costs);
+    overlay_changed |= ImGui::Combo("Cost", (int*) &scene.cost_metric, "Time\0Intersections\0Shadow rays\0Bounces\0");
+    overlay_changed |= ImGui::SliderFloat("Heatmap opacity", &scene.cost_opacity, 0.0f, 1.0f);
+
+    // moving a light re-renders right away, only tiles it can reach are traced again
+    bool light_moved = false;
+    if (!scene.sources.empty()) {
+        ImGui::SliderInt("Light", &scene.selected_light, 0, (int) scene.sources.size() - 1);
+        scene.selected_light = std::max(0, std::min(scene.selected_light, (int) scene.sources.size() - 1));
+        Light& light = scene.sources[scene.selected_light];
+        const Light old_light = light;
+        if (ImGui::DragFloat3("Light position", &light.position.x)) {
+            scene.cache.LightChanged(scene.selected_light, old_light);
+            light_moved = true;
+        }
+    }
 
-    if (ImGui::Button("Render")) {
+    const double now = omp_get_wtime();
+    if (scene.live_preview && camera_moved) {
+        RenderPreview(scene, image);
+        UpdateTexture(texture_id, image, scene.shown_width, scene.shown_height);
+        scene.last_move = now;
+        scene.refine = true;
+    }
+    const bool settled = scene.refine && !camera_moved && now - scene.last_move >= scene.settle_time;
+
+    if (ImGui::Button("Render") || light_moved || settled) {
+        scene.refine = false;
         const double start = omp_get_wtime();
-        Raytracing(scene.camera(),
-                   scene.sources,
-                   scene.primitives,
-                   image,
-                   scene.depth,
-                   scene.background,
-                   scene.ambient
-        );
-        UpdateTexture(texture_id, image, image_width, image_height);
+        RenderStats stats;
+        Render(scene, image, &stats);
         const double end = omp_get_wtime();
+        ShowFrame(scene, texture_id, image);
+        scene.shown_width = image_width;
+        scene.shown_height = image_height;
         auto time = end - start;
         std::cout << time << '\n';
+        if (scene.workers == 0) PrintStats(stats);
+    } else if (overlay_changed && scene.shown_width == image_width && scene.shown_height == image_height) {
+        ShowFrame(scene, texture_id, image);
     }
 
     ImGui::EndGroup();
     ImGui::SameLine();
-    ImGui::Image((void*)(intptr_t) texture_id, ImVec2(image_width, image_height));
+    // a preview fills the top left corner of the texture and is stretched by texture filtering,
+    // its uvs are at texel centers so that nothing outside of it is sampled
+    ImVec2 uv0 {0, 0}, uv1 {1, 1};
+    if (scene.shown_width != image_width || scene.shown_height != image_height) {
+        uv0 = ImVec2(0.5f / image_width, 0.5f / image_height);
+        uv1 = ImVec2((scene.shown_width - 0.5f) / image_width, (scene.shown_height - 0.5f) / image_height);
+    }
+    ImGui::Image((void*)(intptr_t) texture_id, ImVec2(image_width, image_height), uv0, uv1);
 
     ImGui::End();
 }
 
+// Shows the scene loaded so far each time the loader swaps in a hierarchy over more of it, as a preview
+// that the full frame follows once no more chunks come for settle_time, the last chunk is shown in full
+void UpdateLoading(Scene& scene, int* image, GLuint texture_id) {
+    if (!scene.loader->Update(&scene.sources, &scene.primitives, &scene.loaded_bvh)) return;
+    const double start = omp_get_wtime();
+    if (!scene.loader->done()) {
+        RenderPreview(scene, image);
+        UpdateTexture(texture_id, image, scene.shown_width, scene.shown_height);
+        scene.last_move = omp_get_wtime();
+        scene.refine = true;
+        std::cout << "loaded " << scene.primitives.size() << " primitives, preview " << scene.last_move - start << '\n';
+        return;
+    }
+
+    RenderStats stats;
+    Render(scene, image, &stats);
+    const double end = omp_get_wtime();
+    ShowFrame(scene, texture_id, image);
+    scene.shown_width = image_width;
+    scene.shown_height = image_height;
+    scene.refine = false;
+    std::cout << "loaded " << scene.primitives.size() << " primitives, " << end - start << '\n';
+    scene.loader.reset();
+    scene.loaded_bvh = Bvh {};
+}
+
 void MainLoop(Scene& scene, int* image, GLuint texture_id) {
+    if (scene.loader) UpdateLoading(scene, image, texture_id);
     AppGUI(scene, texture_id, image);
 }
 
@@ -381,10 +607,30 @@ void FillStrangeScene(Scene& scene) {
     });
 }
 
-int main() {
-    Scene scene;
-    //FillScene(scene.primitives, scene.sources);
-    FillBoxScene(scene.primitives, scene.sources, Box {
+// Diffuse map from a texture file, or from a binary PPM converted next to it
+std::shared_ptr<const SurfaceTextures> LoadSurfaceTextures(const std::string& path) {
+    std::string texture_path = path;
+    if (path.size() > 4 && path.compare(path.size() - 4, 4, ".ppm") == 0) {
+        std::vector<int> image;
+        int width, height;
+        texture_path = path + ".tex";
+        if (!LoadPpm(path, &image, &width, &height) || !WriteTexture(texture_path, image.data(), width, height)) {
+            return nullptr;
+        }
+    }
+    auto texture = OpenTexture(texture_path);
+    if (!texture) return nullptr;
+    std::cout << "texture " << texture->width() << " x " << texture->height() << ", "
+              << texture->level_count() << " levels\n";
+    auto textures = std::make_shared<SurfaceTextures>();
+    textures->diffuse = std::move(texture);
+    return textures;
+}
+
+// The scene shown when no scene file is given, particles and meshes from the command line are added to it
+void FillDefaultScene(std::vector<std::unique_ptr<Primitive>>& primitives, std::vector<Light>& sources) {
+    //FillScene(primitives, sources);
+    FillBoxScene(primitives, sources, Box {
             Vec3{0, 0, image_width * 0.1},
             image_width, image_height, 0.1 * image_width,
             Vec3{-1, 0, 0},
@@ -397,7 +643,7 @@ int main() {
             100
         }
     );
-    /*scene.primitives.push_back(std::make_unique<Sphere>(
+    /*primitives.push_back(std::make_unique<Sphere>(
             Vec3 {0, 0,0.5 *  image_width},
             image_width * 0.25,
             Material {
@@ -406,7 +652,7 @@ int main() {
                 100
             }
             ));*/
-    scene.primitives.push_back(std::make_unique<Sphere>(
+    primitives.push_back(std::make_unique<Sphere>(
             Vec3{image_width * 0.01, -image_height * 0.5 + image_width * 0.05, image_width * 0.1},
             image_width * 0.05,
             Material {
@@ -415,51 +661,138 @@ int main() {
                     100
             }
     ));
-    /*scene.sources.push_back(Light {
+    /*sources.push_back(Light {
             Vec3{0, image_height * 0.1, image_width * 0.1},
             Color {1, 1, 1}
     });*/
-    scene.sources.push_back(Light {
+    sources.push_back(Light {
             Vec3{0, image_height * 0.45, image_width * 0.05},
             Color {1, 1, 1}
     });
-    scene.sources.push_back(Light {
+    sources.push_back(Light {
             Vec3{0, 0, image_width * 0.05},
             Color {1, 1, 1}
     });
-    scene.sources.push_back(Light {
+    sources.push_back(Light {
         Vec3 {0, 0, 0.05 * image_width},
         Color {1, 1, 1}
     });
-    scene.sources.push_back(Light {
+    sources.push_back(Light {
             Vec3 {0, -image_height * 0.9, 0.05 * image_width},
             Color {1, 1, 1}
     });
-    scene.sources.push_back(Light {
+    sources.push_back(Light {
             Vec3 {0, image_height * 0.9, 0.05 * image_width},
             Color {1, 1, 1}
     });
-    scene.sources.push_back(Light {
+    sources.push_back(Light {
             Vec3 {-image_width * 0.9, 0, 0.05 * image_width},
             Color {1, 1, 1}
     });
-    scene.sources.push_back(Light {
+    sources.push_back(Light {
             Vec3 {image_width * 0.9, 0, 0.05 * image_width},
             Color {1, 1, 1}
     });
-    int image[image_width * image_height];
-    const double start = omp_get_wtime();
-    Raytracing(scene.camera(),
-               scene.sources,
-               scene.primitives,
-               image,
-               scene.depth,
-               scene.background,
-               scene.ambient
-    );
-    const double end = omp_get_wtime();
-    auto time = end - start;
-    std::cout << time << '\n';
+}
+
+int main(int argc, char** argv) {
+    if (argc == 3 && strcmp(argv[1], render_worker_flag) == 0) {
+        return RunRenderWorker(atoi(argv[2]));
+    }
+
+    Scene scene;
+    const char* particles_path = nullptr;
+    const char* save_path = nullptr;
+    const char* cost_path = nullptr;
+    const char* mesh_path = nullptr;
+    size_t mesh_budget = default_stream_budget;
+    const char* texture_path = nullptr;
+    bool validate_fast_math = false;
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "--workers") == 0) {
+            scene.workers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--particles") == 0) {
+            // records of x, y, z, radius floats
+            particles_path = argv[++i];
+        } else if (strcmp(argv[i], "--save-scene") == 0) {
+            // writes the scene for render_daemon and exits
+            save_path = argv[++i];
+        } else if (strcmp(argv[i], "--cost-map") == 0) {
+            // renders once in this process, writes <prefix>.ppm and <prefix>.csv and exits
+            cost_path = argv[++i];
+        } else if (strcmp(argv[i], "--mesh") == 0) {
+            // file written by WriteStreamedMesh, paged in as rays reach it
+            mesh_path = argv[++i];
+        } else if (strcmp(argv[i], "--mesh-budget") == 0) {
+            // megabytes of the mesh kept in memory
+            mesh_budget = (size_t) atoi(argv[++i]) << 20;
+        } else if (strcmp(argv[i], "--texture") == 0) {
+            // diffuse map of the spheres, a binary PPM is converted to <path>.tex first
+            texture_path = argv[++i];
+        }
+    }
+    for (int i = 1; i < argc; i++) {
+        // renders once in both math modes, prints how far apart the images are and exits
+        validate_fast_math |= strcmp(argv[i], "--validate-fast-math") == 0;
+    }
+
+    // the built in scene comes first, so that there is something to look at while the files load
+    std::vector<LoadStep> steps;
+    steps.emplace_back([texture_path](std::vector<Light>* sources, std::vector<std::unique_ptr<Primitive>>* primitives) {
+        FillDefaultScene(*primitives, *sources);
+        if (!texture_path) return;
+        auto textures = LoadSurfaceTextures(texture_path);
+        if (!textures) return;
+        for (auto& primitive: *primitives) {
+            if (auto* sphere = dynamic_cast<Sphere*>(primitive.get())) sphere->SetTextures(textures);
+        }
+    });
+    if (particles_path) {
+        steps.emplace_back([particles_path](std::vector<Light>*, std::vector<std::unique_ptr<Primitive>>* primitives) {
+            auto cloud = LoadSphereCloud(particles_path, ParticleFileLayout {}, {
+                    Material {Color {0.9, 0.1, 0.5}, Color {}, 100}
+            });
+            if (cloud) {
+                std::cout << "loaded " << cloud->size() << " particles\n";
+                primitives->push_back(std::move(cloud));
+            }
+        });
+    }
+    if (mesh_path) {
+        steps.emplace_back([mesh_path, mesh_budget](std::vector<Light>*, std::vector<std::unique_ptr<Primitive>>* primitives) {
+            auto mesh = OpenStreamedMesh(mesh_path, mesh_budget);
+            if (mesh) {
+                std::cout << "mapped " << mesh->chunk_count() << " mesh chunks\n";
+                primitives->push_back(std::move(mesh));
+            }
+        });
+    }
+    if (save_path || validate_fast_math || cost_path) {
+        LoadNow(steps, &scene.sources, &scene.primitives);
+    }
+    if (save_path) {
+        // levels of detail are stored in the file rather than built on every load
+        AddSimplifiedLevels(&scene.primitives);
+        return SaveScene(save_path, scene.sources, scene.primitives) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (validate_fast_math) {
+        const FastMathReport report = ValidateFastMath(scene.camera(), scene.sources, scene.primitives, scene.depth,
+                                                       scene.background, scene.ambient, scene.settings);
+        std::cout << "precise " << report.precise_seconds << " s, fast " << report.fast_seconds << " s\n"
+                  << "max error " << report.max_error << ", mean error " << report.mean_error
+                  << ", pixels off by more than 1: " << report.differing_pixels << '\n';
+        return EXIT_SUCCESS;
+    }
+    int image[image_width * image_height] = {};
+    if (cost_path) {
+        std::vector<PixelCost> costs(image_width * image_height);
+        Raytracing(scene.camera(), scene.sources, scene.primitives, image, scene.depth,
+                   scene.background, scene.ambient, scene.settings, nullptr, costs.data());
+        return SaveCostMap(cost_path, costs.data(), image_width, image_height, scene.cost_metric)
+               ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    // the window opens right away and shows the scene as it comes in
+    scene.loader = std::make_unique<SceneLoader>(std::move(steps), scene.settings.builder);
 
     auto window = InitImgui();
     if (!window) return EXIT_FAILURE;
@@ -5,7 +5,16 @@
 //
 
 #include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <omp.h>
 #include "raytracing.h"
+#include "raytracing_bvh.h"
+#include "raytracing_frustum.h"
+#include "raytracing_denoise.h"
+#include "raytracing_numa.h"
+#include "raytracing_fastmath.h"
+#include "raytracing_visibility.h"
 
 void PrintVec(const Vec3& vec) {
     std::cout << vec.x << ", "
@@ -19,192 +28,1108 @@ void PrintColor(const Color& color) {
               << color.blue << '\n';
 }
 
-// find closest primitive that is intersected by ray
-// excluding ignored_primitive
-bool FindPrimitive(
+// Work done by the calling thread, TracePixel takes the difference before and after a pixel
+struct TraceCounters {
+    uint32_t intersections = 0;
+    uint32_t shadow_rays = 0;
+    uint32_t bounces = 0;
+};
+
+thread_local TraceCounters trace_counters;
+
+// Closest hit of start + t * ray, t in [t_min, t_max], on primitives under the nodes of cut, or all of them
+// if cut is null. leaving is the surface the ray starts from, it isn't hit. The hit is completed for shading
+bool FindClosest(
         const Vec3& start,
         const Vec3& ray,
         const std::vector<std::unique_ptr<Primitive>>& primitives,
-        float* min_intersection,
-        int* index,
-        int ignored_primitive = -1 //index of primitive that is ignored when finding the next one
+        const Bvh& bvh,
+        const BvhCut* cut,
+        float t_min,
+        float t_max,
+        const RayCone& cone,
+        Hit* hit,
+        const Hit* leaving
 ) {
-    float min = INFINITY;
-    int idx = -1;
-    for (int i = 0; i < primitives.size(); i++) {
-        if (i == ignored_primitive) continue;
-        float intersection;
-        if (primitives[i]->Intersection(start, ray, &intersection)) {
-            if (intersection < 0) continue;
-            if (min > intersection) {
-                idx = i;
-                min = intersection;
-            }
+    Hit closest, candidate;
+    const int ignored = leaving ? leaving->primitive : -1;
+    uint32_t tests = 0;
+    const auto visit = [&](int i, float* node_t_max) {
+        tests++;
+        const int skipped = i == ignored ? leaving->part : -1;
+        if (!primitives[i]->Intersect(start, ray, &candidate, skipped, cone)) return true;
+        if (candidate.t < t_min) {
+            // hits behind start are dropped, a primitive crossing the near plane may still be hit behind it
+            if (t_min <= 0 || candidate.t < 0) return true;
+            if (!primitives[i]->Intersect(start + ray * t_min, ray, &candidate, skipped,
+                                          RayCone {cone.At(t_min), cone.spread})) return true;
+            if (candidate.t < 0) return true;
+            candidate.t += t_min;
+        }
+        if (candidate.t > t_max) return true;
+        // ties go to the lower index, as if primitives were scanned in order
+        if (closest.t > candidate.t || (closest.t == candidate.t && i < closest.primitive)) {
+            closest = candidate;
+            closest.primitive = i;
+            *node_t_max = closest.t;
         }
+        return true;
+    };
+    if (cut) {
+        bvh.Traverse(*cut, start, ray, t_min, t_max, visit);
+    } else {
+        bvh.Traverse(start, ray, t_min, t_max, visit);
     }
+    trace_counters.intersections += tests;
+
+    *hit = closest;
+    if (closest.primitive < 0) return false;
+    hit->footprint = cone.At(closest.t);
+    primitives[closest.primitive]->Complete(start + ray * closest.t, hit);
+    return true;
+}
 
-    *min_intersection = min;
-    *index = idx;
+// find closest primitive that is intersected by ray, the hit is completed for shading
+// leaving is the surface the ray starts from, it isn't hit
+bool FindPrimitive(
+        const Vec3& start,
+        const Vec3& ray,
+        const std::vector<std::unique_ptr<Primitive>>& primitives,
+        const Bvh& bvh,
+        const RayCone& cone,
+        Hit* hit,
+        const Hit* leaving = nullptr
+) {
+    return FindClosest(start, ray, primitives, bvh, nullptr, 0, INFINITY, cone, hit, leaving);
+}
+
+// largest ray parameter of a hit on primitives[index] that blocks a shadow ray ending on surface at 1
+float ShadowLimit(const Vec3& ray, const Hit& surface, int index) {
+    return index == surface.primitive ? 1 - self_hit_distance / ray.length() : 1.0f;
+}
 
-    return idx >= 0;
+// only hits between the light at 0 and the surface count, unbounded primitives cross most lines
+// through the light somewhere behind it
+bool BlocksShadowRay(float t, const Vec3& ray, const Hit& surface, int index) {
+    return t >= 0 && t <= ShadowLimit(ray, surface, index);
 }
 
-// Returns true if there are other primitives in front of primitives[index] in path of light,
-// where start + ray is intersection of light with primitives[index], ray is light direction
+// Returns true if there are other surfaces in front of surface in path of light,
+// where start + ray is the point of surface, ray is light direction
 bool IsHidden(
         const Vec3& start,
         const Vec3& ray,
         const std::vector<std::unique_ptr<Primitive>>& primitives,
-        int index
+        const Bvh& bvh,
+        const Hit& surface
 ) {
-    for (int i = 0; i < primitives.size(); i++) {
-        if (i == index) continue;
-        float result;
-        if (primitives[i]->Intersection(start, ray, &result)) {
-            if (result <= 1.0f) {
-                return true;
+    bool hidden = false;
+    uint32_t tests = 0;
+    Hit hit;
+    // shadow rays are as wide as the footprint they start from
+    const RayCone cone {surface.footprint, 0};
+    bvh.Traverse(start, ray, 0.0f, 1.0f, [&](int i, float*) {
+        tests++;
+        if (primitives[i]->Intersect(start, ray, &hit, i == surface.primitive ? surface.part : -1, cone)) {
+            if (BlocksShadowRay(hit.t, ray, surface, i)) {
+                hidden = true;
+                return false;
             }
         }
+        return true;
+    });
+    trace_counters.intersections += tests;
+    trace_counters.shadow_rays++;
+    return hidden;
+}
+
+// Marks hidden[k] for every shadow ray k (from starts[k] along rays[k], up to the point at 1)
+// blocked by surfaces other than surface
+// The whole batch shares one traversal of the hierarchy, every primitive takes the rays reaching it at once
+void IsHiddenBatch(
+        const Vec3* starts,
+        const Vec3* rays,
+        int count,
+        const std::vector<std::unique_ptr<Primitive>>& primitives,
+        const Bvh& bvh,
+        const Hit& surface,
+        bool* hidden
+) {
+    for (int k = 0; k < count; k++) {
+        hidden[k] = false;
     }
-    return false;
+
+    uint32_t tests = 0;
+    thread_local Hit hits[Bvh::max_packet];
+    const RayCone cone {surface.footprint, 0};
+    for (int first = 0; first < count; first += Bvh::max_packet) {
+        bvh.TraversePacket(starts + first, rays + first, std::min(count - first, Bvh::max_packet),
+                           0.0f, 1.0f, hidden + first,
+                           [&](int i, const Vec3* packet_starts, const Vec3* packet_rays, int n, bool* finished) {
+            primitives[i]->IntersectMany(packet_starts, packet_rays, n, hits,
+                                         i == surface.primitive ? surface.part : -1, cone);
+            tests += n;
+            bool any = false;
+            for (int j = 0; j < n; j++) {
+                finished[j] = BlocksShadowRay(hits[j].t, packet_rays[j], surface, i);
+                any = any || finished[j];
+            }
+            return any;
+        });
+    }
+    trace_counters.intersections += tests;
+    trace_counters.shadow_rays += count;
 }
 
+MaterialClass Classify(const Material& material) {
+    const auto black = [](const Color& color) {
+        return color.red == 0 && color.green == 0 && color.blue == 0;
+    };
+    const bool diffuse = !black(material.diffuse);
+    const bool specular = !black(material.specular);
+    if (diffuse && specular) return MaterialClass::Phong;
+    if (diffuse) return MaterialClass::Diffuse;
+    return specular ? MaterialClass::Mirror : MaterialClass::Black;
+}
+
+// Phong intensity from a light at light_position, false if the surface is facing away from it
+// Terms that are zero for the class of material are left out, sums are the same as the full ones
+// The fast variant shares one reciprocal square root between the direction, the reflection and attenuation
+template <MaterialClass shading, bool fast>
+bool LightIntensity(
+        const Vec3& light_position,
+        const Color& light_color,
+        const Vec3& intersection,
+        const Vec3& normal,
+        const Vec3& view,
+        const Material& material,
+        Color* result
+) {
+    const Vec3 light_vec = light_position - intersection;
+    if constexpr (fast) {
+        const float squared = light_vec * light_vec;
+        const float inverse_length = FastRsqrt(squared);
+        const Vec3 light_norm = light_vec * inverse_length;
+        const float light_cosine = normal * light_norm;
+        if (light_cosine < 0) return false;
+
+        const float attenuation = 1 / (1 + squared * inverse_length * 0.0005f);
+        if constexpr (shading == MaterialClass::Diffuse) {
+            *result = light_color * (material.diffuse * (light_cosine * attenuation));
+            return true;
+        }
+        const float reflect_cosine = (normal * (2 * light_cosine) - light_norm) * view;
+        const Color specular = reflect_cosine > 0 ? material.specular * FastPow(reflect_cosine, material.power)
+                                                  : Color {};
+        if constexpr (shading == MaterialClass::Mirror) {
+            *result = light_color * specular * attenuation;
+        } else {
+            *result = light_color * (material.diffuse * light_cosine + specular) * attenuation;
+        }
+        return true;
+    }
+    // check if the object is facing the light in this point
+    const Vec3 light_norm = light_vec.norm();
+    float light_cosine = normal * light_norm;
+    if (light_cosine < 0) return false;
+
+    if constexpr (shading == MaterialClass::Diffuse) {
+        *result = light_color * (material.diffuse * light_cosine) * light_vec.f_att();
+        return true;
+    }
+    const float reflect_cosine = light_vec.reflection(normal) * view;
+    const Color specular = reflect_cosine > 0 ? material.specular * powf(reflect_cosine, material.power) : Color {};
+    if constexpr (shading == MaterialClass::Mirror) {
+        *result = light_color * specular * light_vec.f_att();
+    } else {
+        *result = light_color * (material.diffuse * light_cosine + specular) * light_vec.f_att();
+    }
+    return true;
+}
+
+// Point of stratum (i, j) of a strata x strata grid on the light, jittered by (ju, jv)
+// Spheres are sampled as the disk facing intersection
+Vec3 LightSamplePosition(const Light& light, const Vec3& intersection, int i, int j, int strata, float ju, float jv) {
+    const float su = (i + ju) / strata;
+    const float sv = (j + jv) / strata;
+    if (light.shape == LightShape::Rectangle) {
+        return light.position + light.u * (2 * su - 1) + light.v * (2 * sv - 1);
+    }
+
+    const Vec3 w = (intersection - light.position).norm();
+    const Vec3 helper = fabsf(w.x) > 0.5f ? Vec3 {0, 1, 0} : Vec3 {1, 0, 0};
+    const Vec3 a = w.cross(helper).norm();
+    const Vec3 b = w.cross(a);
+    const float r = light.radius * sqrtf(su);
+    const float phi = 2 * (float) M_PI * sv;
+    return light.position + a * (r * cosf(phi)) + b * (r * sinf(phi));
+}
+
+constexpr int max_light_strata = 16;
+
+// Soft shadows: every stratum of the light is a point light with its share of the color
+// The 4 corner strata and the center one are traced first, if all of them face the surface and agree on
+// visibility the rest is assumed to agree too. An occluder hiding only strata between them is missed
+template <MaterialClass shading, bool fast>
+Color AreaLightIntensity(
+        const Light& light,
+        const Vec3& intersection,
+        const Vec3& normal,
+        const Vec3& view,
+        const Material& material,
+        const std::vector<std::unique_ptr<Primitive>>& primitives,
+        const Bvh& bvh,
+        const Hit& surface,
+        SampleRng& rng
+) {
+    const int strata = std::clamp((int) sqrtf((float) light.samples), 1, max_light_strata);
+    const int count = strata * strata;
+    const Color sample_color = light.color / (float) count;
+
+    Color intensities[max_light_strata * max_light_strata];
+    Vec3 starts[max_light_strata * max_light_strata];
+    Vec3 rays[max_light_strata * max_light_strata];
+    bool hidden[max_light_strata * max_light_strata];
+
+    // facing samples are ordered so that the probed strata come first
+    int facing = 0;
+    int probes = 0;
+    int probed_strata = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int j = 0; j < strata; j++) {
+            for (int i = 0; i < strata; i++) {
+                const bool corner = (i == 0 || i == strata - 1) && (j == 0 || j == strata - 1);
+                const bool probed = corner || (i == strata / 2 && j == strata / 2);
+                if (probed != (pass == 0)) continue;
+                if (probed) probed_strata++;
+
+                const float ju = rng.Next();
+                const float jv = rng.Next();
+                const Vec3 position = LightSamplePosition(light, intersection, i, j, strata, ju, jv);
+                if (!LightIntensity<shading, fast>(position, sample_color, intersection, normal, view, material,
+                                                   &intensities[facing])) {
+                    continue;
+                }
+                starts[facing] = position;
+                rays[facing] = intersection - position;
+                facing++;
+            }
+        }
+        if (pass == 0) probes = facing;
+    }
+
+    IsHiddenBatch(starts, rays, probes, primitives, bvh, surface, hidden);
+    // a probe that doesn't face the surface leaves part of the light unchecked
+    bool uniform = probes >= 2 && probes == probed_strata;
+    for (int k = 1; k < probes; k++) {
+        uniform = uniform && hidden[k] == hidden[0];
+    }
+    if (uniform) {
+        for (int k = probes; k < facing; k++) {
+            hidden[k] = hidden[0];
+        }
+    } else {
+        IsHiddenBatch(starts + probes, rays + probes, facing - probes, primitives, bvh, surface, hidden + probes);
+    }
+
+    Color result {0, 0, 0};
+    for (int k = 0; k < facing; k++) {
+        if (!hidden[k]) result += intensities[k];
+    }
+    return result;
+}
+
+// Mask of the point lights hidden from corner, tested as IsHidden tests points of surface
+uint64_t HiddenLights(
+        const Vec3& corner,
+        const std::vector<Light>& light_sources,
+        const std::vector<std::unique_ptr<Primitive>>& primitives,
+        const Bvh& bvh,
+        const Hit& surface
+) {
+    uint64_t hidden = 0;
+    for (int l = 0; l < light_sources.size() && l < VisibilityCache::max_lights; l++) {
+        const Light& light = light_sources[l];
+        if (light.shape != LightShape::Point) continue;
+        if (IsHidden(light.position, corner - light.position, primitives, bvh, surface)) {
+            hidden |= 1ull << l;
+        }
+    }
+    return hidden;
+}
+
+// Shadow answers for point lights at intersection, looked up once per point as the first point light
+// needs one. Lights without an answer get an exact shadow ray, so do all points of compound primitives,
+// their parts shadow each other and corners aren't kept per part
+class PointShadows {
+private:
+    const VisibilityCache* visibility;
+    bool looked_up = false;
+    uint64_t known = 0, hidden = 0;
+public:
+    explicit PointShadows(const VisibilityCache* visibility): visibility {visibility} {}
+
+    bool Hidden(int light,
+                const Vec3& intersection,
+                const std::vector<Light>& light_sources,
+                const std::vector<std::unique_ptr<Primitive>>& primitives,
+                const Bvh& bvh,
+                const Hit& surface
+    ) {
+        if (visibility && !looked_up) {
+            looked_up = true;
+            if (primitives[surface.primitive]->parts() == 1) {
+                visibility->Lookup(intersection, surface.primitive, [&](const Vec3& corner) {
+                    return HiddenLights(corner, light_sources, primitives, bvh, surface);
+                }, &known, &hidden);
+            }
+        }
+        if (light < VisibilityCache::max_lights && (known >> light & 1)) {
+            return (hidden >> light & 1) != 0;
+        }
+        const Vec3& position = light_sources[light].position;
+        return IsHidden(position, (position - intersection) * -1, primitives, bvh, surface);
+    }
+};
+
+// Ambient and direct light reflected at intersection, a material that can't reflect anything isn't shaded
+template <MaterialClass shading, bool fast>
+Color DirectIntensity(
+        const Vec3& intersection,
+        const Vec3& normal,
+        const Vec3& view,
+        const Material& material,
+        const std::vector<Light>& light_sources,
+        const std::vector<std::unique_ptr<Primitive>>& primitives,
+        const Bvh& bvh,
+        const Color& ambient,
+        const Hit& surface,
+        SampleRng& rng,
+        const VisibilityCache* visibility
+) {
+    Color reflected_intensity {0, 0, 0};
+    if constexpr (shading == MaterialClass::Black) {
+        return reflected_intensity;
+    }
+    if constexpr (shading != MaterialClass::Mirror) {
+        reflected_intensity = material.diffuse * ambient;
+    }
+
+    PointShadows shadows(visibility);
+    for (int l = 0; l < light_sources.size(); l++) {
+        const Light& light = light_sources[l];
+        if (light.shape != LightShape::Point) {
+            reflected_intensity += AreaLightIntensity<shading, fast>(light, intersection, normal, view, material,
+                                                                     primitives, bvh, surface, rng);
+            continue;
+        }
+
+        Color light_intensity;
+        if (!LightIntensity<shading, fast>(light.position, light.color, intersection, normal, view, material,
+                                           &light_intensity)) {
+            continue;
+        }
+
+        if (shadows.Hidden(l, intersection, light_sources, primitives, bvh, surface)) {
+            continue;
+        }
+
+        // add intensity from light
+        reflected_intensity += light_intensity;
+    }
+    return reflected_intensity;
+}
+
+template <bool fast>
 Color CalculateIntensity(
         const Vec3& start,
         const Vec3& ray,
         const std::vector<Light>& light_sources,
         const std::vector<std::unique_ptr<Primitive>>& primitives,
+        const Bvh& bvh,
         const Color& ambient,
-        int primitive_index,
-        int depth = 0 // reflection depth
+        const Hit& hit, // completed hit at start + ray, hit.primitive is negative if the ray missed
+        const SampleKey& sample, // stochastic terms draw from SampleRng(sample, bounce)
+        float spread, // width of the footprint of the sample per unit of distance along the path
+        int depth = 0, // reflection depth
+        int* reflections = nullptr, // incremented for every reflected ray that can contribute
+        const VisibilityCache* visibility = nullptr // answers shadow rays of point lights if not null
 ) {
-    if (primitive_index < 0) {
+    if (hit.primitive < 0) {
         // we can't get intensities below zero if we calculate it from different sources
         // so we can just set these pixels to background after finding maximum intensity
         return Color {-1.0f, -1.0f, -1.0f };
     }
 
     Vec3 intersection = start + ray;
+    // reflections are treated as flat, so the footprint keeps growing with the length of the path
+    float travelled = ray.length();
 
+    Hit surface = hit;
     Color intensity {0, 0, 0};
     Color reflection_coefficient {1, 1, 1};
     for (int i = 0; i < depth + 1; i++) {
-        const Primitive& primitive = *primitives[primitive_index];
-
-        Color reflected_intensity = primitive.material().diffuse * ambient;
-
-        const Vec3 normal = primitive.Normal(intersection);
-        const Vec3 view = (ray * -1).norm();
-
-        for (const auto& light: light_sources) {
-            const Vec3 light_vec = light.position - intersection;
-            // check if the object is facing the light in this point
-            const Vec3 light_norm = light_vec.norm();
-            float light_cosine = normal * light_norm;
-            if (light_cosine < 0) continue;
+        const Primitive& primitive = *primitives[surface.primitive];
+        const Material material = primitive.SurfaceMaterial(surface, ray, spread * travelled);
+        const MaterialClass shading = Classify(material);
 
-            if (IsHidden(light.position, light_vec * -1, primitives, primitive_index)) {
-                continue;
-            }
+        const Vec3& normal = surface.normal;
+        const Vec3 view = fast ? FastNorm(ray * -1) : (ray * -1).norm();
 
-            // add intensity from light
-            const float reflect_cosine = light_vec.reflection(normal) * view;
-            const Color specular = reflect_cosine > 0 ? primitive.material().specular * powf(reflect_cosine, primitive.material().power) : Color {};
-            reflected_intensity += light.color * (primitive.material().diffuse * light_cosine + specular) * light_vec.f_att();
+        // every bounce seeds its own generator, so skipping draws of one doesn't change the others
+        SampleRng rng(sample, i);
+        Color reflected_intensity;
+        switch (shading) {
+            case MaterialClass::Black:
+                break;
+            case MaterialClass::Diffuse:
+                reflected_intensity = DirectIntensity<MaterialClass::Diffuse, fast>(
+                        intersection, normal, view, material, light_sources, primitives, bvh, ambient, surface, rng,
+                        visibility);
+                break;
+            case MaterialClass::Mirror:
+                reflected_intensity = DirectIntensity<MaterialClass::Mirror, fast>(
+                        intersection, normal, view, material, light_sources, primitives, bvh, ambient, surface, rng,
+                        visibility);
+                break;
+            case MaterialClass::Phong:
+                reflected_intensity = DirectIntensity<MaterialClass::Phong, fast>(
+                        intersection, normal, view, material, light_sources, primitives, bvh, ambient, surface, rng,
+                        visibility);
+                break;
         }
 
         intensity += reflection_coefficient * reflected_intensity;
 
-        // find light from other objects
+        // find light from other objects, surfaces without specular color would scale it by zero
         if (i != depth) {
-            const Vec3 new_ray = ray.reflection(normal) * -1;
-            float min_intersection;
-            if (!FindPrimitive(intersection, new_ray, primitives, &min_intersection, &primitive_index, primitive_index)) {
+            if (shading == MaterialClass::Black || shading == MaterialClass::Diffuse) break;
+            if (reflections && material.specular.red + material.specular.green + material.specular.blue > 0) {
+                ++*reflections;
+            }
+            trace_counters.bounces++;
+            Vec3 new_ray;
+            if constexpr (fast) {
+                new_ray = FastNorm(ray - normal * (2 * (normal * ray)));
+            } else {
+                new_ray = ray.reflection(normal) * -1;
+            }
+            Hit next;
+            // new_ray has unit length
+            if (!FindPrimitive(intersection, new_ray, primitives, bvh, RayCone {spread * travelled, spread},
+                               &next, &surface)) {
                 break;
             }
+            surface = next;
+            const float min_intersection = next.t;
             intersection += new_ray * min_intersection;
-            reflection_coefficient *= primitive.material().specular * (new_ray * min_intersection).f_att();
+            travelled += fabsf(min_intersection);
+            if constexpr (fast) {
+                // new_ray has unit length, so the distance is the ray parameter
+                reflection_coefficient *= material.specular * (1 / (1 + fabsf(min_intersection) * 0.0005f));
+            } else {
+                reflection_coefficient *= material.specular * (new_ray * min_intersection).f_att();
+            }
         }
     }
 
     return intensity;
 }
 
+// paths are never cut by Russian roulette before this many bounces
+constexpr int roulette_bounces = 3;
+constexpr float max_survival = 0.95f;
+
+float Average(const Color& color) {
+    return (color.red + color.green + color.blue) / 3;
+}
+
+float MaxComponent(const Color& color) {
+    return std::max(color.red, std::max(color.green, color.blue));
+}
+
+// power heuristic weight of a sample drawn with pdf, other_pdf is the one of the other strategy
+float PowerHeuristic(float pdf, float other_pdf) {
+    const float ratio = other_pdf / pdf;
+    return 1 / (1 + ratio * ratio);
+}
+
+// area of the part of the light LightSamplePosition samples, spheres are seen as disks facing the point
+float LightArea(const Light& light) {
+    switch (light.shape) {
+        case LightShape::Point:
+            return 0;
+        case LightShape::Sphere:
+            return (float) M_PI * light.radius * light.radius;
+        case LightShape::Rectangle:
+            return 4 * light.u.cross(light.v).length();
+    }
+    return 0;
+}
+
+// cosine between direction (unit) and the normal of the light sampled from point
+float LightCosine(const Light& light, const Vec3& point, const Vec3& direction) {
+    const Vec3 normal = light.shape == LightShape::Rectangle ? light.u.cross(light.v).norm()
+                                                             : (point - light.position).norm();
+    return fabsf(normal * direction);
+}
 
-struct PixelSamples {
-    Color colors[4];
+// t at which point + t * direction crosses the area LightSamplePosition samples, lights are two-sided
+bool IntersectLight(const Light& light, const Vec3& point, const Vec3& direction, float* t) {
+    if (light.shape == LightShape::Point) return false;
+    const Vec3 normal = light.shape == LightShape::Rectangle ? light.u.cross(light.v).norm()
+                                                             : (point - light.position).norm();
+    const float denominator = normal * direction;
+    if (denominator == 0) return false;
+    *t = ((light.position - point) * normal) / denominator;
+    if (*t <= 0) return false;
+    const Vec3 offset = point + direction * *t - light.position;
+    if (light.shape == LightShape::Sphere) {
+        return offset * offset <= light.radius * light.radius;
+    }
+    // coordinates along u and v from the dual basis, u and v don't have to be orthogonal
+    const Vec3 u_orthogonal = light.v.cross(normal);
+    const Vec3 v_orthogonal = normal.cross(light.u);
+    const float s = (offset * u_orthogonal) / (light.u * u_orthogonal);
+    const float r = (offset * v_orthogonal) / (light.v * v_orthogonal);
+    return fabsf(s) <= 1 && fabsf(r) <= 1;
+}
+
+// direction around normal with density cosine / pi
+Vec3 CosineDirection(const Vec3& normal, float u1, float u2) {
+    const Vec3 helper = fabsf(normal.x) > 0.5f ? Vec3 {0, 1, 0} : Vec3 {1, 0, 0};
+    const Vec3 a = normal.cross(helper).norm();
+    const Vec3 b = normal.cross(a);
+    const float r = sqrtf(u1);
+    const float phi = 2 * (float) M_PI * u2;
+    return a * (r * cosf(phi)) + b * (r * sinf(phi)) + normal * sqrtf(std::max(0.0f, 1 - u1));
+}
+
+// Monte Carlo estimate of the light coming back along ray, arguments are those of CalculateIntensity
+// Surfaces are Lambertian with a perfect mirror on top, the path continues with one of them chosen
+// by the average of their colors. Direct light is sampled at every vertex, for area lights it's weighted
+// against diffuse bounces reaching the light by multiple importance sampling. As in CalculateIntensity
+// lights are scaled by f_att instead of the squared distance, are never seen directly or in mirrors
+// and keep their Phong highlights. Paths leaving the scene see ambient as a uniform sky
+template <bool fast>
+Color PathIntensity(
+        const Vec3& start,
+        const Vec3& ray,
+        const std::vector<Light>& light_sources,
+        const std::vector<std::unique_ptr<Primitive>>& primitives,
+        const Bvh& bvh,
+        const Color& ambient,
+        const Hit& hit,
+        const SampleKey& sample,
+        float spread,
+        int depth, // bounces after the primary hit
+        int* reflections,
+        const VisibilityCache* visibility
+) {
+    if (hit.primitive < 0) {
+        return Color {-1.0f, -1.0f, -1.0f };
+    }
+
+    Hit surface = hit;
+    Vec3 intersection = start + ray;
+    Vec3 direction = fast ? FastNorm(ray) : ray.norm();
+    float travelled = ray.length();
+
+    Color radiance {0, 0, 0};
+    Color throughput {1, 1, 1};
+    for (int bounce = 0; bounce <= depth; bounce++) {
+        const Primitive& primitive = *primitives[surface.primitive];
+        const Material material = primitive.SurfaceMaterial(surface, direction, spread * travelled);
+        if (Classify(material) == MaterialClass::Black) break;
+
+        // the side the path arrives from
+        Vec3 normal = surface.normal;
+        if (normal * direction > 0) normal = normal * -1;
+        const Vec3 view = direction * -1;
+        // stream 0 of the sample places it in the pixel
+        SampleRng rng(sample, bounce + 1);
+        const float diffuse_weight = Average(material.diffuse);
+        const float diffuse_chance = diffuse_weight / (diffuse_weight + Average(material.specular));
+
+        Color direct {0, 0, 0};
+        PointShadows shadows(visibility);
+        for (int l = 0; l < light_sources.size(); l++) {
+            const Light& light = light_sources[l];
+            if (light.shape == LightShape::Point) {
+                Color light_intensity;
+                if (LightIntensity<MaterialClass::Phong, fast>(light.position, light.color, intersection, normal,
+                                                               view, material, &light_intensity)
+                    && !shadows.Hidden(l, intersection, light_sources, primitives, bvh, surface)) {
+                    direct += light_intensity;
+                }
+                continue;
+            }
+
+            const float ju = rng.Next();
+            const float jv = rng.Next();
+            const Vec3 position = LightSamplePosition(light, intersection, 0, 0, 1, ju, jv);
+            const Vec3 light_vec = position - intersection;
+            const float squared = light_vec * light_vec;
+            const Vec3 light_norm = light_vec / sqrtf(squared);
+            const float cosine = normal * light_norm;
+            if (cosine <= 0) continue;
+            if (IsHidden(position, intersection - position, primitives, bvh, surface)) continue;
+
+            // solid angle densities of sampling this direction on the light and by a diffuse bounce
+            const float light_pdf = squared / (LightArea(light) * LightCosine(light, intersection, light_norm));
+            // the last vertex doesn't bounce, so light samples are the only way to reach the light from it
+            const float bounce_pdf = bounce < depth ? diffuse_chance * cosine / (float) M_PI : 0;
+            Color reflected = material.diffuse * (cosine * PowerHeuristic(light_pdf, bounce_pdf));
+            const float reflect_cosine = light_vec.reflection(normal) * view;
+            if (reflect_cosine > 0) {
+                reflected += material.specular * (fast ? FastPow(reflect_cosine, material.power)
+                                                       : powf(reflect_cosine, material.power));
+            }
+            direct += light.color * reflected * light_vec.f_att();
+        }
+        radiance += throughput * direct;
+        if (bounce == depth) break;
+
+        const bool diffuse = rng.Next() < diffuse_chance;
+        Vec3 new_ray;
+        if (diffuse) {
+            new_ray = CosineDirection(normal, rng.Next(), rng.Next());
+            throughput *= material.diffuse / diffuse_chance;
+        } else {
+            new_ray = direction - normal * (2 * (normal * direction));
+            throughput *= material.specular / (1 - diffuse_chance);
+        }
+        if (bounce + 1 >= roulette_bounces) {
+            const float survival = std::min(MaxComponent(throughput), max_survival);
+            if (rng.Next() >= survival) break;
+            throughput = throughput / survival;
+        }
+
+        if (reflections) ++*reflections;
+        trace_counters.bounces++;
+        Hit next;
+        const bool found = FindPrimitive(intersection, new_ray, primitives, bvh, RayCone {spread * travelled, spread},
+                                         &next, &surface);
+        const float min_intersection = next.t;
+
+        // area lights in front of the next surface, they don't block the path
+        if (diffuse) {
+            const float cosine = normal * new_ray;
+            const float bounce_pdf = diffuse_chance * cosine / (float) M_PI;
+            for (const auto& light: light_sources) {
+                float t;
+                if (!IntersectLight(light, intersection, new_ray, &t) || (found && t >= min_intersection)) continue;
+                const float light_pdf = t * t / (LightArea(light) * LightCosine(light, intersection, new_ray));
+                // emission that makes direct sampling above give f_att * color * cosine * diffuse
+                const float emission = (float) M_PI * light_pdf / (1 + t * 0.0005f);
+                radiance += throughput * light.color * (emission * PowerHeuristic(bounce_pdf, light_pdf));
+            }
+        }
+        if (!found) {
+            radiance += throughput * ambient;
+            break;
+        }
+
+        surface = next;
+        intersection += new_ray * min_intersection;
+        travelled += fabsf(min_intersection);
+        throughput *= Color {1, 1, 1} * (1 / (1 + fabsf(min_intersection) * 0.0005f));
+        direction = new_ray;
+    }
+    return radiance;
+}
+
+// Primary rays of samples, ray of sample i goes from camera.eye through the image plane at zn
+struct SampleRays {
+    int n;
+    SamplePattern pattern;
+    // dx, dy are distances between neighbouring samples of the grid
+    Vec3 dx, dy;
+    Vec3 start_ray;
+    // top left corner of the first pixel for samples placed anywhere inside pixels
+    Vec3 corner;
+    // rays reach depth zn at 1, hits are clipped to depths [near_clip, zf]
+    float t_near;
+    float t_far;
+
+    SampleRays(const Camera& camera, const RenderSettings& settings):
+            n {settings.samples},
+            pattern {settings.pattern},
+            dx {camera.right.norm() * (1.0f / n)},
+            dy {camera.up.norm() * (-1.0f / n)},
+            t_near {camera.near_clip / camera.zn},
+            t_far {camera.zf > camera.near_clip ? camera.zf / camera.zn : INFINITY} {
+        const Vec3 center = camera.z.norm() * camera.zn;
+        start_ray = center
+                + dx * (-camera.sw * n * 0.5f + 0.5f)
+                + dy * (-camera.sh * n * 0.5f - n * 0.5f + 0.5f);
+        corner = start_ray - dx * 0.5f - dy * 0.5f;
+    }
+
+    [[nodiscard]] Vec3 Ray(int x, int y, const SampleKey& key) const {
+        if (pattern == SamplePattern::Grid) {
+            const int i = (int) key.sample;
+            const Vec3 row_ray = start_ray + dy * (n * y + i / n);
+            return row_ray + dx * (n * x + i % n);
+        }
+        float u, v;
+        SamplePoint(pattern, key, n, &u, &v);
+        return corner + dy * (n * (y + v)) + dx * (n * (x + u));
+    }
 };
 
-// Traces rays through pixels and determines the color by applying light sources and reflection
-// Puts all the pixels into image
-void Raytracing(const Camera& camera,
+// Traces all samples of pixel (x, y) into pixel, records its primary hit if hit is given
+// and the work it took if cost is given. cut holds the primitives primary rays of the pixel may hit
+void TracePixel(const Camera& camera,
+                const SampleRays& rays,
+                const BvhCut& cut,
                 const std::vector<Light>& light_sources,
                 const std::vector<std::unique_ptr<Primitive>>& primitives,
-                int* image,
+                const Bvh& bvh,
+                int x, int y,
+                Color* pixel,
+                PixelHit* hit,
                 int depth,
-                const Color& background,
-                const Color& ambient
+                const Color& ambient,
+                const RenderSettings& settings,
+                PixelCost* cost,
+                const VisibilityCache* visibility
+) {
+    const TraceCounters counters_before = trace_counters;
+    const auto time_before = cost ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point {};
+    const Vec3 start = camera.eye;
+    const int samples_per_pixel = settings.samples_per_pixel();
+    SampleKey key {settings.seed, (uint32_t) (camera.sw * y + x), 0};
+    int reflections = 0;
+    bool surface_recorded = false;
+    for (int i = 0; i < samples_per_pixel; i++) {
+        key.sample = i;
+        const Vec3 ray = rays.Ray(x, y, key);
+        // samples are 1 / settings.samples apart at the image plane, where the ray parameter is 1
+        const float spread = 1 / (settings.samples * ray.length());
+
+        Hit primary;
+        FindClosest(start, ray, primitives, bvh, &cut, rays.t_near, rays.t_far, RayCone {0, spread * ray.length()},
+                    &primary, nullptr);
+        const int index = primary.primitive;
+        const float min_intersection = primary.t;
+        const auto calculate = settings.integrator == Integrator::PathTracing
+                ? (settings.fast_math ? PathIntensity<true> : PathIntensity<false>)
+                : (settings.fast_math ? CalculateIntensity<true> : CalculateIntensity<false>);
+        pixel[i] = calculate(
+                start, ray * min_intersection,
+                light_sources, primitives, bvh,
+                ambient, primary,
+                key,
+                spread,
+                depth,
+                &reflections,
+                visibility
+        );
+
+        if (!hit) continue;
+        // the surface comes from the first sample that found one, so that mixed pixels have one too
+        if (index >= 0 && !surface_recorded) {
+            hit->position = start + ray * min_intersection;
+            hit->normal = primary.normal;
+            // neighbouring pixels are 1 apart at the image plane where the ray parameter is 1
+            hit->footprint = min_intersection;
+            surface_recorded = true;
+        }
+        if (i == 0) {
+            hit->primitive = index;
+        } else if (hit->primitive != index) {
+            hit->primitive = PixelHit::mixed;
+        }
+    }
+    if (hit) {
+        hit->reflected = reflections > 0;
+    }
+    if (cost) {
+        cost->intersections = trace_counters.intersections - counters_before.intersections;
+        cost->shadow_rays = trace_counters.shadow_rays - counters_before.shadow_rays;
+        cost->bounces = trace_counters.bounces - counters_before.bounces;
+        cost->nanoseconds = (float) std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - time_before).count();
+    }
+}
+
+// Traces rays through pixels of rows [row_begin, row_end) and determines the color
+// by applying light sources and reflection
+void TraceRows(const Camera& camera,
+               const std::vector<Light>& light_sources,
+               const std::vector<std::unique_ptr<Primitive>>& primitives,
+               const Bvh& bvh,
+               int row_begin, int row_end,
+               Color* intensities,
+               int depth,
+               const Color& ambient,
+               const RenderSettings& settings,
+               PixelHit* hits,
+               const SceneReplicas* replicas,
+               PixelCost* costs,
+               const VisibilityCache* visibility
 ) {
     const int width = camera.sw;
-    const int height = camera.sh;
-    std::vector<PixelSamples> intensities(width * height);
+    const int samples_per_pixel = settings.samples_per_pixel();
+    const SampleRays rays(camera, settings);
+    const bool pin = settings.numa != NumaPolicy::Off;
 
-    const Vec3 center = camera.z.norm() * camera.zn;
-    const Vec3 dx = camera.right.norm() * 0.5;
-    const Vec3 dy = camera.up.norm() * -0.5;
-    const Vec3 start = camera.eye;
-    const Vec3 start_ray = center
-            + dx * (-width + 0.5f)
-            + dy * (-height - 0.5f);
-
-    #pragma omp parallel for
-    for (int y = 0; y < 2 * height; y++) {
-        const Vec3 row_ray = start_ray + dy * y;
-        for (int x = 0; x < 2 * width; x++) {
-            const int pixel_index = width * (y / 2) + (x / 2);
-            const int sample_index = 2 * (y % 2) + (x % 2);
-            const Vec3 ray = row_ray + dx * x;
-
-            int index;
-            float min_intersection;
-            FindPrimitive(start, ray, primitives, &min_intersection, &index);
-            intensities[pixel_index].colors[sample_index] = CalculateIntensity(
-                    start, ray * min_intersection,
-                    light_sources, primitives,
-                    ambient, index,
-                    depth
-            );
-        }
-    }
-
-    // convert all components from [0, max_intensity] to [0, 1] and then to int rgba
-    float max_intensity = 0;
-    for (int i = 0; i < width * height; i++) {
-        for (auto & intensity : intensities[i].colors) {
-            if (max_intensity < intensity.red) {
-                max_intensity = intensity.red;
+    #pragma omp parallel
+    {
+        const TeamThreadPin pinned(pin);
+        const SceneReplicas::Replica* local = replicas ? replicas->Local() : nullptr;
+        const std::vector<Light>& local_sources = local ? local->light_sources : light_sources;
+        const std::vector<std::unique_ptr<Primitive>>& local_primitives = local ? local->primitives : primitives;
+        const Bvh& local_bvh = local ? local->bvh : bvh;
+
+        // rows are taken in bands, so that primitives are culled once for a tile of the band
+        #pragma omp for schedule(static)
+        for (int band = row_begin; band < row_end; band += cull_tile_size) {
+            const int band_end = std::min(band + cull_tile_size, row_end);
+            for (int tile_x = 0; tile_x < width; tile_x += cull_tile_size) {
+                const int tile_end = std::min(tile_x + cull_tile_size, width);
+                BvhCut cut;
+                CullTile(camera, Tile {tile_x, band, tile_end - tile_x, band_end - band}, local_bvh, &cut);
+                for (int y = band; y < band_end; y++) {
+                    for (int x = tile_x; x < tile_end; x++) {
+                        const int pixel_index = width * (y - row_begin) + x;
+                        TracePixel(camera, rays, cut, local_sources, local_primitives, local_bvh, x, y,
+                                   intensities + samples_per_pixel * pixel_index,
+                                   hits ? hits + pixel_index : nullptr,
+                                   depth, ambient, settings,
+                                   costs ? costs + pixel_index : nullptr, visibility);
+                    }
+                }
+            }
+        }
+    }
+}
+
+void TraceTiles(const Camera& camera,
+                const std::vector<Light>& light_sources,
+                const std::vector<std::unique_ptr<Primitive>>& primitives,
+                const Bvh& bvh,
+                const std::vector<Tile>& tiles,
+                Color* intensities,
+                int depth,
+                const Color& ambient,
+                const RenderSettings& settings,
+                PixelHit* hits,
+                PixelCost* costs,
+                const VisibilityCache* visibility
+) {
+    const int width = camera.sw;
+    const int samples_per_pixel = settings.samples_per_pixel();
+    const SampleRays rays(camera, settings);
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int t = 0; t < tiles.size(); t++) {
+        const Tile& tile = tiles[t];
+        BvhCut cut;
+        CullTile(camera, tile, bvh, &cut);
+        for (int y = tile.y; y < tile.y + tile.height; y++) {
+            for (int x = tile.x; x < tile.x + tile.width; x++) {
+                const int pixel_index = width * y + x;
+                TracePixel(camera, rays, cut, light_sources, primitives, bvh, x, y,
+                           intensities + samples_per_pixel * pixel_index,
+                           hits ? hits + pixel_index : nullptr,
+                           depth, ambient, settings,
+                           costs ? costs + pixel_index : nullptr, visibility);
             }
+        }
+    }
+}
+
+void TraceViewTiles(const std::vector<Camera>& cameras,
+                    const std::vector<Light>& light_sources,
+                    const std::vector<std::unique_ptr<Primitive>>& primitives,
+                    const Bvh& bvh,
+                    const std::vector<ViewTile>& tiles,
+                    Color* const* intensities,
+                    int depth,
+                    const Color& ambient,
+                    const RenderSettings& settings,
+                    PixelHit* const* hits
+) {
+    const int samples_per_pixel = settings.samples_per_pixel();
+    std::vector<SampleRays> rays;
+    rays.reserve(cameras.size());
+    for (const auto& camera: cameras) {
+        rays.emplace_back(camera, settings);
+    }
 
-            if (max_intensity < intensity.green) {
-                max_intensity = intensity.green;
+    #pragma omp parallel for schedule(dynamic)
+    for (int t = 0; t < tiles.size(); t++) {
+        const int view = tiles[t].view;
+        const Tile& tile = tiles[t].tile;
+        const Camera& camera = cameras[view];
+        PixelHit* const view_hits = hits ? hits[view] : nullptr;
+        BvhCut cut;
+        CullTile(camera, tile, bvh, &cut);
+        for (int y = tile.y; y < tile.y + tile.height; y++) {
+            for (int x = tile.x; x < tile.x + tile.width; x++) {
+                const int pixel_index = camera.sw * y + x;
+                TracePixel(camera, rays[view], cut, light_sources, primitives, bvh, x, y,
+                           intensities[view] + samples_per_pixel * pixel_index,
+                           view_hits ? view_hits + pixel_index : nullptr,
+                           depth, ambient, settings, nullptr, nullptr);
             }
+        }
+    }
+}
 
-            if (max_intensity < intensity.blue) {
-                max_intensity = intensity.blue;
+// convert all components from [0, max_intensity] to [0, 1] and then to int rgba
+// share of pixels brighter than the white point of a path traced frame
+constexpr float path_clipped_share = 0.001f;
+
+void ResolvePixels(const Color* intensities,
+                   int pixel_count,
+                   int samples_per_pixel,
+                   Color* pixels,
+                   const Color& background,
+                   Integrator integrator
+) {
+    if (integrator == Integrator::PathTracing) {
+        // a few lucky samples would set the maximum, so averages come first
+        std::vector<float> brightness;
+        for (int i = 0; i < pixel_count; i++) {
+            Color sum {0, 0, 0};
+            for (int j = 0; j < samples_per_pixel; j++) {
+                const Color& color = intensities[i * samples_per_pixel + j];
+                if (color.red >= 0) sum += color;
+            }
+            pixels[i] = sum / samples_per_pixel;
+            brightness.push_back(MaxComponent(pixels[i]));
+        }
+        const size_t white_index = (size_t) ((float) brightness.size() * (1 - path_clipped_share));
+        float white = 0;
+        if (white_index < brightness.size()) {
+            std::nth_element(brightness.begin(), brightness.begin() + (long) white_index, brightness.end());
+            white = brightness[white_index];
+        }
+        const float scale = white > 0 ? 1 / white : 0;
+        for (int i = 0; i < pixel_count; i++) {
+            int background_samples = 0;
+            for (int j = 0; j < samples_per_pixel; j++) {
+                if (intensities[i * samples_per_pixel + j].red < 0) background_samples++;
             }
+            const Color& pixel = pixels[i];
+            pixels[i] = Color {std::min(pixel.red * scale, 1.0f), std::min(pixel.green * scale, 1.0f),
+                               std::min(pixel.blue * scale, 1.0f)}
+                    + background * ((float) background_samples / (float) samples_per_pixel);
         }
+        return;
     }
 
-    for (int i = 0; i < width * height; i++) {
+    float max_intensity = 0;
+    for (int i = 0; i < pixel_count * samples_per_pixel; i++) {
+        const Color& intensity = intensities[i];
+        if (max_intensity < intensity.red) {
+            max_intensity = intensity.red;
+        }
+
+        if (max_intensity < intensity.green) {
+            max_intensity = intensity.green;
+        }
+
+        if (max_intensity < intensity.blue) {
+            max_intensity = intensity.blue;
+        }
+    }
+
+    for (int i = 0; i < pixel_count; i++) {
         Color sum {0, 0, 0};
-        for (auto & color : intensities[i].colors) {
+        for (int j = 0; j < samples_per_pixel; j++) {
+            const Color& color = intensities[i * samples_per_pixel + j];
             if (color.red < 0) {
                 sum += background;
             } else {
                 sum += color / max_intensity;
             }
         }
-        image[i] = (sum / 4).rgba();
+        pixels[i] = sum / samples_per_pixel;
+    }
+}
+
+void ResolveImage(const Color* intensities,
+                  int pixel_count,
+                  int samples_per_pixel,
+                  int* image,
+                  const Color& background,
+                  Integrator integrator
+) {
+    std::vector<Color> pixels(pixel_count);
+    ResolvePixels(intensities, pixel_count, samples_per_pixel, pixels.data(), background, integrator);
+    for (int i = 0; i < pixel_count; i++) {
+        image[i] = pixels[i].rgba();
+    }
+}
+
+// Traces rays through pixels and determines the color by applying light sources and reflection
+// Puts all the pixels into image
+void Raytracing(const Camera& camera,
+                const std::vector<Light>& light_sources,
+                const std::vector<std::unique_ptr<Primitive>>& primitives,
+                int* image,
+                int depth,
+                const Color& background,
+                const Color& ambient,
+                const RenderSettings& settings,
+                RenderStats* stats,
+                PixelCost* costs,
+                const VisibilityCache* visibility
+) {
+    const double start = omp_get_wtime();
+    const Bvh bvh(primitives, settings.builder);
+    if (stats) {
+        stats->build = omp_get_wtime() - start;
+    }
+    Raytracing(camera, light_sources, primitives, bvh, image, depth, background, ambient, settings, stats, costs,
+               visibility);
+}
+
+void Raytracing(const Camera& camera,
+                const std::vector<Light>& light_sources,
+                const std::vector<std::unique_ptr<Primitive>>& primitives,
+                const Bvh& bvh,
+                int* image,
+                int depth,
+                const Color& background,
+                const Color& ambient,
+                const RenderSettings& settings,
+                RenderStats* stats,
+                PixelCost* costs,
+                const VisibilityCache* visibility
+) {
+    const int width = camera.sw;
+    const int height = camera.sh;
+    // rows are first touched by the threads that trace them
+    const bool pin = settings.numa != NumaPolicy::Off;
+    FirstTouchArray<Color> intensities(height, width * settings.samples_per_pixel(), pin);
+
+    const double start = omp_get_wtime();
+    // the denoiser is guided by the primary hits
+    FirstTouchArray<PixelHit> hits(settings.denoise > 0 ? height : 0, width, pin);
+    std::unique_ptr<SceneReplicas> replicas;
+    if (settings.numa == NumaPolicy::Replicated && NumaNodeCount() > 1) {
+        replicas = std::make_unique<SceneReplicas>(light_sources, primitives, bvh);
+    }
+    TraceRows(camera, light_sources, primitives, bvh, 0, height, intensities.data(), depth, ambient, settings,
+              hits.empty() ? nullptr : hits.data(), replicas.get(), costs, visibility);
+    const double traced = omp_get_wtime();
+    if (settings.denoise > 0) {
+        ResolveDenoisedImage(intensities.data(), hits.data(), width, height, settings.samples_per_pixel(),
+                             image, background, settings.denoise, settings.integrator);
+    } else {
+        ResolveImage(intensities.data(), width * height, settings.samples_per_pixel(), image, background,
+                     settings.integrator);
+    }
+
+    if (stats) {
+        stats->trace = traced - start;
+        stats->resolve = omp_get_wtime() - traced;
+        stats->nodes = (int) bvh.nodes().size();
     }
 }
 
@@ -0,0 +1,346 @@
+//
+// Created by numi on 6/9/22.
+//
+
+#include <algorithm>
+
+#include "raytracing_bvh.h"
+
+namespace {
+
+// Boxes are grown a little, so that rays grazing flat primitives (axis aligned triangles)
+// and hits exactly at the current closest distance aren't culled by rounding
+Aabb Padded(const Aabb& box) {
+    const Vec3 size = box.max - box.min;
+    const float scale = std::max({size.x, size.y, size.z,
+                                  fabsf(box.min.x), fabsf(box.min.y), fabsf(box.min.z),
+                                  fabsf(box.max.x), fabsf(box.max.y), fabsf(box.max.z)});
+    const float pad = scale * 1e-5f + 1e-6f;
+    const Vec3 extent {pad, pad, pad};
+    return Aabb {box.min - extent, box.max + extent};
+}
+
+float Axis(const Vec3& vec, int axis) {
+    return axis == 0 ? vec.x : (axis == 1 ? vec.y : vec.z);
+}
+
+constexpr int sah_bins = 16;
+// cost of testing a node box relative to intersecting an item
+constexpr float node_cost = 0.5f;
+
+struct Bin {
+    Aabb bounds;
+    int count = 0;
+};
+
+struct Bins {
+    Bin axes[3][sah_bins];
+};
+
+struct Extent {
+    Aabb bounds;
+    Aabb centers;
+};
+
+// Calls add(local, i) for i in [begin, end) and merges value initialized locals into result,
+// merging only takes unions and sums, so the result is the same for any number of threads
+template <typename T, typename Add, typename Merge>
+void Reduce(int begin, int end, bool parallel, T* result, Add&& add, Merge&& merge) {
+    if (!parallel) {
+        for (int i = begin; i < end; i++) {
+            add(*result, i);
+        }
+        return;
+    }
+
+    #pragma omp parallel
+    {
+        T local {};
+        #pragma omp for nowait
+        for (int i = begin; i < end; i++) {
+            add(local, i);
+        }
+        #pragma omp critical
+        merge(*result, local);
+    }
+}
+
+// 10 bits of value spread to every third bit
+uint32_t SpreadBits(uint32_t value) {
+    value = (value | (value << 16u)) & 0x030000ffu;
+    value = (value | (value << 8u)) & 0x0300f00fu;
+    value = (value | (value << 4u)) & 0x030c30c3u;
+    value = (value | (value << 2u)) & 0x09249249u;
+    return value;
+}
+
+// 30 bit Morton code of a point in [0, 1]^3
+uint32_t MortonCode(const Vec3& point) {
+    const auto quantize = [](float value) {
+        return (uint32_t) std::min(std::max(value * 1024.0f, 0.0f), 1023.0f);
+    };
+    return (SpreadBits(quantize(point.x)) << 2u) | (SpreadBits(quantize(point.y)) << 1u) | SpreadBits(quantize(point.z));
+}
+
+}
+
+Bvh::Bvh(const std::vector<Aabb>& bounds, BvhBuilder builder, float item_cost): item_cost {item_cost} {
+    std::vector<Aabb> boxes(bounds.size());
+    for (int i = 0; i < bounds.size(); i++) {
+        if (bounds[i].Empty()) continue;
+        if (!bounds[i].Finite()) {
+            _unbounded.push_back(i);
+            continue;
+        }
+        boxes[i] = Padded(bounds[i]);
+        _items.push_back(i);
+    }
+    if (_items.empty()) return;
+
+    const int count = (int) _items.size();
+    const bool parallel = count >= parallel_items;
+    // slots that aren't used by leaves with several items keep count -1 until Compact
+    _nodes.assign(2 * count - 1, BvhNode {Aabb {}, 0, -1});
+    const Subtree root {0, 1, 0, count, 0};
+    std::vector<Subtree> deferred;
+
+    if (builder == BvhBuilder::Lbvh) {
+        Extent extent;
+        Reduce(0, count, parallel, &extent,
+               [&](Extent& local, int i) { local.centers.Extend(boxes[_items[i]].Center()); },
+               [](Extent& result, const Extent& local) { result.centers.Extend(local.centers); });
+        const Vec3 size = extent.centers.max - extent.centers.min;
+        const Vec3 scale {
+                size.x > 0 ? 1 / size.x : 0,
+                size.y > 0 ? 1 / size.y : 0,
+                size.z > 0 ? 1 / size.z : 0
+        };
+
+        std::vector<std::pair<uint32_t, int>> keys(count);
+        #pragma omp parallel for if(parallel)
+        for (int i = 0; i < count; i++) {
+            const Vec3 offset = boxes[_items[i]].Center() - extent.centers.min;
+            keys[i] = {MortonCode(Vec3 {offset.x * scale.x, offset.y * scale.y, offset.z * scale.z}), _items[i]};
+        }
+        // items break ties, so equal codes don't make the order depend on the sort
+        std::sort(keys.begin(), keys.end());
+        std::vector<uint32_t> codes(count);
+        for (int i = 0; i < count; i++) {
+            codes[i] = keys[i].first;
+            _items[i] = keys[i].second;
+        }
+
+        BuildLbvh(root, codes, boxes, parallel ? &deferred : nullptr);
+        #pragma omp parallel for schedule(dynamic)
+        for (int i = 0; i < deferred.size(); i++) {
+            BuildLbvh(deferred[i], codes, boxes, nullptr);
+        }
+
+        // children are stored after their parents
+        for (int i = (int) _nodes.size() - 1; i >= 0; i--) {
+            BvhNode& node = _nodes[i];
+            if (node.count != 0) continue;
+            node.bounds = _nodes[node.first].bounds;
+            node.bounds.Extend(_nodes[node.first + 1].bounds);
+        }
+    } else {
+        BuildSah(root, boxes, parallel ? &deferred : nullptr);
+        #pragma omp parallel for schedule(dynamic)
+        for (int i = 0; i < deferred.size(); i++) {
+            BuildSah(deferred[i], boxes, nullptr);
+        }
+    }
+
+    Compact();
+}
+
+Bvh::Bvh(const std::vector<std::unique_ptr<Primitive>>& primitives, BvhBuilder builder) : Bvh([&primitives] {
+    std::vector<Aabb> bounds;
+    bounds.reserve(primitives.size());
+    for (const auto& primitive: primitives) {
+        bounds.push_back(primitive->Bounds());
+    }
+    return bounds;
+}(), builder) {}
+
+void Bvh::Branch(const Subtree& subtree, int middle, Subtree children[2]) {
+    BvhNode& node = _nodes[subtree.node];
+    node.first = subtree.children;
+    node.count = 0;
+    const int left_count = middle - subtree.begin;
+    children[0] = Subtree {subtree.children, subtree.children + 2, subtree.begin, middle, subtree.depth + 1};
+    children[1] = Subtree {subtree.children + 1, subtree.children + 2 * left_count, middle, subtree.end,
+                           subtree.depth + 1};
+}
+
+// Split minimizing the surface area heuristic over sah_bins bins of item centers on each axis
+void Bvh::BuildSah(const Subtree& subtree, const std::vector<Aabb>& boxes, std::vector<Subtree>* deferred) {
+    const int begin = subtree.begin;
+    const int end = subtree.end;
+    const int count = end - begin;
+    const bool parallel = deferred != nullptr;
+
+    Extent extent;
+    Reduce(begin, end, parallel, &extent,
+           [&](Extent& local, int i) {
+               local.bounds.Extend(boxes[_items[i]]);
+               local.centers.Extend(boxes[_items[i]].Center());
+           },
+           [](Extent& result, const Extent& local) {
+               result.bounds.Extend(local.bounds);
+               result.centers.Extend(local.centers);
+           });
+    BvhNode& node = _nodes[subtree.node];
+    node.bounds = extent.bounds;
+    if (count == 1 || subtree.depth + 1 >= max_depth) {
+        node.first = begin;
+        node.count = count;
+        return;
+    }
+
+    const Vec3 size = extent.centers.max - extent.centers.min;
+    const auto bin_of = [&](int item, int axis) {
+        const float offset = Axis(boxes[item].Center(), axis) - Axis(extent.centers.min, axis);
+        return std::min(sah_bins - 1, (int) (offset * (sah_bins / Axis(size, axis))));
+    };
+
+    Bins bins;
+    Reduce(begin, end, parallel, &bins,
+           [&](Bins& local, int i) {
+               for (int axis = 0; axis < 3; axis++) {
+                   if (Axis(size, axis) <= 0) continue;
+                   Bin& bin = local.axes[axis][bin_of(_items[i], axis)];
+                   bin.bounds.Extend(boxes[_items[i]]);
+                   bin.count++;
+               }
+           },
+           [](Bins& result, const Bins& local) {
+               for (int axis = 0; axis < 3; axis++) {
+                   for (int b = 0; b < sah_bins; b++) {
+                       result.axes[axis][b].bounds.Extend(local.axes[axis][b].bounds);
+                       result.axes[axis][b].count += local.axes[axis][b].count;
+                   }
+               }
+           });
+
+    // best split puts bins [0, best_bin] on the left
+    float best_cost = INFINITY;
+    int best_axis = -1, best_bin = 0;
+    for (int axis = 0; axis < 3; axis++) {
+        if (Axis(size, axis) <= 0) continue;
+        const Bin* axis_bins = bins.axes[axis];
+        float right_costs[sah_bins];
+        Aabb right;
+        int right_count = 0;
+        for (int b = sah_bins - 1; b > 0; b--) {
+            right.Extend(axis_bins[b].bounds);
+            right_count += axis_bins[b].count;
+            right_costs[b - 1] = right_count > 0 ? right.Area() * (float) right_count : INFINITY;
+        }
+        Aabb left;
+        int left_count = 0;
+        for (int b = 0; b < sah_bins - 1; b++) {
+            left.Extend(axis_bins[b].bounds);
+            left_count += axis_bins[b].count;
+            if (left_count == 0) continue;
+            const float cost = left.Area() * (float) left_count + right_costs[b];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_bin = b;
+            }
+        }
+    }
+
+    // a leaf costs its items, an inner node costs its box tests and the items of the children
+    // weighted by the probability of a ray that hits the node hitting them
+    const float leaf_cost = item_cost * (float) count;
+    const float split_cost = 2 * node_cost + item_cost * best_cost / extent.bounds.Area();
+    if (count <= max_leaf_size && (best_axis < 0 || leaf_cost <= split_cost)) {
+        node.first = begin;
+        node.count = count;
+        return;
+    }
+
+    int middle;
+    if (best_axis < 0) {
+        // all centers coincide, any halves are as good
+        middle = (begin + end) / 2;
+    } else {
+        middle = (int) (std::partition(_items.begin() + begin, _items.begin() + end, [&](int item) {
+            return bin_of(item, best_axis) <= best_bin;
+        }) - _items.begin());
+    }
+
+    Subtree children[2];
+    Branch(subtree, middle, children);
+    for (const Subtree& child: children) {
+        if (deferred && child.end - child.begin < parallel_items) {
+            deferred->push_back(child);
+        } else {
+            BuildSah(child, boxes, deferred);
+        }
+    }
+}
+
+// Items are sorted by Morton codes of their centers, nodes split where the highest
+// differing bit of the codes in their range changes
+void Bvh::BuildLbvh(const Subtree& subtree, const std::vector<uint32_t>& codes, const std::vector<Aabb>& boxes,
+                    std::vector<Subtree>* deferred) {
+    const int begin = subtree.begin;
+    const int end = subtree.end;
+    const int count = end - begin;
+
+    if (count <= max_leaf_size || subtree.depth + 1 >= max_depth) {
+        BvhNode& node = _nodes[subtree.node];
+        for (int i = begin; i < end; i++) {
+            node.bounds.Extend(boxes[_items[i]]);
+        }
+        node.first = begin;
+        node.count = count;
+        return;
+    }
+
+    int middle = (begin + end) / 2;
+    const uint32_t difference = codes[begin] ^ codes[end - 1];
+    if (difference != 0) {
+        uint32_t bit = 1u << 31u;
+        while (!(difference & bit)) {
+            bit >>= 1u;
+        }
+        middle = (int) (std::partition_point(codes.begin() + begin, codes.begin() + end, [bit](uint32_t code) {
+            return !(code & bit);
+        }) - codes.begin());
+    }
+
+    Subtree children[2];
+    Branch(subtree, middle, children);
+    for (const Subtree& child: children) {
+        if (deferred && child.end - child.begin < parallel_items) {
+            deferred->push_back(child);
+        } else {
+            BuildLbvh(child, codes, boxes, deferred);
+        }
+    }
+}
+
+// Drops unused slots, keeps the depth first order of subtrees
+void Bvh::Compact() {
+    std::vector<int> index(_nodes.size());
+    int used = 0;
+    for (int i = 0; i < _nodes.size(); i++) {
+        index[i] = used;
+        if (_nodes[i].count >= 0) used++;
+    }
+
+    std::vector<BvhNode> nodes;
+    nodes.reserve(used);
+    for (const BvhNode& node: _nodes) {
+        if (node.count < 0) continue;
+        nodes.push_back(node);
+        if (node.count == 0) {
+            nodes.back().first = index[node.first];
+        }
+    }
+    _nodes = std::move(nodes);
+}
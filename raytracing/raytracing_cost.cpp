@@ -0,0 +1,111 @@
+//
+// Created by numi on 6/18/22.
+//
+
+#include <vector>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+
+#include "raytracing_cost.h"
+#include "raytracing_scene_io.h"
+
+namespace {
+
+constexpr float scale_percentile = 0.99f;
+
+// t in [0, 1] to blue, cyan, green, yellow, red
+Color Ramp(float t) {
+    constexpr Color stops[5] = {
+            Color {0, 0, 1},
+            Color {0, 1, 1},
+            Color {0, 1, 0},
+            Color {1, 1, 0},
+            Color {1, 0, 0}
+    };
+    const float position = std::clamp(t, 0.0f, 1.0f) * 4;
+    const int stop = std::min((int) position, 3);
+    const float f = position - (float) stop;
+    return stops[stop] * (1 - f) + stops[stop + 1] * f;
+}
+
+int Channel(int pixel, int shift) {
+    return (pixel >> shift) & 0xFF;
+}
+
+}
+
+float CostValue(const PixelCost& cost, CostMetric metric) {
+    switch (metric) {
+        case CostMetric::Nanoseconds:
+            return cost.nanoseconds;
+        case CostMetric::Intersections:
+            return (float) cost.intersections;
+        case CostMetric::ShadowRays:
+            return (float) cost.shadow_rays;
+        case CostMetric::Bounces:
+            return (float) cost.bounces;
+    }
+    return 0;
+}
+
+void CostHeatmap(const PixelCost* costs, int pixel_count, CostMetric metric, int* heatmap) {
+    if (pixel_count <= 0) return;
+    std::vector<float> values(pixel_count);
+    for (int i = 0; i < pixel_count; i++) {
+        values[i] = CostValue(costs[i], metric);
+    }
+
+    std::vector<float> sorted = values;
+    const int rank = std::min(pixel_count - 1, (int) (scale_percentile * (float) pixel_count));
+    std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+    float scale = sorted[rank];
+    if (scale <= 0) {
+        scale = *std::max_element(values.begin(), values.end());
+    }
+
+    for (int i = 0; i < pixel_count; i++) {
+        heatmap[i] = Ramp(scale > 0 ? values[i] / scale : 0).rgba();
+    }
+}
+
+void BlendHeatmap(const int* image, const int* heatmap, int pixel_count, float opacity, int* result) {
+    const int weight = (int) (std::clamp(opacity, 0.0f, 1.0f) * 256);
+    for (int i = 0; i < pixel_count; i++) {
+        int pixel = 0xFF << 24;
+        for (int shift = 0; shift < 24; shift += 8) {
+            const int a = Channel(image[i], shift);
+            const int b = Channel(heatmap[i], shift);
+            pixel |= ((a * (256 - weight) + b * weight) >> 8) << shift;
+        }
+        result[i] = pixel;
+    }
+}
+
+bool SaveCostMap(const std::string& path_prefix,
+                 const PixelCost* costs,
+                 int width, int height,
+                 CostMetric metric
+) {
+    std::vector<int> heatmap(width * height);
+    CostHeatmap(costs, width * height, metric, heatmap.data());
+    if (!SavePpm(path_prefix + ".ppm", heatmap.data(), width, height)) {
+        return false;
+    }
+
+    const std::string csv_path = path_prefix + ".csv";
+    std::ofstream csv(csv_path);
+    csv << "x,y,nanoseconds,intersections,shadow_rays,bounces\n";
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            const PixelCost& cost = costs[width * y + x];
+            csv << x << ',' << y << ',' << cost.nanoseconds << ',' << cost.intersections << ','
+                << cost.shadow_rays << ',' << cost.bounces << '\n';
+        }
+    }
+    if (!csv) {
+        std::cerr << "Can't write cost file " << csv_path << '\n';
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,116 @@
+//
+// Created by numi on 6/12/22.
+//
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#include "raytracing_denoise.h"
+
+namespace {
+
+// pixels are filtered by square blocks, so the taps of a block stay in cache
+constexpr int block_size = 32;
+constexpr float kernel[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+
+// edge stopping parameters
+constexpr int normal_squarings = 5; // weight is cos^32 of the angle between normals
+constexpr float plane_sigma = 1; // distance from the tangent plane in pixel footprints per tap step
+constexpr float color_sigma = 0.5f; // relative color difference, halved every pass
+
+float NormalWeight(float cosine) {
+    for (int i = 0; i < normal_squarings; i++) {
+        cosine *= cosine;
+    }
+    return cosine;
+}
+
+// one pass with taps step pixels apart from source to target
+void FilterPass(int width, int height, const PixelHit* hits, const Color* source, Color* target, int step,
+                float color_scale) {
+    const int blocks_x = (width + block_size - 1) / block_size;
+    const int blocks_y = (height + block_size - 1) / block_size;
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int block = 0; block < blocks_x * blocks_y; block++) {
+        const int x_begin = (block % blocks_x) * block_size;
+        const int y_begin = (block / blocks_x) * block_size;
+        const int x_end = std::min(width, x_begin + block_size);
+        const int y_end = std::min(height, y_begin + block_size);
+
+        for (int y = y_begin; y < y_end; y++) {
+            for (int x = x_begin; x < x_end; x++) {
+                const int p = width * y + x;
+                const PixelHit& center = hits[p];
+                if (center.primitive == PixelHit::background) {
+                    target[p] = source[p];
+                    continue;
+                }
+                const float luminance = Luminance(source[p]);
+                const float plane_scale = 1 / (plane_sigma * (float) step * center.footprint + 1e-6f);
+
+                Color sum;
+                float weight_sum = 0;
+                for (int dy = -2; dy <= 2; dy++) {
+                    const int qy = y + dy * step;
+                    if (qy < 0 || qy >= height) continue;
+                    for (int dx = -2; dx <= 2; dx++) {
+                        const int qx = x + dx * step;
+                        if (qx < 0 || qx >= width) continue;
+                        const int q = width * qy + qx;
+                        const PixelHit& tap = hits[q];
+                        if (tap.primitive == PixelHit::background) continue;
+                        // mixed pixels lie on silhouettes, they are left to the other weights
+                        if (center.primitive != tap.primitive
+                            && center.primitive != PixelHit::mixed && tap.primitive != PixelHit::mixed) continue;
+
+                        const float cosine = center.normal * tap.normal;
+                        if (cosine <= 0) continue;
+                        const float plane = fabsf(center.normal * (tap.position - center.position)) * plane_scale;
+                        const float color = fabsf(Luminance(source[q]) - luminance) * color_scale
+                                / (std::max(luminance, Luminance(source[q])) + 1e-3f);
+                        const float weight = kernel[dx + 2] * kernel[dy + 2]
+                                * NormalWeight(cosine) * expf(-plane - color);
+                        sum += source[q] * weight;
+                        weight_sum += weight;
+                    }
+                }
+                // a mixed pixel may find no tap facing its normal, it is kept as it is then
+                target[p] = weight_sum > 0 ? sum / weight_sum : source[p];
+            }
+        }
+    }
+}
+
+}
+
+void Denoise(int width, int height, const PixelHit* hits, Color* pixels, int passes) {
+    std::vector<Color> buffer(width * height);
+    Color* source = pixels;
+    Color* target = buffer.data();
+    for (int pass = 0; pass < passes; pass++) {
+        FilterPass(width, height, hits, source, target, 1 << pass, (float) (1 << pass) / color_sigma);
+        std::swap(source, target);
+    }
+    if (source != pixels) {
+        std::copy(source, source + width * height, pixels);
+    }
+}
+
+void ResolveDenoisedImage(const Color* intensities,
+                          const PixelHit* hits,
+                          int width, int height,
+                          int samples_per_pixel,
+                          int* image,
+                          const Color& background,
+                          int passes,
+                          Integrator integrator
+) {
+    std::vector<Color> pixels(width * height);
+    ResolvePixels(intensities, width * height, samples_per_pixel, pixels.data(), background, integrator);
+    Denoise(width, height, hits, pixels.data(), passes);
+    for (int i = 0; i < width * height; i++) {
+        image[i] = pixels[i].rgba();
+    }
+}
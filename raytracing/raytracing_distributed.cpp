@@ -0,0 +1,295 @@
+//
+// Created by numi on 6/2/22.
+//
+
+#include <iostream>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "raytracing_distributed.h"
+#include "raytracing_scene_io.h"
+#include "raytracing_bvh.h"
+#include "raytracing_denoise.h"
+
+namespace {
+
+// Messages are a 64-bit size followed by bytes, tile requests and replies start with
+// the row range, a negative row_begin asks the worker to exit
+// Replies carry the intensities of the rows, then their primary hits if the job denoises
+
+bool SendAll(int fd, const void* data, size_t size) {
+    const char* bytes = (const char*) data;
+    while (size > 0) {
+        const ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        bytes += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+bool ReceiveAll(int fd, void* data, size_t size) {
+    char* bytes = (char*) data;
+    while (size > 0) {
+        const ssize_t received = recv(fd, bytes, size, 0);
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) return false;
+        bytes += received;
+        size -= received;
+    }
+    return true;
+}
+
+bool SendMessage(int fd, const std::vector<char>& message) {
+    const uint64_t size = message.size();
+    return SendAll(fd, &size, sizeof(size)) && SendAll(fd, message.data(), message.size());
+}
+
+bool ReceiveMessage(int fd, std::vector<char>* message) {
+    uint64_t size;
+    if (!ReceiveAll(fd, &size, sizeof(size))) return false;
+    message->resize(size);
+    return ReceiveAll(fd, message->data(), size);
+}
+
+struct RowRange {
+    int32_t begin = -1, end = -1;
+};
+
+struct Worker {
+    pid_t pid = -1;
+    int fd = -1;
+    RowRange tile;
+};
+
+bool StartWorker(const std::string& executable, Worker* worker) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) return false;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+
+    // everything the child needs is prepared before fork, it only calls exec
+    char fd_arg[16];
+    snprintf(fd_arg, sizeof(fd_arg), "%d", fds[1]);
+
+    const pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    if (pid == 0) {
+        execl(executable.c_str(), executable.c_str(), render_worker_flag, fd_arg, (char*) nullptr);
+        _exit(127);
+    }
+
+    close(fds[1]);
+    worker->pid = pid;
+    worker->fd = fds[0];
+    return true;
+}
+
+void StopWorker(Worker* worker) {
+    if (worker->fd >= 0) {
+        const RowRange stop;
+        SendAll(worker->fd, &stop, sizeof(stop));
+        close(worker->fd);
+        worker->fd = -1;
+    }
+    if (worker->pid > 0) {
+        waitpid(worker->pid, nullptr, 0);
+        worker->pid = -1;
+    }
+}
+
+struct RenderJob {
+    int depth;
+    Color ambient;
+    RenderSettings settings;
+};
+
+}
+
+void RaytracingDistributed(const Camera& camera,
+                           const std::vector<Light>& light_sources,
+                           const std::vector<std::unique_ptr<Primitive>>& primitives,
+                           int* image,
+                           const DistributedOptions& options,
+                           int depth,
+                           const Color& background,
+                           const Color& ambient,
+                           const RenderSettings& settings
+) {
+    const int width = camera.sw;
+    const int height = camera.sh;
+    const int tile_rows = std::max(1, options.tile_rows);
+    const int samples_per_pixel = settings.samples_per_pixel();
+
+    ByteWriter job;
+    job.Write(RenderJob {depth, ambient, settings});
+    SerializeCamera(job, camera);
+    SerializeScene(job, light_sources, primitives);
+
+    std::vector<Worker> workers;
+    for (int i = 0; i < options.workers; i++) {
+        Worker worker;
+        if (!StartWorker(options.worker_executable, &worker)) {
+            std::cerr << "Failed to start render worker\n";
+            break;
+        }
+        if (!SendMessage(worker.fd, job.data())) {
+            StopWorker(&worker);
+            continue;
+        }
+        workers.push_back(worker);
+    }
+
+    if (workers.empty()) {
+        Raytracing(camera, light_sources, primitives, image, depth, background, ambient, settings);
+        return;
+    }
+
+    std::vector<Color> intensities(width * height * samples_per_pixel);
+    // primary hits for the denoiser come back after the intensities of a tile
+    const bool denoise = settings.denoise > 0;
+    std::vector<PixelHit> hits(denoise ? width * height : 0);
+    // tiles of failed workers are traced locally after the rest is done
+    std::vector<RowRange> orphaned_tiles;
+    int next_row = 0;
+
+    auto assign_tile = [&](Worker& worker) {
+        worker.tile = RowRange {};
+        if (next_row >= height) return;
+        const RowRange tile {next_row, std::min(height, next_row + tile_rows)};
+        if (!SendAll(worker.fd, &tile, sizeof(tile))) {
+            orphaned_tiles.push_back(tile);
+            StopWorker(&worker);
+            return;
+        }
+        worker.tile = tile;
+        next_row = tile.end;
+    };
+
+    for (auto& worker: workers) {
+        assign_tile(worker);
+    }
+
+    std::vector<pollfd> poll_fds;
+    std::vector<Worker*> polled_workers;
+    while (true) {
+        poll_fds.clear();
+        polled_workers.clear();
+        for (auto& worker: workers) {
+            if (worker.fd < 0 || worker.tile.begin < 0) continue;
+            poll_fds.push_back(pollfd {worker.fd, POLLIN, 0});
+            polled_workers.push_back(&worker);
+        }
+        if (poll_fds.empty()) break;
+
+        if (poll(poll_fds.data(), poll_fds.size(), -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        for (size_t i = 0; i < poll_fds.size(); i++) {
+            if (poll_fds[i].revents == 0) continue;
+            Worker& worker = *polled_workers[i];
+            const RowRange tile = worker.tile;
+            Color* const tile_intensities = intensities.data() + tile.begin * width * samples_per_pixel;
+            const size_t tile_size = sizeof(Color) * width * (tile.end - tile.begin) * samples_per_pixel;
+            const size_t hits_size = sizeof(PixelHit) * width * (tile.end - tile.begin);
+
+            RowRange reply;
+            if (!ReceiveAll(worker.fd, &reply, sizeof(reply))
+                || reply.begin != tile.begin || reply.end != tile.end
+                || !ReceiveAll(worker.fd, tile_intensities, tile_size)
+                || (denoise && !ReceiveAll(worker.fd, hits.data() + tile.begin * width, hits_size))) {
+                std::cerr << "Render worker " << worker.pid << " failed\n";
+                orphaned_tiles.push_back(tile);
+                worker.tile = RowRange {};
+                StopWorker(&worker);
+                continue;
+            }
+            assign_tile(worker);
+        }
+    }
+
+    // rows never handed out because every worker failed are orphaned too
+    if (next_row < height) {
+        orphaned_tiles.push_back(RowRange {next_row, height});
+    }
+    for (auto& worker: workers) {
+        if (worker.tile.begin >= 0) {
+            orphaned_tiles.push_back(worker.tile);
+        }
+        StopWorker(&worker);
+    }
+
+    const Bvh bvh(primitives, settings.builder);
+    for (const auto& tile: orphaned_tiles) {
+        TraceRows(camera, light_sources, primitives, bvh,
+                  tile.begin, tile.end,
+                  intensities.data() + tile.begin * width * samples_per_pixel,
+                  depth, ambient, settings,
+                  denoise ? hits.data() + tile.begin * width : nullptr);
+    }
+
+    if (denoise) {
+        ResolveDenoisedImage(intensities.data(), hits.data(), width, height, samples_per_pixel,
+                             image, background, settings.denoise, settings.integrator);
+    } else {
+        ResolveImage(intensities.data(), width * height, samples_per_pixel, image, background,
+                     settings.integrator);
+    }
+}
+
+int RunRenderWorker(int fd) {
+    std::vector<char> message;
+    if (!ReceiveMessage(fd, &message)) return EXIT_FAILURE;
+
+    ByteReader in(message.data(), message.size());
+    RenderJob job {};
+    Camera camera {Vec3 {}, Vec3 {0, 0, 1}, Vec3 {0, 1, 0}, 0, 0, 0, 0};
+    std::vector<Light> light_sources;
+    std::vector<std::unique_ptr<Primitive>> primitives;
+    if (!in.Read(&job)
+        || !DeserializeCamera(in, &camera)
+        || !DeserializeScene(in, &light_sources, &primitives)) {
+        std::cerr << "Render worker received malformed scene\n";
+        return EXIT_FAILURE;
+    }
+
+    const Bvh bvh(primitives, job.settings.builder);
+    const bool denoise = job.settings.denoise > 0;
+    std::vector<Color> intensities;
+    std::vector<PixelHit> hits;
+    RowRange tile;
+    while (ReceiveAll(fd, &tile, sizeof(tile)) && tile.begin >= 0) {
+        if (tile.end <= tile.begin || tile.end > camera.sh) return EXIT_FAILURE;
+
+        intensities.resize(camera.sw * (tile.end - tile.begin) * job.settings.samples_per_pixel());
+        hits.resize(denoise ? camera.sw * (tile.end - tile.begin) : 0);
+        TraceRows(camera, light_sources, primitives, bvh,
+                  tile.begin, tile.end,
+                  intensities.data(),
+                  job.depth, job.ambient, job.settings,
+                  denoise ? hits.data() : nullptr);
+
+        if (!SendAll(fd, &tile, sizeof(tile))
+            || !SendAll(fd, intensities.data(), sizeof(Color) * intensities.size())
+            || (denoise && !SendAll(fd, hits.data(), sizeof(PixelHit) * hits.size()))) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    close(fd);
+    return EXIT_SUCCESS;
+}
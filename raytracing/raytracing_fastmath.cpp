@@ -0,0 +1,50 @@
+//
+// Created by numi on 6/20/22.
+//
+
+#include <cstdlib>
+#include <algorithm>
+#include <omp.h>
+
+#include "raytracing_fastmath.h"
+#include "raytracing_bvh.h"
+
+FastMathReport ValidateFastMath(const Camera& camera,
+                                const std::vector<Light>& light_sources,
+                                const std::vector<std::unique_ptr<Primitive>>& primitives,
+                                int depth,
+                                const Color& background,
+                                const Color& ambient,
+                                const RenderSettings& settings
+) {
+    const int pixel_count = camera.sw * camera.sh;
+    const Bvh bvh(primitives, settings.builder);
+
+    RenderSettings precise_settings = settings;
+    precise_settings.fast_math = false;
+    RenderSettings fast_settings = settings;
+    fast_settings.fast_math = true;
+
+    std::vector<int> precise(pixel_count), fast(pixel_count);
+    FastMathReport report;
+    double start = omp_get_wtime();
+    Raytracing(camera, light_sources, primitives, bvh, precise.data(), depth, background, ambient, precise_settings);
+    report.precise_seconds = omp_get_wtime() - start;
+    start = omp_get_wtime();
+    Raytracing(camera, light_sources, primitives, bvh, fast.data(), depth, background, ambient, fast_settings);
+    report.fast_seconds = omp_get_wtime() - start;
+
+    double total_error = 0;
+    for (int i = 0; i < pixel_count; i++) {
+        int pixel_error = 0;
+        for (int shift = 0; shift < 24; shift += 8) {
+            const int error = abs(((precise[i] >> shift) & 0xFF) - ((fast[i] >> shift) & 0xFF));
+            pixel_error = std::max(pixel_error, error);
+            total_error += error;
+        }
+        report.max_error = std::max(report.max_error, pixel_error);
+        if (pixel_error > 1) report.differing_pixels++;
+    }
+    report.mean_error = pixel_count > 0 ? total_error / (3.0 * pixel_count) : 0;
+    return report;
+}
@@ -0,0 +1,104 @@
+//
+// Created by numi on 6/23/22.
+//
+
+#include <cmath>
+#include <algorithm>
+
+#include "raytracing_frustum.h"
+
+namespace {
+
+// samples stay inside their pixels, the margin only covers rounding
+constexpr float pixel_margin = 0.5f;
+
+// squared distance from point to the nearest point of box
+float SquaredDistance(const Vec3& point, const Aabb& box) {
+    const Vec3 nearest {
+            std::clamp(point.x, box.min.x, box.max.x),
+            std::clamp(point.y, box.min.y, box.max.y),
+            std::clamp(point.z, box.min.z, box.max.z)
+    };
+    const Vec3 offset = nearest - point;
+    return offset * offset;
+}
+
+}
+
+Frustum::Frustum(const Camera& camera, const Tile& tile) {
+    const Vec3 z = camera.z.norm();
+    const Vec3 right = camera.right.norm();
+    const Vec3 up = camera.up.norm();
+    // image plane coordinates of the tile edges, laid out as in SampleRays
+    const float left = (float) tile.x - pixel_margin - (float) camera.sw * 0.5f;
+    const float right_edge = (float) (tile.x + tile.width) + pixel_margin - (float) camera.sw * 0.5f;
+    const float top = (float) camera.sh * 0.5f + 0.5f - ((float) tile.y - pixel_margin);
+    const float bottom = (float) camera.sh * 0.5f + 0.5f - ((float) (tile.y + tile.height) + pixel_margin);
+    const auto direction = [&](float x, float y) {
+        return z * camera.zn + right * x + up * y;
+    };
+    const Vec3 inside = direction((left + right_edge) * 0.5f, (top + bottom) * 0.5f);
+
+    // side planes go through the eye and two corners of the tile
+    const Vec3 corners[4] = {
+            direction(left, top), direction(right_edge, top),
+            direction(right_edge, bottom), direction(left, bottom)
+    };
+    for (int i = 0; i < 4; i++) {
+        Vec3 normal = corners[i].cross(corners[(i + 1) % 4]);
+        if (normal * inside > 0) {
+            normal = normal * -1.0f;
+        }
+        normals[i] = normal;
+        offsets[i] = normal * camera.eye;
+    }
+
+    normals[4] = z * -1.0f;
+    offsets[4] = -(z * camera.eye + camera.near_clip);
+    normals[5] = z;
+    offsets[5] = camera.zf > camera.near_clip ? z * camera.eye + camera.zf : INFINITY;
+}
+
+Overlap Frustum::Classify(const Aabb& box) const {
+    Overlap overlap = Overlap::Full;
+    for (int i = 0; i < plane_count; i++) {
+        const Vec3& normal = normals[i];
+        // corners of the box deepest inside and farthest outside of the plane
+        const Vec3 nearest {
+                normal.x >= 0 ? box.min.x : box.max.x,
+                normal.y >= 0 ? box.min.y : box.max.y,
+                normal.z >= 0 ? box.min.z : box.max.z
+        };
+        const Vec3 farthest {
+                normal.x >= 0 ? box.max.x : box.min.x,
+                normal.y >= 0 ? box.max.y : box.min.y,
+                normal.z >= 0 ? box.max.z : box.min.z
+        };
+        if (normal * nearest > offsets[i]) return Overlap::None;
+        if (normal * farthest > offsets[i]) {
+            overlap = Overlap::Partial;
+        }
+    }
+    return overlap;
+}
+
+void CullTile(const Camera& camera, const Tile& tile, const Bvh& bvh, BvhCut* cut) {
+    const Frustum frustum(camera, tile);
+    bvh.Cut([&](const Aabb& box) { return frustum.Classify(box); }, cut);
+    // traversals start with the nearest nodes, so that hits in them cut the farther ones short
+    float distances[BvhCut::max_nodes];
+    for (int i = 0; i < cut->count; i++) {
+        distances[i] = SquaredDistance(camera.eye, bvh.nodes()[cut->nodes[i]].bounds);
+    }
+    for (int i = 1; i < cut->count; i++) {
+        const int node = cut->nodes[i];
+        const float distance = distances[i];
+        int j = i;
+        for (; j > 0 && distances[j - 1] > distance; j--) {
+            cut->nodes[j] = cut->nodes[j - 1];
+            distances[j] = distances[j - 1];
+        }
+        cut->nodes[j] = node;
+        distances[j] = distance;
+    }
+}
@@ -0,0 +1,278 @@
+//
+// Created by numi on 6/10/22.
+//
+
+#include <cmath>
+#include <omp.h>
+
+#include "raytracing_incremental.h"
+#include "raytracing_denoise.h"
+
+namespace {
+
+bool Same(const Vec3& a, const Vec3& b) {
+    return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+
+bool Same(const Color& a, const Color& b) {
+    return a.red == b.red && a.green == b.green && a.blue == b.blue;
+}
+
+bool Same(const Camera& a, const Camera& b) {
+    return Same(a.eye, b.eye) && Same(a.z, b.z) && Same(a.right, b.right) && Same(a.up, b.up)
+        && a.zn == b.zn && a.zf == b.zf && a.near_clip == b.near_clip && a.sw == b.sw && a.sh == b.sh;
+}
+
+bool Same(const RenderSettings& a, const RenderSettings& b) {
+    return a.samples == b.samples && a.pattern == b.pattern && a.seed == b.seed && a.builder == b.builder
+        && a.fast_math == b.fast_math && a.integrator == b.integrator;
+}
+
+bool Same(const Aabb& a, const Aabb& b) {
+    return Same(a.min, b.min) && Same(a.max, b.max);
+}
+
+// radius of a sphere around light.position containing all points of the light
+float LightExtent(const Light& light) {
+    switch (light.shape) {
+        case LightShape::Point:
+            return 0;
+        case LightShape::Sphere:
+            return light.radius;
+        case LightShape::Rectangle:
+            return light.u.length() + light.v.length();
+    }
+    return 0;
+}
+
+Aabb Grown(const Aabb& box, float size) {
+    const Vec3 offset {size, size, size};
+    return Aabb {box.min - offset, box.max + offset};
+}
+
+// whether start + t * (end - start), t in [0, 1] crosses box
+bool SegmentCrosses(const Vec3& start, const Vec3& end, const Aabb& box) {
+    const Vec3 ray = end - start;
+    const Vec3 inv_ray {1 / ray.x, 1 / ray.y, 1 / ray.z};
+    float t_near;
+    return box.Intersect(start, inv_ray, 0, 1, &t_near);
+}
+
+// Whether light can reach a surface at hit: some point of the light is in front of it
+// Other samples of the pixel hit the surface up to footprint away with slightly different normals,
+// so the test is loosened by footprint and a few degrees
+bool LightMayReach(const Light& light, const PixelHit& hit) {
+    const Vec3 light_vec = light.position - hit.position;
+    const float margin = LightExtent(light) + hit.footprint + 0.05f * light_vec.length();
+    return hit.normal * light_vec >= -margin;
+}
+
+void MarkAll(std::vector<bool>& dirty) {
+    dirty.assign(dirty.size(), true);
+}
+
+// marks pixels whose rays may cross box, the whole frame if box reaches behind the eye
+void MarkProjection(const Camera& camera, const Aabb& box, std::vector<bool>& dirty) {
+    if (box.Empty()) return;
+    if (!box.Finite()) {
+        MarkAll(dirty);
+        return;
+    }
+
+    const Vec3 z = camera.z.norm();
+    const Vec3 right = camera.right.norm();
+    const Vec3 up = camera.up.norm();
+    float x_min = INFINITY, x_max = -INFINITY;
+    float y_min = INFINITY, y_max = -INFINITY;
+    for (int i = 0; i < 8; i++) {
+        const Vec3 corner {
+                i & 1 ? box.max.x : box.min.x,
+                i & 2 ? box.max.y : box.min.y,
+                i & 4 ? box.max.z : box.min.z
+        };
+        const Vec3 offset = corner - camera.eye;
+        const float distance = offset * z;
+        if (distance <= 0) {
+            MarkAll(dirty);
+            return;
+        }
+        // pixel coordinates of the point where the ray to corner crosses the image plane
+        const Vec3 plane = offset * (camera.zn / distance);
+        const float x = plane * right + camera.sw * 0.5f;
+        const float y = camera.sh * 0.5f + 0.5f - plane * up;
+        x_min = std::min(x_min, x);
+        x_max = std::max(x_max, x);
+        y_min = std::min(y_min, y);
+        y_max = std::max(y_max, y);
+    }
+
+    // one more pixel around for rounding and sample offsets
+    const int x_begin = std::max(0, (int) floorf(x_min) - 1);
+    const int x_end = std::min(camera.sw, (int) ceilf(x_max) + 1);
+    const int y_begin = std::max(0, (int) floorf(y_min) - 1);
+    const int y_end = std::min(camera.sh, (int) ceilf(y_max) + 1);
+    for (int y = y_begin; y < y_end; y++) {
+        for (int x = x_begin; x < x_end; x++) {
+            dirty[camera.sw * y + x] = true;
+        }
+    }
+}
+
+}
+
+void RenderCache::MarkPrimitive(const PrimitiveChange& change,
+                                const std::vector<Light>& light_sources,
+                                const std::vector<std::unique_ptr<Primitive>>& primitives,
+                                std::vector<bool>& dirty) const {
+    const Aabb& old_bounds = change.old_bounds;
+    const Aabb new_bounds = primitives[change.index]->Bounds();
+    MarkProjection(camera, old_bounds, dirty);
+    MarkProjection(camera, new_bounds, dirty);
+
+    // the material alone changed, so shadows stay the same
+    const bool moved = !Same(old_bounds, new_bounds);
+    for (int i = 0; i < hits.size(); i++) {
+        const PixelHit& hit = hits[i];
+        if (dirty[i] || hit.primitive == PixelHit::background) continue;
+        if (hit.primitive == change.index || hit.primitive == PixelHit::mixed || hit.reflected) {
+            dirty[i] = true;
+            continue;
+        }
+        if (!moved) continue;
+
+        // rays to points of a light stay within its extent around the ray to its center,
+        // and the other samples of the pixel start within footprint
+        for (const auto& light: light_sources) {
+            const float size = LightExtent(light) + hit.footprint;
+            if (SegmentCrosses(hit.position, light.position, Grown(old_bounds, size))
+                || SegmentCrosses(hit.position, light.position, Grown(new_bounds, size))) {
+                dirty[i] = true;
+                break;
+            }
+        }
+    }
+}
+
+void RenderCache::MarkLight(const LightChange& change, const Light& new_light, std::vector<bool>& dirty) const {
+    for (int i = 0; i < hits.size(); i++) {
+        const PixelHit& hit = hits[i];
+        if (dirty[i] || hit.primitive == PixelHit::background) continue;
+        dirty[i] = hit.primitive == PixelHit::mixed || hit.reflected
+                || LightMayReach(change.old_light, hit) || LightMayReach(new_light, hit);
+    }
+}
+
+void RenderCache::Render(const Camera& camera,
+                         const std::vector<Light>& light_sources,
+                         const std::vector<std::unique_ptr<Primitive>>& primitives,
+                         int* image,
+                         int depth,
+                         const Color& background,
+                         const Color& ambient,
+                         const RenderSettings& settings,
+                         RenderStats* stats,
+                         const VisibilityCache* visibility
+) {
+    const int width = camera.sw;
+    const int height = camera.sh;
+    const int tiles_x = (width + tile_size - 1) / tile_size;
+    const int tiles_y = (height + tile_size - 1) / tile_size;
+    const double start = omp_get_wtime();
+    double build_time = 0;
+
+    bool full = !valid
+            || !Same(this->camera, camera)
+            || !Same(this->settings, settings)
+            || this->depth != depth
+            || this->visibility != visibility
+            || !Same(this->ambient, ambient)
+            || light_count != light_sources.size()
+            || primitive_count != primitives.size();
+    for (const auto& change: primitive_changes) {
+        full = full || change.index < 0 || change.index >= primitives.size();
+    }
+    for (const auto& change: light_changes) {
+        full = full || change.index < 0 || change.index >= light_sources.size();
+    }
+
+    if (full) {
+        this->camera = camera;
+        this->settings = settings;
+        this->depth = depth;
+        this->visibility = visibility;
+        this->ambient = ambient;
+        light_count = light_sources.size();
+        primitive_count = primitives.size();
+        intensities.assign(width * height * settings.samples_per_pixel(), Color {});
+        hits.assign(width * height, PixelHit {});
+        costs.assign(width * height, PixelCost {});
+
+        const double build_start = omp_get_wtime();
+        bvh = Bvh(primitives, settings.builder);
+        build_time = omp_get_wtime() - build_start;
+        TraceRows(camera, light_sources, primitives, bvh, 0, height, intensities.data(),
+                  depth, ambient, settings, hits.data(), nullptr, costs.data(), visibility);
+        traced_tiles = tiles_x * tiles_y;
+    } else {
+        // hits are those of the frame before the edits, so every change is checked against them
+        std::vector<bool> dirty(width * height, false);
+        bool moved = false;
+        for (const auto& change: primitive_changes) {
+            MarkPrimitive(change, light_sources, primitives, dirty);
+            moved = moved || !Same(change.old_bounds, primitives[change.index]->Bounds());
+        }
+        for (const auto& change: light_changes) {
+            MarkLight(change, light_sources[change.index], dirty);
+        }
+        if (moved) {
+            const double build_start = omp_get_wtime();
+            bvh = Bvh(primitives, settings.builder);
+            build_time = omp_get_wtime() - build_start;
+        }
+
+        std::vector<Tile> tiles;
+        for (int ty = 0; ty < tiles_y; ty++) {
+            for (int tx = 0; tx < tiles_x; tx++) {
+                const Tile tile {
+                        tx * tile_size, ty * tile_size,
+                        std::min(tile_size, width - tx * tile_size),
+                        std::min(tile_size, height - ty * tile_size)
+                };
+                bool tile_dirty = false;
+                for (int y = tile.y; y < tile.y + tile.height && !tile_dirty; y++) {
+                    for (int x = tile.x; x < tile.x + tile.width && !tile_dirty; x++) {
+                        tile_dirty = dirty[width * y + x];
+                    }
+                }
+                if (tile_dirty) {
+                    tiles.push_back(tile);
+                }
+            }
+        }
+
+        TraceTiles(camera, light_sources, primitives, bvh, tiles, intensities.data(),
+                   depth, ambient, settings, hits.data(), costs.data(), visibility);
+        traced_tiles = (int) tiles.size();
+    }
+
+    valid = true;
+    primitive_changes.clear();
+    light_changes.clear();
+    // maximum intensity is global, so all pixels are normalized again
+    const double traced = omp_get_wtime();
+    // denoising isn't part of Same, it only needs the cached intensities and hits
+    if (settings.denoise > 0) {
+        ResolveDenoisedImage(intensities.data(), hits.data(), width, height, settings.samples_per_pixel(),
+                             image, background, settings.denoise, settings.integrator);
+    } else {
+        ResolveImage(intensities.data(), width * height, settings.samples_per_pixel(), image, background,
+                     settings.integrator);
+    }
+
+    if (stats) {
+        stats->build = build_time;
+        stats->trace = traced - start - build_time;
+        stats->resolve = omp_get_wtime() - traced;
+        stats->nodes = (int) bvh.nodes().size();
+    }
+}
@@ -0,0 +1,217 @@
+//
+// Created by numi on 6/9/22.
+//
+
+#include <algorithm>
+#include <cstring>
+
+#include "raytracing_instance.h"
+#include "raytracing_sampling.h"
+
+namespace {
+
+// levels are mixed over one octave of widths around each threshold
+constexpr float lod_transition = 1.0f;
+
+// uniform in [0, 1) and fixed for a ray, rays next to each other get unrelated values
+float Dither(const Vec3& start, const Vec3& ray) {
+    uint32_t words[6];
+    memcpy(words, &start, sizeof(Vec3));
+    memcpy(words + 3, &ray, sizeof(Vec3));
+    uint32_t hash = 0;
+    for (uint32_t word: words) {
+        hash = PcgHash(hash ^ word);
+    }
+    return (float) (hash >> 8) * (1.0f / 16777216.0f);
+}
+
+}
+
+Transform Transform::Inverse() const {
+    // rows of the inverse are cross products of columns divided by the determinant
+    const Vec3 column_x {x.x, y.x, z.x};
+    const Vec3 column_y {x.y, y.y, z.y};
+    const Vec3 column_z {x.z, y.z, z.z};
+    const Vec3 row_x = column_y.cross(column_z);
+    const Vec3 row_y = column_z.cross(column_x);
+    const Vec3 row_z = column_x.cross(column_y);
+    const float inv_det = 1 / (column_x * row_x);
+
+    Transform inverse {row_x * inv_det, row_y * inv_det, row_z * inv_det, Vec3 {}};
+    inverse.translation = inverse.Vector(translation) * -1;
+    return inverse;
+}
+
+Transform Transform::Rotation(const Vec3& axis, float angle) {
+    const Vec3 n = axis.norm();
+    const float c = cosf(angle), s = sinf(angle), t = 1 - c;
+    return Transform {
+            Vec3 {t * n.x * n.x + c, t * n.x * n.y - s * n.z, t * n.x * n.z + s * n.y},
+            Vec3 {t * n.x * n.y + s * n.z, t * n.y * n.y + c, t * n.y * n.z - s * n.x},
+            Vec3 {t * n.x * n.z - s * n.y, t * n.y * n.z + s * n.x, t * n.z * n.z + c},
+            Vec3 {}
+    };
+}
+
+Geometry::Geometry(std::vector<std::unique_ptr<Primitive>> primitives, std::vector<Level> levels):
+        _primitives {std::move(primitives)},
+        _bvh {_primitives},
+        _levels {std::move(levels)} {
+    first_parts.push_back(0);
+    first_parts.push_back((int) _primitives.size());
+    _bounds = _bvh.Bounds();
+    for (const auto& level: _levels) {
+        first_parts.push_back(first_parts.back() + (int) level.geometry->primitives().size());
+        _bounds.Extend(level.geometry->_bvh.Bounds());
+    }
+}
+
+int Geometry::LevelOf(int part) const {
+    const auto next = std::upper_bound(first_parts.begin() + 1, first_parts.end() - 1, part);
+    return (int) (next - first_parts.begin()) - 1;
+}
+
+int Geometry::Select(float width, float u) const {
+    const float threshold = width * exp2f(lod_transition * (u - 0.5f));
+    int level = 0;
+    while (level < (int) _levels.size() && _levels[level].error <= threshold) {
+        level++;
+    }
+    return level;
+}
+
+bool Geometry::Intersection(const Vec3& start, const Vec3& ray, float* result) const {
+    float min = INFINITY;
+    _bvh.Traverse(start, ray, 0, INFINITY, [&](int i, float* t_max) {
+        float intersection;
+        if (_primitives[i]->Intersection(start, ray, &intersection)
+            && intersection >= 0 && intersection < min) {
+            min = intersection;
+            *t_max = min;
+        }
+        return true;
+    });
+
+    *result = min;
+    return min < INFINITY;
+}
+
+bool Geometry::Intersect(const Vec3& start, const Vec3& ray, float t_min, int skipped_part, Hit* hit) const {
+    float min = INFINITY;
+    int closest = -1;
+    _bvh.Traverse(start, ray, t_min, INFINITY, [&](int i, float* t_max) {
+        if (i == skipped_part) return true;
+        float intersection;
+        if (_primitives[i]->Intersection(start, ray, &intersection)
+            && intersection >= t_min && intersection < min) {
+            min = intersection;
+            closest = i;
+            *t_max = min;
+        }
+        return true;
+    });
+
+    if (closest < 0) return false;
+    hit->t = min;
+    hit->part = closest;
+    return true;
+}
+
+const Primitive* Geometry::Closest(const Vec3& point) const {
+    const Aabb bounds = Bounds();
+    const float eps = (bounds.max - bounds.min).length() * 1e-4f;
+
+    int closest = -1;
+    float min = INFINITY;
+    // ties go to the lower index, so that edges don't depend on the order of the hierarchy
+    auto visit = [&](int i) {
+        const float distance = _primitives[i]->Distance(point);
+        if (distance < min || (distance == min && i < closest)) {
+            min = distance;
+            closest = i;
+        }
+    };
+    _bvh.VisitPoint(point, eps, visit);
+    // point may be off the surface by more than eps after the round trip through the transform
+    if (closest < 0) {
+        for (int i = 0; i < _primitives.size(); i++) {
+            visit(i);
+        }
+    }
+    return closest < 0 ? nullptr : _primitives[closest].get();
+}
+
+Instance::Instance(std::shared_ptr<const Geometry> geometry, const Transform& transform, const Material& material):
+        _geometry {std::move(geometry)},
+        to_world {transform},
+        to_local {transform.Inverse()},
+        _material {material},
+        stretch {std::max({
+                transform.Vector(Vec3 {1, 0, 0}).length(),
+                transform.Vector(Vec3 {0, 1, 0}).length(),
+                transform.Vector(Vec3 {0, 0, 1}).length()
+        })} {}
+
+bool Instance::Intersect(const Vec3& start, const Vec3& ray, Hit* hit, int skipped_part, const RayCone& cone) const {
+    const Vec3 local_start = to_local.Point(start);
+    const Vec3 local_ray = to_local.Vector(ray);
+    int level = 0;
+    if (skipped_part >= 0) {
+        level = _geometry->LevelOf(skipped_part);
+    } else if (_geometry->level_count() > 1 && cone.width + cone.spread > 0) {
+        // the width of the cone where the ray passes closest to the center of the geometry
+        const Vec3 center_offset = _geometry->Bounds().Center() - local_start;
+        const float t = std::max(0.0f, (center_offset * local_ray) / (local_ray * local_ray));
+        level = _geometry->Select(cone.At(t) / stretch, Dither(start, ray));
+    }
+
+    const int first = _geometry->first_part(level);
+    const float t_min = skipped_part >= 0 ? self_hit_distance / ray.length() : 0;
+    if (!_geometry->LevelGeometry(level).Intersect(local_start, local_ray, t_min,
+                                                   skipped_part >= 0 ? skipped_part - first : -1, hit)) {
+        return false;
+    }
+    hit->part += first;
+    return true;
+}
+
+Vec3 Instance::Normal(const Vec3 &intersection) const {
+    const Vec3 local = to_local.Point(intersection);
+    const Primitive* primitive = _geometry->Closest(local);
+    if (!primitive) return Vec3 {0, 0, 1};
+    return to_local.TransposedVector(primitive->Normal(local)).norm();
+}
+
+void Instance::Complete(const Vec3& point, Hit* hit) const {
+    hit->material = &_material;
+    if (hit->part < 0 || hit->part >= parts()) {
+        hit->normal = Normal(point);
+        return;
+    }
+    const int level = _geometry->LevelOf(hit->part);
+    const Primitive& primitive
+            = *_geometry->LevelGeometry(level).primitives()[hit->part - _geometry->first_part(level)];
+    hit->normal = to_local.TransposedVector(primitive.Normal(to_local.Point(point))).norm();
+}
+
+Aabb Instance::Bounds() const {
+    const Aabb local = _geometry->Bounds();
+    Aabb bounds;
+    if (local.Empty()) return bounds;
+    for (int corner = 0; corner < 8; corner++) {
+        bounds.Extend(to_world.Point(Vec3 {
+                corner & 1 ? local.max.x : local.min.x,
+                corner & 2 ? local.max.y : local.min.y,
+                corner & 4 ? local.max.z : local.min.z
+        }));
+    }
+    return bounds;
+}
+
+// exact for rigid transforms, scaled by the largest axis stretch otherwise
+float Instance::Distance(const Vec3& point) const {
+    const Vec3 local = to_local.Point(point);
+    const Primitive* primitive = _geometry->Closest(local);
+    if (!primitive) return INFINITY;
+    return primitive->Distance(local) * stretch;
+}
@@ -0,0 +1,86 @@
+//
+// Created by numi on 6/23/22.
+//
+
+#include "raytracing_loader.h"
+
+SceneLoader::SceneLoader(std::vector<LoadStep> steps, BvhBuilder builder):
+        steps {std::move(steps)},
+        builder {builder},
+        thread {&SceneLoader::Run, this} {}
+
+SceneLoader::~SceneLoader() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    changed.notify_all();
+    thread.join();
+}
+
+void SceneLoader::Run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        changed.wait(lock, [this] {
+            return stopping || (building && !built) || next_step < steps.size();
+        });
+        if (stopping) return;
+
+        // hierarchies go first, the frame on screen is waiting for them
+        if (building && !built) {
+            const auto& primitives = *build_primitives;
+            lock.unlock();
+            auto bvh = std::make_unique<Bvh>(primitives, builder);
+            lock.lock();
+            built = std::move(bvh);
+            continue;
+        }
+
+        const LoadStep& step = steps[next_step++];
+        lock.unlock();
+        Chunk chunk;
+        step(&chunk.light_sources, &chunk.primitives);
+        lock.lock();
+        finished.push_back(std::move(chunk));
+        loaded_steps++;
+    }
+}
+
+bool SceneLoader::Update(std::vector<Light>* light_sources,
+                         std::vector<std::unique_ptr<Primitive>>* primitives,
+                         Bvh* bvh) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (building) {
+        if (!built) return false;
+        *bvh = std::move(*built);
+        built.reset();
+        building = false;
+        return true;
+    }
+    if (finished.empty()) return false;
+
+    for (auto& chunk: finished) {
+        light_sources->insert(light_sources->end(), chunk.light_sources.begin(), chunk.light_sources.end());
+        for (auto& primitive: chunk.primitives) {
+            primitives->push_back(std::move(primitive));
+        }
+    }
+    finished.clear();
+    build_primitives = primitives;
+    building = true;
+    changed.notify_all();
+    return false;
+}
+
+bool SceneLoader::done() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return loaded_steps == steps.size() && finished.empty() && !building;
+}
+
+void LoadNow(const std::vector<LoadStep>& steps,
+             std::vector<Light>* light_sources,
+             std::vector<std::unique_ptr<Primitive>>* primitives) {
+    for (const auto& step: steps) {
+        step(light_sources, primitives);
+    }
+}
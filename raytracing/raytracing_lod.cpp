@@ -0,0 +1,294 @@
+//
+// Created by numi on 6/23/22.
+//
+
+#include <cmath>
+#include <array>
+#include <set>
+#include <map>
+#include <unordered_map>
+#include <algorithm>
+
+#include "raytracing_lod.h"
+#include "raytracing_sphere_cloud.h"
+#include "raytracing_scene_io.h"
+
+namespace {
+
+// cell coordinates along each axis fit in this many bits of a key
+constexpr int key_bits = 21;
+// a level is only worth keeping if it has at most this fraction of the parts of the one before
+constexpr float min_reduction = 0.75f;
+
+struct Grid {
+    Vec3 origin;
+    float cell;
+
+    Grid(const Aabb& bounds, float cell): origin {bounds.min}, cell {cell} {
+        // cells grow for huge extents rather than wrapping around the key
+        const Vec3 extent = bounds.max - bounds.min;
+        const float largest = std::max({extent.x, extent.y, extent.z});
+        this->cell = std::max(cell, largest / (float) ((1 << key_bits) - 1));
+    }
+
+    [[nodiscard]] uint64_t Key(const Vec3& point) const {
+        const auto index = [&](float value, float min) {
+            return (uint64_t) std::clamp((int) floorf((value - min) / cell), 0, (1 << key_bits) - 1);
+        };
+        return index(point.x, origin.x)
+            | index(point.y, origin.y) << key_bits
+            | index(point.z, origin.z) << 2 * key_bits;
+    }
+};
+
+// spheres merged into one of the same volume at their volume weighted center
+struct SphereCluster {
+    Vec3 weighted_center;
+    float volume = 0; // sum of the cubes of the radii
+    Vec3 largest_center;
+    float largest_radius = 0;
+    int largest = -1; // index of the largest sphere, its material stands for the cluster
+
+    void Add(const Vec3& center, float radius, int index) {
+        const float cube = radius * radius * radius;
+        weighted_center = weighted_center + center * cube;
+        volume += cube;
+        if (largest < 0 || radius > largest_radius) {
+            largest_center = center;
+            largest_radius = radius;
+            largest = index;
+        }
+    }
+
+    [[nodiscard]] Vec3 Center() const { return volume > 0 ? weighted_center * (1 / volume) : largest_center; }
+    [[nodiscard]] float Radius() const { return cbrtf(volume); }
+};
+
+// clusters in the order their first sphere came in, so that results don't depend on hashing
+class SphereClusters {
+private:
+    const Grid& grid;
+    std::unordered_map<uint64_t, int> indices;
+public:
+    std::vector<SphereCluster> clusters;
+
+    explicit SphereClusters(const Grid& grid): grid {grid} {}
+
+    void Add(const Vec3& center, float radius, int index) {
+        const auto inserted = indices.emplace(grid.Key(center), (int) clusters.size());
+        if (inserted.second) {
+            clusters.emplace_back();
+        }
+        clusters[inserted.first->second].Add(center, radius, index);
+    }
+};
+
+void SimplifyTriangles(const std::vector<const Triangle*>& triangles,
+                       const Grid& grid,
+                       std::vector<std::unique_ptr<Primitive>>* simplified
+) {
+    // corners are welded at the average of all corners in their cell
+    std::unordered_map<uint64_t, std::pair<Vec3, int>> welded;
+    for (const Triangle* triangle: triangles) {
+        for (int i = 0; i < 3; i++) {
+            auto& sum = welded[grid.Key(triangle->Corner(i))];
+            sum.first = sum.first + triangle->Corner(i);
+            sum.second++;
+        }
+    }
+
+    std::set<std::array<uint64_t, 3>> kept;
+    for (const Triangle* triangle: triangles) {
+        std::array<uint64_t, 3> keys {};
+        Vec3 corners[3];
+        for (int i = 0; i < 3; i++) {
+            keys[i] = grid.Key(triangle->Corner(i));
+            const auto& sum = welded[keys[i]];
+            corners[i] = sum.first * (1.0f / (float) sum.second);
+        }
+        // triangles collapsed to lines or points, or onto one kept before, are dropped
+        if (keys[0] == keys[1] || keys[1] == keys[2] || keys[2] == keys[0]) continue;
+        if ((corners[2] - corners[0]).cross(corners[1] - corners[0]).length() <= 0) continue;
+        std::sort(keys.begin(), keys.end());
+        if (!kept.insert(keys).second) continue;
+
+        auto welded_triangle = std::make_unique<Triangle>(corners[0], corners[1], corners[2],
+                                                          triangle->material(), triangle->excludes_line());
+        if (triangle->surface_textures()) {
+            welded_triangle->SetTextures(triangle->surface_textures(),
+                                         triangle->CornerUv(0), triangle->CornerUv(1), triangle->CornerUv(2));
+        }
+        simplified->push_back(std::move(welded_triangle));
+    }
+}
+
+void SimplifySpheres(const std::vector<const Sphere*>& spheres,
+                     const Grid& grid,
+                     std::vector<std::unique_ptr<Primitive>>* simplified
+) {
+    SphereClusters clusters(grid);
+    for (int i = 0; i < (int) spheres.size(); i++) {
+        clusters.Add(spheres[i]->Center(), spheres[i]->Radius(), i);
+    }
+    for (const SphereCluster& cluster: clusters.clusters) {
+        const Sphere& largest = *spheres[cluster.largest];
+        auto sphere = std::make_unique<Sphere>(cluster.Center(), cluster.Radius(), largest.material());
+        if (largest.surface_textures()) {
+            sphere->SetTextures(largest.surface_textures());
+        }
+        simplified->push_back(std::move(sphere));
+    }
+}
+
+std::unique_ptr<Primitive> SimplifyCloud(const SphereCloud& cloud, const Grid& grid) {
+    SphereClusters clusters(grid);
+    for (int i = 0; i < cloud.size(); i++) {
+        Vec3 center;
+        float radius;
+        cloud.SphereAt(i, &center, &radius);
+        clusters.Add(center, radius, i);
+    }
+
+    std::vector<Vec3> centers;
+    std::vector<float> radii;
+    std::vector<uint16_t> material_indices;
+    for (const SphereCluster& cluster: clusters.clusters) {
+        centers.push_back(cluster.Center());
+        radii.push_back(cluster.Radius());
+        material_indices.push_back(cloud.data().material[cluster.largest]);
+    }
+    return std::make_unique<SphereCloud>(centers, radii, material_indices, cloud.palette(), cloud.data().storage);
+}
+
+// copy of primitive, instances share their geometry instead of copying it,
+// the rest goes through the scene format, it already knows how to rebuild every kind
+std::unique_ptr<Primitive> Copy(const Primitive& primitive) {
+    if (const auto* instance = dynamic_cast<const Instance*>(&primitive)) {
+        return std::make_unique<Instance>(instance->geometry(), instance->transform(), instance->material());
+    }
+    ByteWriter out;
+    primitive.Serialize(out);
+    ByteReader in(out.data().data(), out.data().size());
+    return DeserializePrimitive(in);
+}
+
+// parts the renderer has to deal with, spheres of clouds count one by one
+size_t Complexity(const std::vector<std::unique_ptr<Primitive>>& primitives) {
+    size_t complexity = 0;
+    for (const auto& primitive: primitives) {
+        complexity += primitive->parts();
+    }
+    return complexity;
+}
+
+}
+
+std::vector<std::unique_ptr<Primitive>> Simplify(const std::vector<std::unique_ptr<Primitive>>& primitives,
+                                                 float cell) {
+    std::vector<const Triangle*> triangles;
+    std::vector<const Sphere*> spheres;
+    std::vector<const SphereCloud*> clouds;
+    std::vector<const Primitive*> others;
+    Aabb bounds;
+    for (const auto& primitive: primitives) {
+        if (const auto* triangle = dynamic_cast<const Triangle*>(primitive.get())) {
+            triangles.push_back(triangle);
+        } else if (const auto* sphere = dynamic_cast<const Sphere*>(primitive.get())) {
+            spheres.push_back(sphere);
+        } else if (const auto* cloud = dynamic_cast<const SphereCloud*>(primitive.get())) {
+            clouds.push_back(cloud);
+        } else {
+            others.push_back(primitive.get());
+            continue;
+        }
+        bounds.Extend(primitive->Bounds());
+    }
+
+    std::vector<std::unique_ptr<Primitive>> simplified;
+    const Grid grid(bounds, cell);
+    SimplifyTriangles(triangles, grid, &simplified);
+    SimplifySpheres(spheres, grid, &simplified);
+    for (const SphereCloud* cloud: clouds) {
+        simplified.push_back(SimplifyCloud(*cloud, grid));
+    }
+
+    for (const Primitive* other: others) {
+        auto copy = Copy(*other);
+        if (copy) {
+            simplified.push_back(std::move(copy));
+        }
+    }
+    return simplified;
+}
+
+std::vector<Geometry::Level> SimplifiedLevels(const std::vector<std::unique_ptr<Primitive>>& primitives,
+                                              int max_levels) {
+    float size = 0;
+    int sized = 0;
+    for (const auto& primitive: primitives) {
+        if (const auto* triangle = dynamic_cast<const Triangle*>(primitive.get())) {
+            for (int i = 0; i < 3; i++) {
+                size += (triangle->Corner((i + 1) % 3) - triangle->Corner(i)).length() / 3;
+            }
+            sized++;
+        } else if (const auto* sphere = dynamic_cast<const Sphere*>(primitive.get())) {
+            size += 2 * sphere->Radius();
+            sized++;
+        } else if (const auto* cloud = dynamic_cast<const SphereCloud*>(primitive.get())) {
+            for (int i = 0; i < cloud->size(); i++) {
+                Vec3 center;
+                float radius;
+                cloud->SphereAt(i, &center, &radius);
+                size += 2 * radius;
+            }
+            sized += cloud->size();
+        }
+    }
+
+    std::vector<Geometry::Level> levels;
+    if (sized == 0 || size <= 0) return levels;
+    size_t previous = Complexity(primitives);
+    float cell = 2 * size / (float) sized;
+    // every level starts from the original primitives, so that errors don't pile up
+    for (int i = 0; i < max_levels; i++, cell *= 2) {
+        auto simplified = Simplify(primitives, cell);
+        const size_t complexity = Complexity(simplified);
+        // a level without any parts would make the geometry vanish instead of looking coarser
+        if (complexity == 0) break;
+        if ((float) complexity > (float) previous * min_reduction) continue;
+        previous = complexity;
+        // the diagonal of a cell bounds how far welded corners and merged centers move
+        levels.push_back(Geometry::Level {std::make_shared<const Geometry>(std::move(simplified)),
+                                          cell * sqrtf(3.0f)});
+    }
+    return levels;
+}
+
+void AddSimplifiedLevels(std::vector<std::unique_ptr<Primitive>>* primitives, size_t min_parts) {
+    // instances of one geometry go on sharing one geometry with levels
+    std::map<const Geometry*, std::shared_ptr<const Geometry>> replaced;
+    for (auto& primitive: *primitives) {
+        const auto* instance = dynamic_cast<const Instance*>(primitive.get());
+        if (!instance || !instance->geometry()->levels().empty()) continue;
+        const Geometry& geometry = *instance->geometry();
+        auto& replacement = replaced[&geometry];
+        if (!replacement) {
+            if (Complexity(geometry.primitives()) < min_parts) {
+                replacement = instance->geometry();
+            } else {
+                std::vector<std::unique_ptr<Primitive>> copies;
+                for (const auto& part: geometry.primitives()) {
+                    auto copy = Copy(*part);
+                    if (copy) {
+                        copies.push_back(std::move(copy));
+                    }
+                }
+                auto levels = SimplifiedLevels(copies);
+                replacement = std::make_shared<const Geometry>(std::move(copies), std::move(levels));
+            }
+        }
+        if (replacement != instance->geometry()) {
+            primitive = std::make_unique<Instance>(replacement, instance->transform(), instance->material());
+        }
+    }
+}
@@ -0,0 +1,120 @@
+//
+// Created by numi on 6/16/22.
+//
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <algorithm>
+#include <omp.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "raytracing_numa.h"
+#include "raytracing_scene_io.h"
+
+namespace {
+
+struct NumaTopology {
+    std::vector<int> cpu_nodes; // node of every cpu
+    std::vector<int> cpus; // ordered by node
+    int nodes = 1;
+
+    NumaTopology() {
+        for (int node = 0;; node++) {
+            std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            if (!file) break;
+            // ranges like 0-3,8-11
+            std::string range;
+            while (std::getline(file, range, ',')) {
+                int first, last;
+                char dash;
+                std::istringstream values(range);
+                if (!(values >> first)) continue;
+                if (!(values >> dash >> last)) last = first;
+                for (int cpu = first; cpu <= last; cpu++) {
+                    if (cpu >= (int) cpu_nodes.size()) cpu_nodes.resize(cpu + 1, 0);
+                    cpu_nodes[cpu] = node;
+                    cpus.push_back(cpu);
+                }
+            }
+            nodes = node + 1;
+        }
+    }
+
+    [[nodiscard]] int Node(int cpu) const {
+        return cpu >= 0 && cpu < (int) cpu_nodes.size() ? cpu_nodes[cpu] : 0;
+    }
+};
+
+const NumaTopology& Topology() {
+    static const NumaTopology topology;
+    return topology;
+}
+
+}
+
+int NumaNodeCount() {
+    return Topology().nodes;
+}
+
+int CurrentNumaNode() {
+    return Topology().Node(sched_getcpu());
+}
+
+TeamThreadPin::TeamThreadPin(bool pin) {
+    if (!pin || omp_get_proc_bind() != omp_proc_bind_false) return;
+    const NumaTopology& topology = Topology();
+    const int threads = omp_get_num_threads();
+    if (topology.cpus.empty() || threads < 2) return;
+    if (pthread_getaffinity_np(pthread_self(), sizeof(previous), &previous) != 0) return;
+
+    // thread i of n goes to the cpu i / n of the way through the list, so a team smaller than
+    // the machine still gets a share of every node
+    const int thread = omp_get_thread_num();
+    const int cpu = topology.cpus[(size_t) thread * topology.cpus.size() / threads];
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pinned = pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+TeamThreadPin::~TeamThreadPin() {
+    // thread 0 is the caller of the parallel region, it must not stay pinned after the render
+    if (pinned) pthread_setaffinity_np(pthread_self(), sizeof(previous), &previous);
+}
+
+SceneReplicas::SceneReplicas(const std::vector<Light>& light_sources,
+                             const std::vector<std::unique_ptr<Primitive>>& primitives,
+                             const Bvh& bvh):
+        replicas(NumaNodeCount()) {
+    // primitives are copied through the scene format, it already knows how to rebuild every kind
+    ByteWriter out;
+    SerializeScene(out, light_sources, primitives);
+    std::vector<bool> claimed(replicas.size(), false);
+
+    #pragma omp parallel
+    {
+        const TeamThreadPin pinned(true);
+        const int node = CurrentNumaNode();
+        bool first = false;
+        #pragma omp critical
+        {
+            first = !claimed[node];
+            claimed[node] = true;
+        }
+        if (first) {
+            auto replica = std::make_unique<Replica>();
+            ByteReader in(out.data().data(), out.data().size());
+            if (DeserializeScene(in, &replica->light_sources, &replica->primitives)) {
+                replica->bvh = bvh;
+                replicas[node] = std::move(replica);
+            }
+        }
+    }
+}
+
+const SceneReplicas::Replica* SceneReplicas::Local() const {
+    const int node = CurrentNumaNode();
+    return node < (int) replicas.size() ? replicas[node].get() : nullptr;
+}
@@ -0,0 +1,55 @@
+//
+// Created by numi on 6/13/22.
+//
+
+#include <algorithm>
+#include <cmath>
+
+#include "raytracing_preview.h"
+
+namespace {
+
+// weight of the last frame in the measured costs, the rest smooths out noisy timings
+constexpr double cost_smoothing = 0.5;
+
+double Smoothed(double average, double value) {
+    return average == 0 ? value : average + (value - average) * cost_smoothing;
+}
+
+}
+
+PreviewFrame PreviewController::Plan(const Camera& camera, const RenderSettings& settings) const {
+    const int width = std::max(1, (int) lroundf((float) camera.sw * scale));
+    const int height = std::max(1, (int) lroundf((float) camera.sh * scale));
+    // zn is in pixels, so the image plane comes closer to keep the field of view, near_clip stays
+    Camera preview = camera;
+    preview.sw = width;
+    preview.sh = height;
+    preview.zn = camera.zn * (float) width / (float) camera.sw;
+
+    RenderSettings preview_settings = settings;
+    preview_settings.samples = std::min(samples, settings.samples);
+    preview_settings.fast_math = settings.fast_math || fast_math;
+    return PreviewFrame {preview, preview_settings, (float) width / (float) camera.sw};
+}
+
+void PreviewController::Update(const PreviewFrame& frame, const RenderStats& stats, const RenderSettings& settings) {
+    const double traced = (double) frame.camera.sw * frame.camera.sh * frame.settings.samples_per_pixel();
+    sample_cost = Smoothed(sample_cost, (stats.trace + stats.resolve) / traced);
+    fixed_cost = Smoothed(fixed_cost, stats.build);
+    if (sample_cost <= 0) return;
+
+    // samples per pixel of the full frame that fit in the time left after the fixed part
+    const double full_pixels = (double) frame.camera.sw * frame.camera.sh / (frame.scale * frame.scale);
+    const double budget = std::max(target_time - fixed_cost, 0.25 * target_time);
+    const double affordable = budget / sample_cost / full_pixels;
+
+    // resolution goes up to full first, then samples per pixel side
+    if (affordable >= 1) {
+        scale = 1;
+        samples = std::max(1, std::min(settings.samples, (int) sqrt(affordable)));
+    } else {
+        scale = std::max(min_scale, std::min(1.0f, (float) sqrt(affordable)));
+        samples = 1;
+    }
+}
@@ -0,0 +1,155 @@
+//
+// Created by numi on 6/17/22.
+//
+
+#include <algorithm>
+#include <omp.h>
+
+#include "raytracing_progressive.h"
+#include "raytracing_bvh.h"
+#include "raytracing_denoise.h"
+
+namespace {
+
+constexpr int tile_size = 16;
+// tiles handed to every thread between checks of the clock
+constexpr int batch_per_thread = 2;
+
+// samples per pixel side and reflection depth tiles are traced with
+struct Level {
+    int samples;
+    int depth;
+};
+
+}
+
+BudgetReport RaytracingWithin(double budget,
+                              const Camera& camera,
+                              const std::vector<Light>& light_sources,
+                              const std::vector<std::unique_ptr<Primitive>>& primitives,
+                              int* image,
+                              int depth,
+                              const Color& background,
+                              const Color& ambient,
+                              const RenderSettings& settings,
+                              RenderStats* stats
+) {
+    const double start = omp_get_wtime();
+    const double deadline = start + budget;
+    const int width = camera.sw;
+    const int height = camera.sh;
+    const int samples_per_pixel = settings.samples_per_pixel();
+
+    const Bvh bvh(primitives, settings.builder);
+    const double built = omp_get_wtime();
+
+    std::vector<Tile> tiles;
+    for (int y = 0; y < height; y += tile_size) {
+        for (int x = 0; x < width; x += tile_size) {
+            tiles.push_back(Tile {x, y, std::min(tile_size, width - x), std::min(tile_size, height - y)});
+        }
+    }
+
+    std::vector<Level> levels {Level {1, 0}};
+    if (depth > 0) levels.push_back(Level {1, depth});
+    if (settings.samples > 1) levels.push_back(Level {settings.samples, depth});
+
+    // levels with fewer samples fill all samples of a pixel with theirs, so that resolving doesn't
+    // depend on levels and a finished render is exactly the one of Raytracing
+    std::vector<Color> intensities(width * height * samples_per_pixel);
+    std::vector<Color> single(samples_per_pixel > 1 ? width * height : 0);
+    std::vector<PixelHit> hits(settings.denoise > 0 ? width * height : 0);
+    PixelHit* const hits_data = hits.empty() ? nullptr : hits.data();
+    auto trace = [&](const std::vector<Tile>& batch, const Level& level) {
+        RenderSettings level_settings = settings;
+        level_settings.samples = level.samples;
+        if (level.samples == settings.samples) {
+            TraceTiles(camera, light_sources, primitives, bvh, batch, intensities.data(),
+                       level.depth, ambient, level_settings, hits_data);
+            return;
+        }
+        TraceTiles(camera, light_sources, primitives, bvh, batch, single.data(),
+                   level.depth, ambient, level_settings, hits_data);
+        #pragma omp parallel for
+        for (int t = 0; t < batch.size(); t++) {
+            const Tile& tile = batch[t];
+            for (int y = tile.y; y < tile.y + tile.height; y++) {
+                for (int x = tile.x; x < tile.x + tile.width; x++) {
+                    const int pixel = width * y + x;
+                    std::fill_n(intensities.data() + pixel * samples_per_pixel, samples_per_pixel, single[pixel]);
+                }
+            }
+        }
+    };
+
+    // coarse pass of the whole frame, it is all there is if the budget is too small for it
+    trace(tiles, levels[0]);
+
+    // contrast of the coarse pass, edges and highlights are refined first
+    std::vector<float> contrast(tiles.size());
+    for (int t = 0; t < tiles.size(); t++) {
+        const Tile& tile = tiles[t];
+        float min = INFINITY, max = -INFINITY;
+        for (int y = tile.y; y < tile.y + tile.height; y++) {
+            for (int x = tile.x; x < tile.x + tile.width; x++) {
+                // background samples are negative
+                const float luminance = std::max(0.0f, Luminance(intensities[(width * y + x) * samples_per_pixel]));
+                min = std::min(min, luminance);
+                max = std::max(max, luminance);
+            }
+        }
+        contrast[t] = max - min;
+    }
+    std::vector<int> order(tiles.size());
+    for (int t = 0; t < tiles.size(); t++) {
+        order[t] = t;
+    }
+    std::stable_sort(order.begin(), order.end(), [&contrast](int a, int b) {
+        return contrast[a] > contrast[b];
+    });
+
+    // every tile gets a level before any tile gets the next one
+    std::vector<int> tile_levels(tiles.size(), 0);
+    const int batch_size = batch_per_thread * omp_get_max_threads();
+    std::vector<Tile> batch;
+    bool out_of_time = false;
+    for (int level = 1; level < levels.size() && !out_of_time; level++) {
+        for (int begin = 0; begin < order.size(); begin += batch_size) {
+            if (omp_get_wtime() >= deadline) {
+                out_of_time = true;
+                break;
+            }
+            const int end = std::min((int) order.size(), begin + batch_size);
+            batch.clear();
+            for (int i = begin; i < end; i++) {
+                batch.push_back(tiles[order[i]]);
+            }
+            trace(batch, levels[level]);
+            for (int i = begin; i < end; i++) {
+                tile_levels[order[i]] = level;
+            }
+        }
+    }
+
+    BudgetReport report;
+    report.tiles = (int) tiles.size();
+    report.refined_tiles = (int) std::count(tile_levels.begin(), tile_levels.end(), (int) levels.size() - 1);
+    report.complete = report.refined_tiles == report.tiles;
+
+    const double traced = omp_get_wtime();
+    if (settings.denoise > 0) {
+        ResolveDenoisedImage(intensities.data(), hits.data(), width, height, samples_per_pixel,
+                             image, background, settings.denoise, settings.integrator);
+    } else {
+        ResolveImage(intensities.data(), width * height, samples_per_pixel, image, background,
+                     settings.integrator);
+    }
+
+    if (stats) {
+        stats->build = built - start;
+        stats->trace = traced - built;
+        stats->resolve = omp_get_wtime() - traced;
+        stats->nodes = (int) bvh.nodes().size();
+    }
+    return report;
+}
@@ -0,0 +1,484 @@
+//
+// Created by numi on 6/2/22.
+//
+
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <limits>
+
+#include "raytracing_scene_io.h"
+#include "raytracing_instance.h"
+#include "raytracing_lod.h"
+#include "raytracing_sphere_cloud.h"
+#include "raytracing_streaming.h"
+#include "raytracing_texture.h"
+#include "raytracing_bvh.h"
+
+namespace {
+
+constexpr uint32_t scene_magic = 0x43535452; // "RTSC"
+constexpr uint32_t scene_version = 8;
+
+template <typename T>
+void WriteVector(ByteWriter& out, const std::vector<T>& values) {
+    out.Write((uint32_t) values.size());
+    out.WriteBytes(values.data(), values.size() * sizeof(T));
+}
+
+template <typename T>
+bool ReadVector(ByteReader& in, std::vector<T>* values) {
+    uint32_t size;
+    if (!in.Read(&size) || size > in.remaining() / sizeof(T)) return false;
+    values->resize(size);
+    return in.ReadBytes(values->data(), size * sizeof(T));
+}
+
+void WriteString(ByteWriter& out, const std::string& value) {
+    out.Write((uint32_t) value.size());
+    out.WriteBytes(value.data(), value.size());
+}
+
+bool ReadString(ByteReader& in, std::string* value) {
+    uint32_t length;
+    if (!in.Read(&length) || length > in.remaining()) return false;
+    value->resize(length);
+    return in.ReadBytes(value->data(), length);
+}
+
+void WritePrimitives(ByteWriter& out, const std::vector<std::unique_ptr<Primitive>>& primitives) {
+    out.Write((uint32_t) primitives.size());
+    for (const auto& primitive: primitives) {
+        primitive->Serialize(out);
+    }
+}
+
+bool ReadPrimitives(ByteReader& in, std::vector<std::unique_ptr<Primitive>>* primitives) {
+    uint32_t count;
+    if (!in.Read(&count)) return false;
+    for (uint32_t i = 0; i < count; i++) {
+        auto primitive = DeserializePrimitive(in);
+        if (!primitive) return false;
+        primitives->push_back(std::move(primitive));
+    }
+    return true;
+}
+
+// Paths of the maps, textures shared by several primitives are written once
+// An empty path stands for a missing map
+void WriteTextures(ByteWriter& out, const SurfaceTextures* textures) {
+    out.Write(textures != nullptr);
+    if (!textures) return;
+    bool first;
+    out.Write(out.SharedId(textures, &first));
+    out.Write(first);
+    if (!first) return;
+    WriteString(out, textures->diffuse ? textures->diffuse->path() : std::string {});
+    WriteString(out, textures->specular ? textures->specular->path() : std::string {});
+}
+
+// textures stays null if none were written, maps are opened with the default cache
+bool ReadTextures(ByteReader& in, std::shared_ptr<const SurfaceTextures>* textures) {
+    bool present;
+    if (!in.Read(&present)) return false;
+    if (!present) return true;
+    uint32_t id;
+    bool first;
+    if (!in.Read(&id) || !in.Read(&first)) return false;
+    if (first) {
+        if (!in.NewShared(id)) return false;
+        std::string diffuse_path, specular_path;
+        if (!ReadString(in, &diffuse_path) || !ReadString(in, &specular_path)) return false;
+        auto read = std::make_shared<SurfaceTextures>();
+        if (!diffuse_path.empty() && !(read->diffuse = OpenTexture(diffuse_path))) return false;
+        if (!specular_path.empty() && !(read->specular = OpenTexture(specular_path))) return false;
+        in.SetShared(id, std::move(read));
+    }
+    *textures = std::static_pointer_cast<const SurfaceTextures>(in.Shared(id));
+    return *textures != nullptr;
+}
+
+}
+
+void Sphere::Serialize(ByteWriter& out) const {
+    out.Write(PrimitiveTag::Sphere);
+    out.Write(center);
+    out.Write(radius);
+    out.Write(_material);
+    WriteTextures(out, textures.get());
+}
+
+void Triangle::Serialize(ByteWriter& out) const {
+    out.Write(PrimitiveTag::Triangle);
+    out.Write(a);
+    out.Write(b);
+    out.Write(c);
+    out.Write(_material);
+    out.Write(exclude_line);
+    WriteTextures(out, textures.get());
+    if (textures) {
+        out.Write(uv);
+    }
+}
+
+void Plane::Serialize(ByteWriter& out) const {
+    out.Write(PrimitiveTag::Plane);
+    out.Write(point);
+    out.Write(normal);
+    out.Write(_material);
+}
+
+void Quad::Serialize(ByteWriter& out) const {
+    out.Write(PrimitiveTag::Quad);
+    out.Write(corner);
+    out.Write(u);
+    out.Write(v);
+    out.Write(_material);
+}
+
+void AABox::Serialize(ByteWriter& out) const {
+    out.Write(PrimitiveTag::AABox);
+    out.Write(box.min);
+    out.Write(box.max);
+    out.Write(_material);
+}
+
+void SphereCloud::Serialize(ByteWriter& out) const {
+    out.Write(PrimitiveTag::SphereCloud);
+    out.Write(particles.storage);
+    WriteVector(out, particles.x);
+    WriteVector(out, particles.y);
+    WriteVector(out, particles.z);
+    WriteVector(out, particles.radius);
+    WriteVector(out, particles.qx);
+    WriteVector(out, particles.qy);
+    WriteVector(out, particles.qz);
+    WriteVector(out, particles.qradius);
+    out.Write(particles.origin);
+    out.Write(particles.scale);
+    out.Write(particles.radius_scale);
+    WriteVector(out, particles.material);
+    WriteVector(out, materials);
+}
+
+void Instance::Serialize(ByteWriter& out) const {
+    out.Write(PrimitiveTag::Instance);
+    out.Write(to_world);
+    out.Write(_material);
+
+    bool first;
+    out.Write(out.SharedId(_geometry.get(), &first));
+    out.Write(first);
+    if (!first) return;
+    WritePrimitives(out, _geometry->primitives());
+    out.Write((uint32_t) _geometry->levels().size());
+    for (const auto& level: _geometry->levels()) {
+        out.Write(level.error);
+        WritePrimitives(out, level.geometry->primitives());
+    }
+}
+
+void StreamedMesh::Serialize(ByteWriter& out) const {
+    out.Write(PrimitiveTag::StreamedMesh);
+    WriteString(out, _path);
+    out.Write((uint64_t) memory_budget);
+}
+
+void Bvh::Serialize(ByteWriter& out) const {
+    WriteVector(out, _nodes);
+    WriteVector(out, _items);
+    WriteVector(out, _unbounded);
+}
+
+bool Bvh::Deserialize(ByteReader& in, int item_count) {
+    if (!ReadVector(in, &_nodes) || !ReadVector(in, &_items) || !ReadVector(in, &_unbounded)) return false;
+    const auto valid_item = [item_count](int item) {
+        return item >= 0 && item < item_count;
+    };
+    if (!std::all_of(_items.begin(), _items.end(), valid_item)
+        || !std::all_of(_unbounded.begin(), _unbounded.end(), valid_item)) return false;
+
+    // children come after their parents, so depths are known when a node is reached
+    std::vector<int> depths(_nodes.size(), 0);
+    for (int i = 0; i < _nodes.size(); i++) {
+        const BvhNode& node = _nodes[i];
+        if (node.count > 0) {
+            if (node.first < 0 || node.first > (int) _items.size() - node.count) return false;
+            continue;
+        }
+        if (node.first <= i || node.first + 1 >= (int) _nodes.size() || depths[i] + 1 >= max_depth) return false;
+        depths[node.first] = depths[node.first + 1] = depths[i] + 1;
+    }
+    return true;
+}
+
+void SerializeCamera(ByteWriter& out, const Camera& camera) {
+    out.Write(camera.eye);
+    out.Write(camera.z);
+    out.Write(camera.right);
+    out.Write(camera.up);
+    out.Write(camera.zn);
+    out.Write(camera.zf);
+    out.Write(camera.near_clip);
+    out.Write(camera.sw);
+    out.Write(camera.sh);
+}
+
+bool DeserializeCamera(ByteReader& in, Camera* camera) {
+    // basis is stored as is, so that reconstructing it from eye/view/up can't change rays
+    return in.Read(&camera->eye)
+        && in.Read(&camera->z)
+        && in.Read(&camera->right)
+        && in.Read(&camera->up)
+        && in.Read(&camera->zn)
+        && in.Read(&camera->zf)
+        && in.Read(&camera->near_clip)
+        && in.Read(&camera->sw)
+        && in.Read(&camera->sh);
+}
+
+void SerializeScene(ByteWriter& out,
+                    const std::vector<Light>& light_sources,
+                    const std::vector<std::unique_ptr<Primitive>>& primitives
+) {
+    out.Write(scene_magic);
+    out.Write(scene_version);
+
+    out.Write((uint32_t) light_sources.size());
+    for (const auto& light: light_sources) {
+        out.Write(light);
+    }
+
+    out.Write((uint32_t) primitives.size());
+    for (const auto& primitive: primitives) {
+        primitive->Serialize(out);
+    }
+}
+
+std::unique_ptr<Primitive> DeserializePrimitive(ByteReader& in) {
+    PrimitiveTag tag;
+    if (!in.Read(&tag)) return nullptr;
+
+    switch (tag) {
+        case PrimitiveTag::Sphere: {
+            Vec3 center;
+            float radius;
+            Material material;
+            std::shared_ptr<const SurfaceTextures> textures;
+            if (!in.Read(&center) || !in.Read(&radius) || !in.Read(&material)
+                || !ReadTextures(in, &textures)) return nullptr;
+            auto sphere = std::make_unique<Sphere>(center, radius, material);
+            if (textures) sphere->SetTextures(std::move(textures));
+            return sphere;
+        }
+        case PrimitiveTag::Triangle: {
+            Vec3 a, b, c;
+            Material material;
+            bool exclude_line;
+            std::shared_ptr<const SurfaceTextures> textures;
+            TexCoord uv[3];
+            if (!in.Read(&a) || !in.Read(&b) || !in.Read(&c)
+                || !in.Read(&material) || !in.Read(&exclude_line)
+                || !ReadTextures(in, &textures) || (textures && !in.Read(&uv))) return nullptr;
+            auto triangle = std::make_unique<Triangle>(a, b, c, material, exclude_line);
+            if (textures) triangle->SetTextures(std::move(textures), uv[0], uv[1], uv[2]);
+            return triangle;
+        }
+        case PrimitiveTag::Plane: {
+            Vec3 point, normal;
+            Material material;
+            if (!in.Read(&point) || !in.Read(&normal) || !in.Read(&material)) return nullptr;
+            return std::make_unique<Plane>(point, normal, material);
+        }
+        case PrimitiveTag::Quad: {
+            Vec3 corner, u, v;
+            Material material;
+            if (!in.Read(&corner) || !in.Read(&u) || !in.Read(&v) || !in.Read(&material)) return nullptr;
+            return std::make_unique<Quad>(corner, u, v, material);
+        }
+        case PrimitiveTag::AABox: {
+            Vec3 min, max;
+            Material material;
+            if (!in.Read(&min) || !in.Read(&max) || !in.Read(&material)) return nullptr;
+            return std::make_unique<AABox>(min, max, material);
+        }
+        case PrimitiveTag::SphereCloud: {
+            SphereCloud::Particles particles;
+            std::vector<Material> materials;
+            if (!in.Read(&particles.storage)
+                || !ReadVector(in, &particles.x) || !ReadVector(in, &particles.y)
+                || !ReadVector(in, &particles.z) || !ReadVector(in, &particles.radius)
+                || !ReadVector(in, &particles.qx) || !ReadVector(in, &particles.qy)
+                || !ReadVector(in, &particles.qz) || !ReadVector(in, &particles.qradius)
+                || !in.Read(&particles.origin) || !in.Read(&particles.scale) || !in.Read(&particles.radius_scale)
+                || !ReadVector(in, &particles.material) || !ReadVector(in, &materials)) return nullptr;
+
+            const size_t count = particles.material.size();
+            const bool complete = particles.storage == CloudStorage::Quantized
+                    ? particles.qx.size() == count && particles.qy.size() == count
+                      && particles.qz.size() == count && particles.qradius.size() == count
+                    : particles.x.size() == count && particles.y.size() == count
+                      && particles.z.size() == count && particles.radius.size() == count;
+            if (!complete) return nullptr;
+            return std::make_unique<SphereCloud>(std::move(particles), std::move(materials));
+        }
+        case PrimitiveTag::Instance: {
+            Transform transform;
+            Material material;
+            uint32_t id;
+            bool first;
+            if (!in.Read(&transform) || !in.Read(&material) || !in.Read(&id) || !in.Read(&first)) return nullptr;
+
+            if (first) {
+                if (!in.NewShared(id)) return nullptr;
+                std::vector<std::unique_ptr<Primitive>> primitives;
+                uint32_t level_count;
+                if (!ReadPrimitives(in, &primitives) || !in.Read(&level_count)) return nullptr;
+                std::vector<Geometry::Level> levels;
+                for (uint32_t i = 0; i < level_count; i++) {
+                    Geometry::Level level;
+                    std::vector<std::unique_ptr<Primitive>> level_primitives;
+                    if (!in.Read(&level.error) || !ReadPrimitives(in, &level_primitives)) return nullptr;
+                    level.geometry = std::make_shared<const Geometry>(std::move(level_primitives));
+                    levels.push_back(std::move(level));
+                }
+                in.SetShared(id, std::make_shared<const Geometry>(std::move(primitives), std::move(levels)));
+            }
+            auto geometry = std::static_pointer_cast<const Geometry>(in.Shared(id));
+            if (!geometry) return nullptr;
+            return std::make_unique<Instance>(std::move(geometry), transform, material);
+        }
+        case PrimitiveTag::StreamedMesh: {
+            std::string path;
+            uint64_t budget;
+            if (!ReadString(in, &path) || !in.Read(&budget)) return nullptr;
+            return OpenStreamedMesh(path, budget);
+        }
+    }
+    return nullptr;
+}
+
+bool DeserializeScene(ByteReader& in,
+                      std::vector<Light>* light_sources,
+                      std::vector<std::unique_ptr<Primitive>>* primitives
+) {
+    uint32_t magic, version;
+    if (!in.Read(&magic) || !in.Read(&version)) return false;
+    if (magic != scene_magic || version != scene_version) return false;
+
+    uint32_t light_count;
+    if (!in.Read(&light_count)) return false;
+    for (uint32_t i = 0; i < light_count; i++) {
+        Light light;
+        if (!in.Read(&light)) return false;
+        light_sources->push_back(light);
+    }
+
+    uint32_t primitive_count;
+    if (!in.Read(&primitive_count)) return false;
+    for (uint32_t i = 0; i < primitive_count; i++) {
+        auto primitive = DeserializePrimitive(in);
+        if (!primitive) return false;
+        primitives->push_back(std::move(primitive));
+    }
+    return true;
+}
+
+bool SaveScene(const std::string& path,
+               const std::vector<Light>& light_sources,
+               const std::vector<std::unique_ptr<Primitive>>& primitives
+) {
+    ByteWriter out;
+    SerializeScene(out, light_sources, primitives);
+    std::ofstream file(path, std::ios::binary);
+    if (!file.write(out.data().data(), (std::streamsize) out.data().size())) {
+        std::cerr << "Can't write scene file " << path << '\n';
+        return false;
+    }
+    return true;
+}
+
+bool SavePpm(const std::string& path, const int* image, int width, int height) {
+    std::ofstream file(path, std::ios::binary);
+    file << "P6\n" << width << ' ' << height << "\n255\n";
+    std::vector<char> row(width * 3);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            const int pixel = image[width * y + x];
+            row[3 * x] = (char) (pixel & 0xFF);
+            row[3 * x + 1] = (char) ((pixel >> 8) & 0xFF);
+            row[3 * x + 2] = (char) ((pixel >> 16) & 0xFF);
+        }
+        file.write(row.data(), (std::streamsize) row.size());
+    }
+    if (!file) {
+        std::cerr << "Can't write image file " << path << '\n';
+        return false;
+    }
+    return true;
+}
+
+bool LoadPpm(const std::string& path, std::vector<int>* image, int* width, int* height) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        std::cerr << "Can't open image file " << path << '\n';
+        return false;
+    }
+    // header fields are separated by whitespace and comments running to the end of the line
+    const auto field = [&file](int* value) {
+        while (file >> std::ws && file.peek() == '#') {
+            file.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        }
+        return (bool) (file >> *value);
+    };
+    std::string magic;
+    int max_value;
+    if (!(file >> magic) || magic != "P6" || !field(width) || !field(height) || !field(&max_value)
+        || *width <= 0 || *height <= 0 || max_value <= 0 || max_value > 255) {
+        std::cerr << "Image file " << path << " isn't a binary PPM with 8 bit channels\n";
+        return false;
+    }
+    file.get();
+
+    std::vector<unsigned char> row((size_t) *width * 3);
+    image->resize((size_t) *width * *height);
+    for (int y = 0; y < *height; y++) {
+        if (!file.read(reinterpret_cast<char*>(row.data()), (std::streamsize) row.size())) {
+            std::cerr << "Image file " << path << " is truncated\n";
+            return false;
+        }
+        for (int x = 0; x < *width; x++) {
+            const auto channel = [&](int i) {
+                return row[3 * x + i] * 255 / max_value;
+            };
+            (*image)[(size_t) *width * y + x] = (int) IM_COL32(channel(0), channel(1), channel(2), 255);
+        }
+    }
+    return true;
+}
+
+bool LoadScene(const std::string& path,
+               std::vector<Light>* light_sources,
+               std::vector<std::unique_ptr<Primitive>>* primitives
+) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) {
+        std::cerr << "Can't open scene file " << path << '\n';
+        return false;
+    }
+    std::vector<char> data(file.tellg());
+    file.seekg(0);
+    if (!file.read(data.data(), (std::streamsize) data.size())) {
+        std::cerr << "Can't read scene file " << path << '\n';
+        return false;
+    }
+    ByteReader in(data.data(), data.size());
+    if (!DeserializeScene(in, light_sources, primitives) || !in.at_end()) {
+        std::cerr << "Malformed scene file " << path << '\n';
+        return false;
+    }
+    // files saved before levels of detail were built get them here, renders and copies of the scene
+    // made through SerializeScene then all see the same levels
+    AddSimplifiedLevels(primitives);
+    return true;
+}
@@ -0,0 +1,433 @@
+//
+// Created by numi on 6/14/22.
+//
+
+#include <iostream>
+#include <sstream>
+#include <set>
+#include <map>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <omp.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "raytracing_service.h"
+#include "raytracing_scene_io.h"
+
+namespace {
+
+// limits of requests, so that a single one can't take all memory or time of the daemon or overflow sizes
+constexpr int max_image_side = 16384;
+constexpr int max_depth = 32; // bounces, a closed mirror box would keep a runner busy for hours otherwise
+constexpr int max_samples = 64; // per side of the grid of samples of a pixel
+constexpr int max_denoise = 8;
+
+bool ParseInt(const std::string& text, int* value) {
+    char* end;
+    errno = 0;
+    const long result = strtol(text.c_str(), &end, 10);
+    if (text.empty() || *end != '\0' || errno != 0) return false;
+    *value = (int) result;
+    return true;
+}
+
+bool ParseFloat(const std::string& text, float* value) {
+    char* end;
+    *value = strtof(text.c_str(), &end);
+    return !text.empty() && *end == '\0';
+}
+
+bool ParseVec3(const std::string& text, Vec3* value) {
+    char* end;
+    const char* position = text.c_str();
+    float* components[3] = {&value->x, &value->y, &value->z};
+    for (int i = 0; i < 3; i++) {
+        *components[i] = strtof(position, &end);
+        if (end == position || *end != (i < 2 ? ',' : '\0')) return false;
+        position = end + 1;
+    }
+    return true;
+}
+
+bool ParseColor(const std::string& text, Color* value) {
+    Vec3 components;
+    if (!ParseVec3(text, &components)) return false;
+    *value = Color {components.x, components.y, components.z};
+    return true;
+}
+
+bool ParseName(const std::string& text, const std::vector<std::string>& names, int* value) {
+    for (int i = 0; i < (int) names.size(); i++) {
+        if (text == names[i]) {
+            *value = i;
+            return true;
+        }
+    }
+    return ParseInt(text, value) && *value >= 0 && *value < (int) names.size();
+}
+
+long long ModificationTime(const std::string& path) {
+    struct stat status {};
+    if (stat(path.c_str(), &status) != 0) return -1;
+    return (long long) status.st_mtim.tv_sec * 1000000000 + status.st_mtim.tv_nsec;
+}
+
+bool SendLine(int fd, const std::string& line) {
+    const std::string message = line + '\n';
+    size_t sent = 0;
+    while (sent < message.size()) {
+        const ssize_t result = send(fd, message.data() + sent, message.size() - sent, MSG_NOSIGNAL);
+        if (result < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        sent += result;
+    }
+    return true;
+}
+
+// value of "key=value" among the words of line, empty if it isn't there
+std::string Argument(const std::string& line, const std::string& key) {
+    std::istringstream words(line);
+    std::string word;
+    while (words >> word) {
+        if (word.compare(0, key.size() + 1, key + "=") == 0) {
+            return word.substr(key.size() + 1);
+        }
+    }
+    return "";
+}
+
+}
+
+bool ParseRenderRequest(const std::string& line, RenderRequest* request, std::string* error) {
+    std::istringstream words(line);
+    std::string word;
+    if (!(words >> word) || word != "render") {
+        *error = "not a render request";
+        return false;
+    }
+
+    RenderSettings& settings = request->settings;
+    while (words >> word) {
+        const size_t equals = word.find('=');
+        if (equals == std::string::npos) {
+            *error = "expected key=value, got " + word;
+            return false;
+        }
+        const std::string key = word.substr(0, equals);
+        const std::string value = word.substr(equals + 1);
+        int number;
+        bool ok;
+        if (key == "scene") {
+            request->scene_path = value;
+            ok = !value.empty();
+        } else if (key == "out") {
+            request->output_path = value;
+            ok = !value.empty();
+        } else if (key == "eye") {
+            ok = ParseVec3(value, &request->eye);
+        } else if (key == "view") {
+            ok = ParseVec3(value, &request->view);
+        } else if (key == "up") {
+            ok = ParseVec3(value, &request->up);
+        } else if (key == "width") {
+            ok = ParseInt(value, &request->width) && request->width > 0 && request->width <= max_image_side;
+        } else if (key == "height") {
+            ok = ParseInt(value, &request->height) && request->height > 0 && request->height <= max_image_side;
+        } else if (key == "zn") {
+            ok = ParseFloat(value, &request->zn) && request->zn > 0;
+        } else if (key == "zf") {
+            ok = ParseFloat(value, &request->zf);
+        } else if (key == "depth") {
+            ok = ParseInt(value, &request->depth) && request->depth >= 0 && request->depth <= max_depth;
+        } else if (key == "background") {
+            ok = ParseColor(value, &request->background);
+        } else if (key == "ambient") {
+            ok = ParseColor(value, &request->ambient);
+        } else if (key == "samples") {
+            ok = ParseInt(value, &settings.samples) && settings.samples > 0 && settings.samples <= max_samples;
+        } else if (key == "pattern") {
+            ok = ParseName(value, {"grid", "random", "sobol", "r2"}, &number);
+            settings.pattern = (SamplePattern) number;
+        } else if (key == "seed") {
+            ok = ParseInt(value, &number);
+            settings.seed = (uint32_t) number;
+        } else if (key == "builder") {
+            ok = ParseName(value, {"sah", "lbvh"}, &number);
+            settings.builder = (BvhBuilder) number;
+        } else if (key == "denoise") {
+            ok = ParseInt(value, &settings.denoise) && settings.denoise >= 0 && settings.denoise <= max_denoise;
+        } else if (key == "numa") {
+            ok = ParseName(value, {"off", "local", "replicated"}, &number);
+            settings.numa = (NumaPolicy) number;
+        } else if (key == "math") {
+            ok = ParseName(value, {"precise", "fast"}, &number);
+            settings.fast_math = number == 1;
+        } else if (key == "integrator") {
+            ok = ParseName(value, {"whitted", "path"}, &number);
+            settings.integrator = (Integrator) number;
+        } else {
+            *error = "unknown key " + key;
+            return false;
+        }
+        if (!ok) {
+            *error = "bad value of " + key;
+            return false;
+        }
+    }
+
+    if (request->scene_path.empty() || request->output_path.empty()) {
+        *error = "scene and out are required";
+        return false;
+    }
+    return true;
+}
+
+RenderService::RenderService(int threads): threads {std::max(1, threads)}, free_threads {this->threads} {
+    for (int i = 0; i < this->threads; i++) {
+        runners.emplace_back([this] { Run(); });
+    }
+}
+
+RenderService::~RenderService() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    changed.notify_all();
+    for (auto& runner: runners) {
+        runner.join();
+    }
+}
+
+std::future<RenderResult> RenderService::Submit(const RenderRequest& request) {
+    const long long samples = (long long) request.width * request.height * request.settings.samples_per_pixel();
+    Job job {request, samples <= small_job_samples ? 1 : threads, std::promise<RenderResult> {}};
+    std::future<RenderResult> result = job.result.get_future();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(std::move(job));
+    }
+    changed.notify_all();
+    return result;
+}
+
+void RenderService::Unload(const std::string& path) {
+    std::lock_guard<std::mutex> lock(mutex);
+    scenes.erase(path);
+}
+
+void RenderService::Run() {
+    while (true) {
+        std::unique_lock<std::mutex> lock(mutex);
+        // only the first job may start, so large jobs aren't starved by small ones
+        changed.wait(lock, [this] {
+            return stopping || (!queue.empty() && queue.front().threads <= free_threads);
+        });
+        if (stopping) return;
+        Job job = std::move(queue.front());
+        queue.pop_front();
+        free_threads -= job.threads;
+        lock.unlock();
+        // more jobs may fit into the threads left
+        changed.notify_all();
+
+        // the team of this thread is kept by OpenMP between jobs of the same size
+        omp_set_num_threads(job.threads);
+        // a failed allocation ends the job, not the daemon and the jobs of other clients
+        RenderResult result;
+        try {
+            result = Render(job.request);
+        } catch (const std::exception& exception) {
+            result = RenderResult {};
+            result.error = std::string("render failed: ") + exception.what();
+        }
+        job.result.set_value(std::move(result));
+
+        lock.lock();
+        free_threads += job.threads;
+        lock.unlock();
+        changed.notify_all();
+    }
+}
+
+std::shared_ptr<RenderService::CachedScene> RenderService::Scene(const std::string& path, bool* cached) {
+    const long long modified = ModificationTime(path);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        const auto it = scenes.find(path);
+        if (it != scenes.end() && it->second->modified == modified) {
+            *cached = true;
+            return it->second;
+        }
+    }
+
+    // loaded outside of the lock, two jobs missing the same scene at once both load it
+    *cached = false;
+    auto scene = std::make_shared<CachedScene>();
+    scene->modified = modified;
+    if (modified < 0 || !LoadScene(path, &scene->light_sources, &scene->primitives)) {
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    scenes[path] = scene;
+    return scene;
+}
+
+RenderResult RenderService::Render(const RenderRequest& request) {
+    const double start = omp_get_wtime();
+    RenderResult result;
+    const std::shared_ptr<CachedScene> scene = Scene(request.scene_path, &result.scene_cached);
+    if (!scene) {
+        result.error = "can't load scene " + request.scene_path;
+        return result;
+    }
+
+    const int builder = (int) request.settings.builder;
+    std::call_once(scene->built[builder], [&] {
+        scene->bvh[builder] = Bvh(scene->primitives, request.settings.builder);
+    });
+
+    std::vector<int> image((size_t) request.width * request.height);
+    Raytracing(request.camera(), scene->light_sources, scene->primitives, scene->bvh[builder], image.data(),
+               request.depth, request.background, request.ambient, request.settings);
+    if (!SavePpm(request.output_path, image.data(), request.width, request.height)) {
+        result.error = "can't write " + request.output_path;
+        return result;
+    }
+    result.ok = true;
+    result.seconds = omp_get_wtime() - start;
+    return result;
+}
+
+int RunRenderDaemon(const std::string& socket_path, int threads) {
+    sockaddr_un address {};
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "Socket path " << socket_path << " is too long\n";
+        return EXIT_FAILURE;
+    }
+    strcpy(address.sun_path, socket_path.c_str());
+
+    const int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path.c_str());
+    if (listen_fd < 0 || bind(listen_fd, (sockaddr*) &address, sizeof(address)) != 0 || listen(listen_fd, 16) != 0) {
+        perror("render daemon socket");
+        if (listen_fd >= 0) close(listen_fd);
+        return EXIT_FAILURE;
+    }
+
+    RenderService service(threads);
+    std::mutex connections_mutex;
+    std::set<int> connections;
+    // handlers by number, finished ones are joined on the next accept so that they don't pile up
+    std::map<int, std::thread> handlers;
+    std::vector<int> finished_handlers;
+    int next_handler = 0;
+    bool stopping = false;
+
+    // a connection sends requests one line at a time and gets a reply line for each
+    auto serve = [&](int fd, int handler) {
+        std::string buffer;
+        char chunk[4096];
+        bool open = true;
+        while (open) {
+            const ssize_t received = recv(fd, chunk, sizeof(chunk), 0);
+            if (received < 0 && errno == EINTR) continue;
+            if (received <= 0) break;
+            buffer.append(chunk, received);
+
+            size_t end;
+            while (open && (end = buffer.find('\n')) != std::string::npos) {
+                const std::string line = buffer.substr(0, end);
+                buffer.erase(0, end + 1);
+                std::istringstream words(line);
+                std::string command;
+                words >> command;
+
+                std::string reply;
+                if (command == "render") {
+                    RenderRequest request;
+                    std::string error;
+                    if (ParseRenderRequest(line, &request, &error)) {
+                        const RenderResult result = service.Submit(request).get();
+                        reply = result.ok
+                                ? "ok " + std::to_string(result.seconds) + (result.scene_cached ? " cached" : " loaded")
+                                : "error " + result.error;
+                    } else {
+                        reply = "error " + error;
+                    }
+                } else if (command == "unload") {
+                    service.Unload(Argument(line, "scene"));
+                    reply = "ok";
+                } else if (command == "shutdown") {
+                    // replied before stopping, which closes all connections
+                    SendLine(fd, "ok");
+                    std::lock_guard<std::mutex> lock(connections_mutex);
+                    stopping = true;
+                    // wakes up accept and the reads of other connections
+                    shutdown(listen_fd, SHUT_RDWR);
+                    for (const int other: connections) {
+                        if (other != fd) shutdown(other, SHUT_RDWR);
+                    }
+                    open = false;
+                    break;
+                } else if (command.empty()) {
+                    continue;
+                } else {
+                    reply = "error unknown command " + command;
+                }
+                open = SendLine(fd, reply);
+            }
+        }
+        std::lock_guard<std::mutex> lock(connections_mutex);
+        connections.erase(fd);
+        close(fd);
+        finished_handlers.push_back(handler);
+    };
+
+    while (true) {
+        const int fd = accept(listen_fd, nullptr, nullptr);
+        std::lock_guard<std::mutex> lock(connections_mutex);
+        if (stopping) {
+            if (fd >= 0) close(fd);
+            break;
+        }
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("render daemon accept");
+            break;
+        }
+        // handlers on the list are past their last use of the lock, joining them doesn't wait for it
+        for (const int handler: finished_handlers) {
+            handlers[handler].join();
+            handlers.erase(handler);
+        }
+        finished_handlers.clear();
+        connections.insert(fd);
+        handlers.emplace(next_handler, std::thread(serve, fd, next_handler));
+        next_handler++;
+    }
+
+    bool failed;
+    {
+        std::lock_guard<std::mutex> lock(connections_mutex);
+        failed = !stopping;
+        stopping = true;
+        for (const int fd: connections) {
+            shutdown(fd, SHUT_RDWR);
+        }
+    }
+    for (auto& handler: handlers) {
+        handler.second.join();
+    }
+    close(listen_fd);
+    unlink(socket_path.c_str());
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
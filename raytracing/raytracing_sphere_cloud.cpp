@@ -0,0 +1,328 @@
+//
+// Created by numi on 6/11/22.
+//
+
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <cstring>
+
+#include "raytracing_sphere_cloud.h"
+
+namespace {
+
+constexpr float quantization_steps = 65535;
+// testing a whole kernel of spheres costs about as much as testing a couple of node boxes
+constexpr float sphere_cost = 0.25f;
+
+std::atomic<uint32_t> next_cloud_id {1};
+
+// Normal and MaterialAt are asked about the same hit one after another
+struct LastHit {
+    uint32_t cloud = 0;
+    Vec3 point;
+    int index = -1;
+};
+thread_local LastHit last_hit;
+
+uint16_t Quantize(float value, float origin, float scale) {
+    if (scale <= 0) return 0;
+    const float steps = roundf((value - origin) / scale);
+    return (uint16_t) std::min(std::max(steps, 0.0f), quantization_steps);
+}
+
+SphereCloud::Particles MakeParticles(const std::vector<Vec3>& centers,
+                                     const std::vector<float>& radii,
+                                     const std::vector<uint16_t>& material_indices,
+                                     CloudStorage storage
+) {
+    const int count = (int) std::min(centers.size(), radii.size());
+    SphereCloud::Particles particles;
+    particles.storage = storage;
+    particles.material = material_indices;
+    particles.material.resize(count, 0);
+
+    if (storage == CloudStorage::Float) {
+        particles.x.resize(count);
+        particles.y.resize(count);
+        particles.z.resize(count);
+        particles.radius.resize(count);
+        for (int i = 0; i < count; i++) {
+            particles.x[i] = centers[i].x;
+            particles.y[i] = centers[i].y;
+            particles.z[i] = centers[i].z;
+            particles.radius[i] = radii[i];
+        }
+        return particles;
+    }
+
+    Aabb bounds;
+    float max_radius = 0;
+    for (int i = 0; i < count; i++) {
+        bounds.Extend(centers[i]);
+        max_radius = std::max(max_radius, radii[i]);
+    }
+    const Vec3 size = count > 0 ? bounds.max - bounds.min : Vec3 {};
+    particles.origin = count > 0 ? bounds.min : Vec3 {};
+    particles.scale = size * (1 / quantization_steps);
+    particles.radius_scale = max_radius / quantization_steps;
+
+    particles.qx.resize(count);
+    particles.qy.resize(count);
+    particles.qz.resize(count);
+    particles.qradius.resize(count);
+    for (int i = 0; i < count; i++) {
+        particles.qx[i] = Quantize(centers[i].x, particles.origin.x, particles.scale.x);
+        particles.qy[i] = Quantize(centers[i].y, particles.origin.y, particles.scale.y);
+        particles.qz[i] = Quantize(centers[i].z, particles.origin.z, particles.scale.z);
+        particles.qradius[i] = Quantize(radii[i], 0, particles.radius_scale);
+    }
+    return particles;
+}
+
+template <typename T>
+void Permute(std::vector<T>& values, const std::vector<int>& order) {
+    if (values.empty()) return;
+    std::vector<T> permuted(order.size());
+    for (int i = 0; i < order.size(); i++) {
+        permuted[i] = values[order[i]];
+    }
+    values = std::move(permuted);
+}
+
+}
+
+SphereCloud::SphereCloud(const std::vector<Vec3>& centers,
+                         const std::vector<float>& radii,
+                         const std::vector<uint16_t>& material_indices,
+                         std::vector<Material> materials,
+                         CloudStorage storage):
+        SphereCloud(MakeParticles(centers, radii, material_indices, storage), std::move(materials)) {}
+
+SphereCloud::SphereCloud(Particles particles, std::vector<Material> materials):
+        particles {std::move(particles)},
+        materials {std::move(materials)},
+        id {next_cloud_id++} {
+    if (this->materials.empty()) {
+        this->materials.emplace_back();
+    }
+    for (auto& index: this->particles.material) {
+        if (index >= this->materials.size()) {
+            std::cerr << "Sphere cloud material " << index << " is out of the palette, using 0\n";
+            index = 0;
+        }
+    }
+
+    const int count = this->particles.size();
+    std::vector<Aabb> boxes(count);
+    for (int i = 0; i < count; i++) {
+        float x, y, z, radius;
+        Load(i, 1, &x, &y, &z, &radius);
+        const Vec3 extent {radius, radius, radius};
+        boxes[i] = Aabb {Vec3 {x, y, z} - extent, Vec3 {x, y, z} + extent};
+    }
+    bvh = Bvh(boxes, BvhBuilder::Sah, sphere_cost);
+
+    // storage follows the order of the hierarchy, so leaves are ranges of spheres,
+    // spheres with non finite boxes are dropped
+    const std::vector<int>& order = bvh.items();
+    Permute(this->particles.x, order);
+    Permute(this->particles.y, order);
+    Permute(this->particles.z, order);
+    Permute(this->particles.radius, order);
+    Permute(this->particles.qx, order);
+    Permute(this->particles.qy, order);
+    Permute(this->particles.qz, order);
+    Permute(this->particles.qradius, order);
+    Permute(this->particles.material, order);
+
+    const Aabb bounds = bvh.Bounds();
+    point_eps = bounds.Empty() ? 0 : (bounds.max - bounds.min).length() * 1e-4f;
+}
+
+void SphereCloud::Load(int first, int count, float* x, float* y, float* z, float* radius) const {
+    const Particles& p = particles;
+    if (p.storage == CloudStorage::Float) {
+        memcpy(x, p.x.data() + first, count * sizeof(float));
+        memcpy(y, p.y.data() + first, count * sizeof(float));
+        memcpy(z, p.z.data() + first, count * sizeof(float));
+        memcpy(radius, p.radius.data() + first, count * sizeof(float));
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        x[i] = p.origin.x + (float) p.qx[first + i] * p.scale.x;
+        y[i] = p.origin.y + (float) p.qy[first + i] * p.scale.y;
+        z[i] = p.origin.z + (float) p.qz[first + i] * p.scale.z;
+        radius[i] = (float) p.qradius[first + i] * p.radius_scale;
+    }
+}
+
+float SphereCloud::Nearest(const Vec3& start, const Vec3& ray, float t_min, int skipped, int* index) const {
+    const float vv = ray * ray;
+    float min = INFINITY;
+    *index = -1;
+    bvh.TraverseLeaves(start, ray, t_min, INFINITY, [&](int first, int count, float* t_max) {
+        for (int base = first; base < first + count; base += kernel_width) {
+            const int n = std::min(kernel_width, first + count - base);
+            float x[kernel_width] = {}, y[kernel_width] = {}, z[kernel_width] = {}, radius[kernel_width] = {};
+            Load(base, n, x, y, z, radius);
+
+            // near root of every sphere, or the far one if the near one is before t_min like in
+            // Sphere::Intersection, lanes past n are ignored
+            float t[kernel_width];
+            #pragma omp simd
+            for (int k = 0; k < kernel_width; k++) {
+                const float ox = start.x - x[k], oy = start.y - y[k], oz = start.z - z[k];
+                const float ov = ox * ray.x + oy * ray.y + oz * ray.z;
+                const float oo = ox * ox + oy * oy + oz * oz;
+                const float discriminant = ov * ov - vv * (oo - radius[k] * radius[k]);
+                const float root = sqrtf(discriminant > 0 ? discriminant : 0);
+                const float near_root = (-ov - root) / vv, far_root = (-ov + root) / vv;
+                const float hit = near_root >= t_min ? near_root : far_root;
+                t[k] = k < n && discriminant >= 0 && hit >= t_min ? hit : INFINITY;
+            }
+            for (int k = 0; k < kernel_width; k++) {
+                if (t[k] < min && base + k != skipped) {
+                    min = t[k];
+                    *index = base + k;
+                }
+            }
+        }
+        if (min < *t_max) *t_max = min;
+        return true;
+    });
+    return min;
+}
+
+bool SphereCloud::Intersection(const Vec3& start, const Vec3& ray, float* result) const {
+    int index;
+    *result = Nearest(start, ray, 0, -1, &index);
+    return index >= 0;
+}
+
+bool SphereCloud::Intersect(const Vec3& start, const Vec3& ray, Hit* hit, int skipped_part, const RayCone&) const {
+    const float t_min = skipped_part >= 0 ? self_hit_distance / ray.length() : 0;
+    int index;
+    const float t = Nearest(start, ray, t_min, skipped_part, &index);
+    if (index < 0) return false;
+    hit->t = t;
+    hit->part = index;
+    return true;
+}
+
+void SphereCloud::Complete(const Vec3& point, Hit* hit) const {
+    if (hit->part < 0 || hit->part >= size()) {
+        Primitive::Complete(point, hit);
+        return;
+    }
+    float x, y, z, radius;
+    Load(hit->part, 1, &x, &y, &z, &radius);
+    hit->normal = (point - Vec3 {x, y, z}).norm();
+    hit->material = &materials[particles.material[hit->part]];
+}
+
+int SphereCloud::Closest(const Vec3& point) const {
+    if (last_hit.cloud == id && last_hit.point.x == point.x && last_hit.point.y == point.y
+        && last_hit.point.z == point.z) {
+        return last_hit.index;
+    }
+
+    int closest = -1;
+    float min = INFINITY;
+    // ties go to the lower material, storage order depends on how the hierarchy was built
+    auto visit = [&](int first, int count) {
+        for (int i = first; i < first + count; i++) {
+            float x, y, z, radius;
+            Load(i, 1, &x, &y, &z, &radius);
+            const float distance = fabsf((point - Vec3 {x, y, z}).length() - radius);
+            if (distance < min
+                || (distance == min && closest >= 0 && particles.material[i] < particles.material[closest])) {
+                min = distance;
+                closest = i;
+            }
+        }
+    };
+    bvh.VisitPointLeaves(point, point_eps, visit);
+    if (closest < 0) {
+        visit(0, particles.size());
+    }
+
+    last_hit = LastHit {id, point, closest};
+    return closest;
+}
+
+Vec3 SphereCloud::Normal(const Vec3& intersection) const {
+    const int index = Closest(intersection);
+    if (index < 0) return Vec3 {0, 0, 1};
+    float x, y, z, radius;
+    Load(index, 1, &x, &y, &z, &radius);
+    return (intersection - Vec3 {x, y, z}).norm();
+}
+
+const Material& SphereCloud::MaterialAt(const Vec3& point) const {
+    const int index = Closest(point);
+    return index < 0 ? materials[0] : materials[particles.material[index]];
+}
+
+float SphereCloud::Distance(const Vec3& point) const {
+    const int index = Closest(point);
+    if (index < 0) return INFINITY;
+    float x, y, z, radius;
+    Load(index, 1, &x, &y, &z, &radius);
+    return fabsf((point - Vec3 {x, y, z}).length() - radius);
+}
+
+std::unique_ptr<SphereCloud> LoadSphereCloud(const std::string& path,
+                                             const ParticleFileLayout& layout,
+                                             std::vector<Material> materials,
+                                             CloudStorage storage
+) {
+    const auto fits = [&layout](int offset, int size) {
+        return offset >= 0 && offset + size <= layout.record_size;
+    };
+    if (layout.record_size <= 0 || !fits(layout.x, 4) || !fits(layout.y, 4) || !fits(layout.z, 4)
+        || (layout.radius >= 0 && !fits(layout.radius, 4))
+        || (layout.material >= 0 && !fits(layout.material, 2))) {
+        std::cerr << "Invalid particle record layout\n";
+        return nullptr;
+    }
+
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) {
+        std::cerr << "Can't open particle file " << path << '\n';
+        return nullptr;
+    }
+    const std::streamsize size = file.tellg();
+    if (size % layout.record_size != 0) {
+        std::cerr << "Particle file " << path << " isn't made of " << layout.record_size << " byte records\n";
+        return nullptr;
+    }
+    file.seekg(0);
+
+    const size_t count = size / layout.record_size;
+    std::vector<Vec3> centers(count);
+    std::vector<float> radii(count, layout.default_radius);
+    std::vector<uint16_t> material_indices(layout.material >= 0 ? count : 0);
+
+    // records are read in blocks, the whole file is never held in memory next to the spheres
+    constexpr size_t block_records = 1 << 16;
+    std::vector<char> block(block_records * layout.record_size);
+    for (size_t begin = 0; begin < count; begin += block_records) {
+        const size_t records = std::min(block_records, count - begin);
+        if (!file.read(block.data(), (std::streamsize) (records * layout.record_size))) {
+            std::cerr << "Can't read particle file " << path << '\n';
+            return nullptr;
+        }
+        for (size_t i = 0; i < records; i++) {
+            const char* record = block.data() + i * layout.record_size;
+            Vec3& center = centers[begin + i];
+            memcpy(&center.x, record + layout.x, sizeof(float));
+            memcpy(&center.y, record + layout.y, sizeof(float));
+            memcpy(&center.z, record + layout.z, sizeof(float));
+            if (layout.radius >= 0) memcpy(&radii[begin + i], record + layout.radius, sizeof(float));
+            if (layout.material >= 0) memcpy(&material_indices[begin + i], record + layout.material, sizeof(uint16_t));
+        }
+    }
+
+    return std::make_unique<SphereCloud>(centers, radii, material_indices, std::move(materials), storage);
+}
@@ -0,0 +1,451 @@
+//
+// Created by numi on 6/19/22.
+//
+
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "raytracing_streaming.h"
+#include "raytracing_scene_io.h"
+
+namespace {
+
+constexpr uint32_t mesh_magic = 0x4D535452; // "RTSM"
+constexpr uint32_t mesh_version = 1;
+constexpr uint64_t page_alignment = 4096;
+// non resident chunks a ray puts off until the resident ones are tested, more are paged in right away
+constexpr int max_deferred = 64;
+
+std::atomic<uint32_t> next_mesh_id {1};
+
+// Normal and MaterialAt are asked about the hit Intersection just found
+struct LastHit {
+    uint32_t mesh = 0;
+    Vec3 point;
+    StreamedTriangle triangle;
+};
+thread_local LastHit last_hit;
+
+Vec3 TriangleNormal(const StreamedTriangle& triangle) {
+    return (triangle.c - triangle.a).cross(triangle.b - triangle.a).norm();
+}
+
+// Moller-Trumbore, t of start + t * ray at the triangle
+bool IntersectTriangle(const StreamedTriangle& triangle, const Vec3& start, const Vec3& ray, float* t) {
+    const Vec3 ab = triangle.b - triangle.a;
+    const Vec3 ac = triangle.c - triangle.a;
+    const Vec3 p = ray.cross(ac);
+    const float determinant = ab * p;
+    if (determinant == 0) return false;
+    const float inv_determinant = 1 / determinant;
+    const Vec3 offset = start - triangle.a;
+    const float u = (offset * p) * inv_determinant;
+    if (u < 0 || u > 1) return false;
+    const Vec3 q = offset.cross(ab);
+    const float v = (ray * q) * inv_determinant;
+    if (v < 0 || u + v > 1) return false;
+    *t = (ac * q) * inv_determinant;
+    return true;
+}
+
+Aabb TriangleBounds(const StreamedTriangle& triangle) {
+    Aabb bounds;
+    bounds.Extend(triangle.a);
+    bounds.Extend(triangle.b);
+    bounds.Extend(triangle.c);
+    return bounds;
+}
+
+uint64_t AlignUp(uint64_t value) {
+    return (value + page_alignment - 1) / page_alignment * page_alignment;
+}
+
+}
+
+// Triangles stay in the mapping, the pages are given back when the last user of a chunk is gone
+struct StreamedMesh::Chunk {
+    const StreamedTriangle* triangles = nullptr;
+    int count = 0;
+    Bvh bvh;
+    const char* pages = nullptr;
+    size_t page_bytes = 0;
+
+    [[nodiscard]] size_t bytes() const {
+        return page_bytes + bvh.nodes().size() * sizeof(BvhNode) + bvh.items().size() * sizeof(int);
+    }
+
+    ~Chunk() {
+        if (pages) madvise((void*) pages, page_bytes, MADV_DONTNEED);
+    }
+};
+
+StreamedMesh::StreamedMesh(std::string path,
+                           const char* map, size_t map_size,
+                           std::vector<Material> materials,
+                           std::vector<ChunkInfo> chunks,
+                           size_t memory_budget):
+        _path {std::move(path)},
+        map {map},
+        map_size {map_size},
+        materials {std::move(materials)},
+        chunks {std::move(chunks)},
+        memory_budget {memory_budget},
+        id {next_mesh_id++},
+        slots {std::make_unique<Slot[]>(this->chunks.size())} {
+    if (this->materials.empty()) {
+        this->materials.emplace_back();
+    }
+    std::vector<Aabb> boxes(this->chunks.size());
+    first_triangles.push_back(0);
+    for (int i = 0; i < boxes.size(); i++) {
+        boxes[i] = this->chunks[i].bounds;
+        first_triangles.push_back(first_triangles.back() + this->chunks[i].count);
+    }
+    chunk_bvh = Bvh(boxes);
+    const Aabb bounds = chunk_bvh.Bounds();
+    point_eps = bounds.Empty() ? 0 : (bounds.max - bounds.min).length() * 1e-4f;
+}
+
+StreamedMesh::~StreamedMesh() {
+    // chunks give their pages back before the mapping goes away
+    slots.reset();
+    if (map) munmap((void*) map, map_size);
+}
+
+std::shared_ptr<const StreamedMesh::Chunk> StreamedMesh::Resident(int chunk) const {
+    Slot& slot = slots[chunk];
+    std::shared_ptr<const Chunk> resident = std::atomic_load(&slot.chunk);
+    if (resident) {
+        // the clock only ticks on loads, so most visits don't write to memory shared with other threads
+        const uint64_t now = clock.load(std::memory_order_relaxed);
+        if (slot.last_use.load(std::memory_order_relaxed) != now) {
+            slot.last_use.store(now, std::memory_order_relaxed);
+        }
+    }
+    return resident;
+}
+
+std::shared_ptr<const StreamedMesh::Chunk> StreamedMesh::Acquire(int chunk) const {
+    if (auto resident = Resident(chunk)) return resident;
+
+    Slot& slot = slots[chunk];
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (slot.loading) {
+            chunk_loaded.wait(lock);
+        }
+        if (auto resident = std::atomic_load(&slot.chunk)) {
+            slot.last_use.store(clock.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            return resident;
+        }
+        slot.loading = true;
+    }
+
+    // paging in and building the hierarchy happen outside of the lock
+    const ChunkInfo& info = chunks[chunk];
+    auto loaded = std::make_shared<Chunk>();
+    loaded->triangles = reinterpret_cast<const StreamedTriangle*>(map + info.offset);
+    loaded->count = (int) info.count;
+    loaded->pages = map + info.offset;
+    loaded->page_bytes = std::min(AlignUp(info.bytes), map_size - info.offset);
+    madvise((void*) loaded->pages, loaded->page_bytes, MADV_WILLNEED);
+    const size_t triangle_bytes = info.count * sizeof(StreamedTriangle);
+    ByteReader in(map + info.offset + triangle_bytes, info.bytes - triangle_bytes);
+    if (!loaded->bvh.Deserialize(in, loaded->count)) {
+        // the chunk stays empty, rays go through it
+        std::cerr << "Mesh file " << _path << " has a malformed chunk " << chunk << '\n';
+        loaded->bvh = Bvh();
+    }
+    loads++;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    std::atomic_store(&slot.chunk, std::shared_ptr<const Chunk>(loaded));
+    slot.last_use.store(++clock, std::memory_order_relaxed);
+    slot.loading = false;
+    resident_bytes += loaded->bytes();
+    Evict(chunk);
+    chunk_loaded.notify_all();
+    return loaded;
+}
+
+void StreamedMesh::Evict(int kept) const {
+    while (resident_bytes > memory_budget) {
+        int oldest = -1;
+        uint64_t oldest_use = UINT64_MAX;
+        for (int i = 0; i < chunks.size(); i++) {
+            if (i == kept || !std::atomic_load(&slots[i].chunk)) continue;
+            const uint64_t use = slots[i].last_use.load(std::memory_order_relaxed);
+            if (use < oldest_use) {
+                oldest_use = use;
+                oldest = i;
+            }
+        }
+        if (oldest < 0) return;
+        // rays still inside the chunk keep it alive until they are done
+        const std::shared_ptr<const Chunk> evicted = std::atomic_load(&slots[oldest].chunk);
+        resident_bytes -= evicted->bytes();
+        std::atomic_store(&slots[oldest].chunk, std::shared_ptr<const Chunk>());
+    }
+}
+
+size_t StreamedMesh::resident() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return resident_bytes;
+}
+
+bool StreamedMesh::IntersectChunk(const Chunk& chunk, const Vec3& start, const Vec3& ray, float t_min, int skipped,
+                                  float* min, int* hit) const {
+    bool found = false;
+    chunk.bvh.Traverse(start, ray, t_min, *min, [&](int i, float* t_max) {
+        if (i == skipped) return true;
+        float t;
+        if (IntersectTriangle(chunk.triangles[i], start, ray, &t) && t >= t_min && t < *min) {
+            *min = t;
+            *hit = i;
+            *t_max = t;
+            found = true;
+        }
+        return true;
+    });
+    return found;
+}
+
+bool StreamedMesh::Intersection(const Vec3& start, const Vec3& ray, float* result) const {
+    Hit hit;
+    if (!StreamedMesh::Intersect(start, ray, &hit, -1, RayCone {})) return false;
+    *result = hit.t;
+    return true;
+}
+
+bool StreamedMesh::Intersect(const Vec3& start, const Vec3& ray, Hit* hit, int skipped_part, const RayCone&) const {
+    const float t_min = skipped_part >= 0 ? self_hit_distance / ray.length() : 0;
+    float min = INFINITY;
+    StreamedTriangle closest;
+    int closest_part = -1;
+    int deferred[max_deferred];
+    int deferred_count = 0;
+
+    auto test = [&](int chunk, const Chunk& data) {
+        const int first = (int) first_triangles[chunk];
+        int index;
+        if (IntersectChunk(data, start, ray, t_min, skipped_part - first, &min, &index)) {
+            closest = data.triangles[index];
+            closest_part = first + index;
+        }
+    };
+
+    chunk_bvh.Traverse(start, ray, 0, INFINITY, [&](int chunk, float* t_max) {
+        std::shared_ptr<const Chunk> resident = Resident(chunk);
+        if (!resident) {
+            if (deferred_count < max_deferred) {
+                deferred[deferred_count++] = chunk;
+                return true;
+            }
+            resident = Acquire(chunk);
+        }
+        test(chunk, *resident);
+        if (min < *t_max) *t_max = min;
+        return true;
+    });
+
+    // a hit in a resident chunk spares paging in the chunks behind it
+    const Vec3 inv_ray {1 / ray.x, 1 / ray.y, 1 / ray.z};
+    for (int k = 0; k < deferred_count; k++) {
+        const Aabb& bounds = chunks[deferred[k]].bounds;
+        const Aabb padded {
+                bounds.min - Vec3 {point_eps, point_eps, point_eps},
+                bounds.max + Vec3 {point_eps, point_eps, point_eps}
+        };
+        float t_near;
+        if (!padded.Intersect(start, inv_ray, 0, min, &t_near)) continue;
+        test(deferred[k], *Acquire(deferred[k]));
+    }
+
+    if (closest_part < 0) return false;
+    last_hit = LastHit {id, start + ray * min, closest};
+    hit->t = min;
+    hit->part = closest_part;
+    return true;
+}
+
+void StreamedMesh::Complete(const Vec3& point, Hit* hit) const {
+    if (hit->part < 0 || hit->part >= parts()) {
+        Primitive::Complete(point, hit);
+        return;
+    }
+    const int chunk = (int) (std::upper_bound(first_triangles.begin(), first_triangles.end(), (uint32_t) hit->part)
+            - first_triangles.begin()) - 1;
+    const std::shared_ptr<const Chunk> data = Acquire(chunk);
+    const StreamedTriangle& triangle = data->triangles[hit->part - first_triangles[chunk]];
+    hit->normal = TriangleNormal(triangle);
+    hit->material = triangle.material < materials.size() ? &materials[triangle.material] : &materials[0];
+}
+
+const StreamedTriangle* StreamedMesh::Closest(const Vec3& point, std::shared_ptr<const Chunk>* holder) const {
+    if (last_hit.mesh == id && last_hit.point.x == point.x && last_hit.point.y == point.y
+        && last_hit.point.z == point.z) {
+        return &last_hit.triangle;
+    }
+
+    const StreamedTriangle* closest = nullptr;
+    float min = INFINITY;
+    chunk_bvh.VisitPoint(point, point_eps, [&](int chunk) {
+        std::shared_ptr<const Chunk> data = Acquire(chunk);
+        bool closer = false;
+        data->bvh.VisitPoint(point, point_eps, [&](int i) {
+            const StreamedTriangle& triangle = data->triangles[i];
+            const float distance = fabsf((point - triangle.a) * TriangleNormal(triangle));
+            if (distance < min) {
+                min = distance;
+                closest = &triangle;
+                closer = true;
+            }
+        });
+        if (closer) *holder = std::move(data);
+    });
+    if (closest) {
+        last_hit = LastHit {id, point, *closest};
+    }
+    return closest;
+}
+
+Vec3 StreamedMesh::Normal(const Vec3& intersection) const {
+    std::shared_ptr<const Chunk> holder;
+    const StreamedTriangle* triangle = Closest(intersection, &holder);
+    return triangle ? TriangleNormal(*triangle) : Vec3 {0, 0, 1};
+}
+
+const Material& StreamedMesh::MaterialAt(const Vec3& point) const {
+    std::shared_ptr<const Chunk> holder;
+    const StreamedTriangle* triangle = Closest(point, &holder);
+    return triangle && triangle->material < materials.size() ? materials[triangle->material] : materials[0];
+}
+
+float StreamedMesh::Distance(const Vec3& point) const {
+    std::shared_ptr<const Chunk> holder;
+    const StreamedTriangle* triangle = Closest(point, &holder);
+    return triangle ? fabsf((point - triangle->a) * TriangleNormal(*triangle)) : INFINITY;
+}
+
+std::unique_ptr<StreamedMesh> OpenStreamedMesh(const std::string& path, size_t memory_budget) {
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Can't open mesh file " << path << '\n';
+        return nullptr;
+    }
+    struct stat status {};
+    if (fstat(fd, &status) != 0 || status.st_size == 0) {
+        std::cerr << "Can't read mesh file " << path << '\n';
+        close(fd);
+        return nullptr;
+    }
+    const size_t size = status.st_size;
+    void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // the mapping keeps the file open
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        std::cerr << "Can't map mesh file " << path << '\n';
+        return nullptr;
+    }
+    const char* map = static_cast<const char*>(mapped);
+
+    ByteReader in(map, size);
+    uint32_t magic, version, material_count, chunk_count;
+    std::vector<Material> materials;
+    std::vector<StreamedMesh::ChunkInfo> chunks;
+    bool valid = in.Read(&magic) && in.Read(&version) && magic == mesh_magic && version == mesh_version
+            && in.Read(&material_count) && in.Read(&chunk_count);
+    for (uint32_t i = 0; valid && i < material_count; i++) {
+        Material material;
+        valid = in.Read(&material);
+        materials.push_back(material);
+    }
+    for (uint32_t i = 0; valid && i < chunk_count; i++) {
+        StreamedMesh::ChunkInfo chunk;
+        valid = in.Read(&chunk) && chunk.offset % page_alignment == 0 && chunk.offset <= size
+                && chunk.bytes <= size - chunk.offset && chunk.count <= chunk.bytes / sizeof(StreamedTriangle);
+        chunks.push_back(chunk);
+    }
+    if (!valid) {
+        std::cerr << "Mesh file " << path << " is malformed\n";
+        munmap(mapped, size);
+        return nullptr;
+    }
+    // chunks are paged in in any order, reading ahead would only bring in their neighbours
+    madvise(mapped, size, MADV_RANDOM);
+    return std::make_unique<StreamedMesh>(path, map, size, std::move(materials), std::move(chunks), memory_budget);
+}
+
+bool WriteStreamedMesh(const std::string& path,
+                       const std::vector<StreamedTriangle>& triangles,
+                       const std::vector<Material>& materials,
+                       int chunk_triangles
+) {
+    chunk_triangles = std::max(chunk_triangles, 1);
+    std::vector<Aabb> boxes(triangles.size());
+    for (size_t i = 0; i < triangles.size(); i++) {
+        boxes[i] = TriangleBounds(triangles[i]);
+    }
+    // neighbouring leaves are close in space, so runs of the leaf order make compact chunks
+    const Bvh bvh(boxes, BvhBuilder::Lbvh);
+    const std::vector<int>& order = bvh.items();
+
+    const uint32_t chunk_count = (uint32_t) ((order.size() + chunk_triangles - 1) / chunk_triangles);
+    const uint64_t header_size = 4 * sizeof(uint32_t) + materials.size() * sizeof(Material)
+            + chunk_count * sizeof(StreamedMesh::ChunkInfo);
+    std::vector<StreamedMesh::ChunkInfo> chunks(chunk_count);
+    // chunks are built here once instead of every time they are paged in
+    std::vector<ByteWriter> hierarchies(chunk_count);
+    uint64_t offset = AlignUp(header_size);
+    for (uint32_t c = 0; c < chunk_count; c++) {
+        StreamedMesh::ChunkInfo& chunk = chunks[c];
+        const size_t begin = (size_t) c * chunk_triangles;
+        chunk.count = (uint32_t) std::min((size_t) chunk_triangles, order.size() - begin);
+        std::vector<Aabb> chunk_boxes(chunk.count);
+        for (uint32_t i = 0; i < chunk.count; i++) {
+            chunk_boxes[i] = boxes[order[begin + i]];
+            chunk.bounds.Extend(chunk_boxes[i]);
+        }
+        Bvh(chunk_boxes).Serialize(hierarchies[c]);
+        chunk.offset = offset;
+        chunk.bytes = (uint32_t) (chunk.count * sizeof(StreamedTriangle) + hierarchies[c].data().size());
+        offset = AlignUp(offset + chunk.bytes);
+    }
+
+    std::ofstream file(path, std::ios::binary);
+    ByteWriter header;
+    header.Write(mesh_magic);
+    header.Write(mesh_version);
+    header.Write((uint32_t) materials.size());
+    header.Write(chunk_count);
+    for (const auto& material: materials) {
+        header.Write(material);
+    }
+    for (const auto& chunk: chunks) {
+        header.Write(chunk);
+    }
+    file.write(header.data().data(), (std::streamsize) header.data().size());
+
+    std::vector<StreamedTriangle> block;
+    for (uint32_t c = 0; c < chunk_count && file; c++) {
+        const StreamedMesh::ChunkInfo& chunk = chunks[c];
+        file.seekp((std::streamoff) chunk.offset);
+        block.clear();
+        for (size_t i = (size_t) c * chunk_triangles; i < (size_t) c * chunk_triangles + chunk.count; i++) {
+            block.push_back(triangles[order[i]]);
+        }
+        file.write(reinterpret_cast<const char*>(block.data()), (std::streamsize) (block.size() * sizeof(StreamedTriangle)));
+        file.write(hierarchies[c].data().data(), (std::streamsize) hierarchies[c].data().size());
+    }
+    if (!file) {
+        std::cerr << "Can't write mesh file " << path << '\n';
+        return false;
+    }
+    return true;
+}
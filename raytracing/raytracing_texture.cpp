@@ -0,0 +1,376 @@
+//
+// Created by numi on 6/21/22.
+//
+
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "raytracing_texture.h"
+#include "raytracing_scene_io.h"
+
+namespace {
+
+constexpr uint32_t texture_magic = 0x58545452; // "RTTX"
+constexpr uint32_t texture_version = 1;
+constexpr uint64_t page_alignment = 4096;
+constexpr int max_levels = 32;
+constexpr size_t tile_bytes = sizeof(TextureTile);
+static_assert(tile_bytes == page_alignment);
+// grazing rays stretch the footprint by 1 / cosine, up to this factor
+constexpr float max_stretch = 8;
+
+std::atomic<uint32_t> next_texture_id {1};
+
+// Tiles a thread used last, direct mapped by key, they stay alive here even if the cache drops them
+struct RecentTile {
+    uint64_t key = 0;
+    std::shared_ptr<const TextureTile> tile;
+};
+constexpr int recent_tiles = 16;
+thread_local RecentTile recent[recent_tiles];
+
+uint64_t AlignUp(uint64_t value) {
+    return (value + page_alignment - 1) / page_alignment * page_alignment;
+}
+
+// bits of value spread to even positions
+uint32_t SpreadBits(uint32_t value) {
+    value = (value | (value << 8)) & 0x00FF00FF;
+    value = (value | (value << 4)) & 0x0F0F0F0F;
+    value = (value | (value << 2)) & 0x33333333;
+    return (value | (value << 1)) & 0x55555555;
+}
+
+// index of texel (x, y) of a tile in its Morton order
+uint32_t TexelIndex(uint32_t x, uint32_t y) {
+    return SpreadBits(x) | (SpreadBits(y) << 1);
+}
+
+int Wrap(int value, int size) {
+    const int wrapped = value % size;
+    return wrapped < 0 ? wrapped + size : wrapped;
+}
+
+Color Unpack(uint32_t texel) {
+    return Color {
+            (float) (texel & 0xFF) / 255,
+            (float) ((texel >> 8) & 0xFF) / 255,
+            (float) ((texel >> 16) & 0xFF) / 255
+    };
+}
+
+uint32_t Pack(const Color& color) {
+    const auto channel = [](float value) {
+        return (uint32_t) std::clamp((int) lroundf(value * 255), 0, 255);
+    };
+    return channel(color.red) | (channel(color.green) << 8) | (channel(color.blue) << 16) | 0xFF000000;
+}
+
+Texture::Level LevelOf(uint32_t width, uint32_t height) {
+    Texture::Level level;
+    level.width = width;
+    level.height = height;
+    level.tiles_x = (width + texture_tile_size - 1) / texture_tile_size;
+    level.tiles_y = (height + texture_tile_size - 1) / texture_tile_size;
+    return level;
+}
+
+// footprint of a surface with normal seen along ray, wider where the ray grazes it
+float Stretch(float footprint, const Vec3& ray, const Vec3& normal) {
+    const float cosine = fabsf(ray * normal) / ray.length();
+    return footprint / std::max(cosine, 1 / max_stretch);
+}
+
+}
+
+TextureCache::TextureCache(size_t budget): budget {budget} {}
+
+std::shared_ptr<const TextureTile> TextureCache::Find(uint64_t key) const {
+    RecentTile& slot = recent[key % recent_tiles];
+    if (slot.key == key) return slot.tile;
+
+    Shard& shard = shards[key % shard_count];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    const auto it = shard.entries.find(key);
+    if (it == shard.entries.end()) return nullptr;
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second.lru);
+    slot = RecentTile {key, it->second.tile};
+    return it->second.tile;
+}
+
+std::shared_ptr<const TextureTile> TextureCache::Insert(uint64_t key, std::shared_ptr<const TextureTile> tile) const {
+    Shard& shard = shards[key % shard_count];
+    // every shard keeps at least one tile, so a tiny budget still makes progress
+    const size_t shard_tiles = std::max(budget / shard_count / tile_bytes, (size_t) 1);
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        const auto [it, inserted] = shard.entries.emplace(key, Entry {tile, {}});
+        if (inserted) {
+            shard.lru.push_front(key);
+            it->second.lru = shard.lru.begin();
+            while (shard.entries.size() > shard_tiles) {
+                shard.entries.erase(shard.lru.back());
+                shard.lru.pop_back();
+            }
+        } else {
+            tile = it->second.tile;
+        }
+    }
+    recent[key % recent_tiles] = RecentTile {key, tile};
+    return tile;
+}
+
+size_t TextureCache::resident() const {
+    size_t tiles = 0;
+    for (Shard& shard: shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        tiles += shard.entries.size();
+    }
+    return tiles * tile_bytes;
+}
+
+const std::shared_ptr<TextureCache>& DefaultTextureCache() {
+    static const std::shared_ptr<TextureCache> cache = std::make_shared<TextureCache>(default_texture_budget);
+    return cache;
+}
+
+Texture::Texture(std::string path, int fd, std::vector<Level> levels, std::shared_ptr<TextureCache> cache):
+        _path {std::move(path)},
+        fd {fd},
+        levels {std::move(levels)},
+        cache {std::move(cache)},
+        id {next_texture_id++} {
+    uint32_t tiles = 0;
+    for (const Level& level: this->levels) {
+        first_tiles.push_back(tiles);
+        tiles += level.tiles_x * level.tiles_y;
+    }
+}
+
+Texture::~Texture() {
+    close(fd);
+}
+
+uint32_t Texture::Texel(int level_index, int x, int y) const {
+    const Level& level = levels[level_index];
+    x = Wrap(x, (int) level.width);
+    y = Wrap(y, (int) level.height);
+    const uint32_t tile = (y / texture_tile_size) * level.tiles_x + x / texture_tile_size;
+    const uint64_t key = ((uint64_t) id << 32) | (first_tiles[level_index] + tile);
+    const auto texels = cache->Acquire(key, [&](TextureTile* loaded) {
+        const off_t offset = (off_t) (level.offset + (uint64_t) tile * tile_bytes);
+        if (pread(fd, loaded->texels, tile_bytes, offset) != (ssize_t) tile_bytes) {
+            std::cerr << "Can't read a tile of texture " << _path << '\n';
+            memset(loaded->texels, 0, tile_bytes);
+        }
+    });
+    return texels->texels[TexelIndex(x % texture_tile_size, y % texture_tile_size)];
+}
+
+Color Texture::Bilinear(int level_index, float u, float v) const {
+    const Level& level = levels[level_index];
+    // texel centers are at half integers
+    const float x = u * (float) level.width - 0.5f;
+    const float y = v * (float) level.height - 0.5f;
+    const float x0 = floorf(x), y0 = floorf(y);
+    const float fx = x - x0, fy = y - y0;
+    const int ix = (int) x0, iy = (int) y0;
+    return Unpack(Texel(level_index, ix, iy)) * ((1 - fx) * (1 - fy))
+         + Unpack(Texel(level_index, ix + 1, iy)) * (fx * (1 - fy))
+         + Unpack(Texel(level_index, ix, iy + 1)) * ((1 - fx) * fy)
+         + Unpack(Texel(level_index, ix + 1, iy + 1)) * (fx * fy);
+}
+
+Color Texture::Sample(float u, float v, float footprint) const {
+    // wrap far away coordinates before they lose the precision of the fraction
+    u -= floorf(u);
+    v -= floorf(v);
+    const float texels = footprint * (float) std::max(levels[0].width, levels[0].height);
+    const float lod = std::clamp(texels > 0 ? log2f(texels) : 0.0f, 0.0f, (float) (levels.size() - 1));
+    const int level = (int) lod;
+    const float blend = lod - (float) level;
+    const Color fine = Bilinear(level, u, v);
+    if (blend == 0) return fine;
+    return fine * (1 - blend) + Bilinear(level + 1, u, v) * blend;
+}
+
+std::shared_ptr<Texture> OpenTexture(const std::string& path, std::shared_ptr<TextureCache> cache) {
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Can't open texture file " << path << '\n';
+        return nullptr;
+    }
+    struct stat status {};
+    if (fstat(fd, &status) != 0) {
+        std::cerr << "Can't read texture file " << path << '\n';
+        close(fd);
+        return nullptr;
+    }
+    const uint64_t size = status.st_size;
+
+    char header[3 * sizeof(uint32_t) + max_levels * sizeof(Texture::Level)];
+    const ssize_t header_size = pread(fd, header, sizeof(header), 0);
+    ByteReader in(header, header_size > 0 ? (size_t) header_size : 0);
+    uint32_t magic, version, level_count;
+    std::vector<Texture::Level> levels;
+    bool valid = in.Read(&magic) && in.Read(&version) && magic == texture_magic && version == texture_version
+            && in.Read(&level_count) && level_count > 0 && level_count <= max_levels;
+    for (uint32_t i = 0; valid && i < level_count; i++) {
+        Texture::Level level;
+        valid = in.Read(&level) && level.width > 0 && level.height > 0;
+        // every level halves the previous one, all tiles are in the file
+        const Texture::Level expected = i == 0 ? LevelOf(level.width, level.height)
+                : LevelOf(std::max(levels.back().width / 2, 1u), std::max(levels.back().height / 2, 1u));
+        valid = valid && level.width == expected.width && level.height == expected.height
+                && level.tiles_x == expected.tiles_x && level.tiles_y == expected.tiles_y
+                && level.offset % page_alignment == 0 && level.offset <= size
+                && (uint64_t) level.tiles_x * level.tiles_y <= (size - level.offset) / tile_bytes;
+        levels.push_back(level);
+    }
+    if (!valid) {
+        std::cerr << "Texture file " << path << " is malformed\n";
+        close(fd);
+        return nullptr;
+    }
+    // tiles are read in any order
+    posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+    return std::make_shared<Texture>(path, fd, std::move(levels), std::move(cache));
+}
+
+bool WriteTexture(const std::string& path, const int* image, int width, int height) {
+    if (width <= 0 || height <= 0) {
+        std::cerr << "Texture " << path << " has no texels\n";
+        return false;
+    }
+
+    // levels are filtered in floats, each from the one before it
+    std::vector<std::vector<Color>> texels(1);
+    std::vector<Texture::Level> levels {LevelOf(width, height)};
+    texels[0].resize((size_t) width * height);
+    for (int i = 0; i < width * height; i++) {
+        texels[0][i] = Unpack((uint32_t) image[i]);
+    }
+    while (levels.back().width > 1 || levels.back().height > 1) {
+        const Texture::Level& fine = levels.back();
+        const Texture::Level coarse = LevelOf(std::max(fine.width / 2, 1u), std::max(fine.height / 2, 1u));
+        std::vector<Color> filtered((size_t) coarse.width * coarse.height);
+        const std::vector<Color>& source = texels.back();
+        for (uint32_t y = 0; y < coarse.height; y++) {
+            for (uint32_t x = 0; x < coarse.width; x++) {
+                // 2 x 2 box, rows and columns past the edge of odd sizes are clamped
+                const uint32_t x0 = std::min(2 * x, fine.width - 1), x1 = std::min(2 * x + 1, fine.width - 1);
+                const uint32_t y0 = std::min(2 * y, fine.height - 1), y1 = std::min(2 * y + 1, fine.height - 1);
+                filtered[(size_t) coarse.width * y + x] = (source[(size_t) fine.width * y0 + x0]
+                        + source[(size_t) fine.width * y0 + x1]
+                        + source[(size_t) fine.width * y1 + x0]
+                        + source[(size_t) fine.width * y1 + x1]) * 0.25f;
+            }
+        }
+        levels.push_back(coarse);
+        texels.push_back(std::move(filtered));
+    }
+
+    uint64_t offset = AlignUp(3 * sizeof(uint32_t) + levels.size() * sizeof(Texture::Level));
+    for (Texture::Level& level: levels) {
+        level.offset = offset;
+        offset += (uint64_t) level.tiles_x * level.tiles_y * tile_bytes;
+    }
+
+    std::ofstream file(path, std::ios::binary);
+    ByteWriter header;
+    header.Write(texture_magic);
+    header.Write(texture_version);
+    header.Write((uint32_t) levels.size());
+    for (const Texture::Level& level: levels) {
+        header.Write(level);
+    }
+    file.write(header.data().data(), (std::streamsize) header.data().size());
+
+    TextureTile tile {};
+    for (size_t l = 0; l < levels.size() && file; l++) {
+        const Texture::Level& level = levels[l];
+        file.seekp((std::streamoff) level.offset);
+        for (uint32_t ty = 0; ty < level.tiles_y; ty++) {
+            for (uint32_t tx = 0; tx < level.tiles_x; tx++) {
+                // tiles over the edge repeat the last row and column
+                for (uint32_t y = 0; y < texture_tile_size; y++) {
+                    for (uint32_t x = 0; x < texture_tile_size; x++) {
+                        const uint32_t sx = std::min(tx * texture_tile_size + x, level.width - 1);
+                        const uint32_t sy = std::min(ty * texture_tile_size + y, level.height - 1);
+                        tile.texels[TexelIndex(x, y)] = Pack(texels[l][(size_t) level.width * sy + sx]);
+                    }
+                }
+                file.write(reinterpret_cast<const char*>(tile.texels), (std::streamsize) tile_bytes);
+            }
+        }
+    }
+    if (!file) {
+        std::cerr << "Can't write texture file " << path << '\n';
+        return false;
+    }
+    return true;
+}
+
+Material SurfaceTextures::Apply(const Material& material, const TexCoord& uv, float footprint) const {
+    Material result = material;
+    if (diffuse) result.diffuse *= diffuse->Sample(uv.u, uv.v, footprint);
+    if (specular) result.specular *= specular->Sample(uv.u, uv.v, footprint);
+    return result;
+}
+
+void Sphere::Complete(const Vec3& point, Hit* hit) const {
+    hit->normal = Normal(point);
+    hit->material = &_material;
+    if (!textures) return;
+    const Vec3 direction = (point - center) / radius;
+    hit->uv = TexCoord {
+            0.5f + atan2f(direction.z, direction.x) / (2 * (float) M_PI),
+            acosf(std::clamp(direction.y, -1.0f, 1.0f)) / (float) M_PI
+    };
+}
+
+Material Sphere::SurfaceMaterial(const Hit& hit, const Vec3& ray, float footprint) const {
+    if (!textures) return _material;
+    // v spans half of a great circle
+    return textures->Apply(_material, hit.uv, Stretch(footprint, ray, hit.normal) / ((float) M_PI * radius));
+}
+
+void Triangle::SetTextures(std::shared_ptr<const SurfaceTextures> surface_textures,
+                           const TexCoord& uv_a, const TexCoord& uv_b, const TexCoord& uv_c
+) {
+    textures = std::move(surface_textures);
+    uv[0] = uv_a;
+    uv[1] = uv_b;
+    uv[2] = uv_c;
+    const float uv_area = fabsf((uv_b.u - uv_a.u) * (uv_c.v - uv_a.v) - (uv_c.u - uv_a.u) * (uv_b.v - uv_a.v));
+    const float area = (b - a).cross(c - a).length();
+    uv_scale = area > 0 ? sqrtf(uv_area / area) : 0;
+}
+
+void Triangle::Complete(const Vec3& point, Hit* hit) const {
+    hit->normal = normal;
+    hit->material = &_material;
+    if (!textures) return;
+    // barycentric coordinates of point
+    const Vec3 ab = b - a, ac = c - a, ap = point - a;
+    const float d00 = ab * ab, d01 = ab * ac, d11 = ac * ac;
+    const float d20 = ap * ab, d21 = ap * ac;
+    const float denominator = d00 * d11 - d01 * d01;
+    const float wb = denominator != 0 ? (d11 * d20 - d01 * d21) / denominator : 0;
+    const float wc = denominator != 0 ? (d00 * d21 - d01 * d20) / denominator : 0;
+    const float wa = 1 - wb - wc;
+    hit->uv = TexCoord {
+            uv[0].u * wa + uv[1].u * wb + uv[2].u * wc,
+            uv[0].v * wa + uv[1].v * wb + uv[2].v * wc
+    };
+}
+
+Material Triangle::SurfaceMaterial(const Hit& hit, const Vec3& ray, float footprint) const {
+    if (!textures) return _material;
+    return textures->Apply(_material, hit.uv, Stretch(footprint, ray, normal) * uv_scale);
+}
@@ -0,0 +1,111 @@
+//
+// Created by numi on 6/15/22.
+//
+
+#include <algorithm>
+#include <omp.h>
+
+#include "raytracing_views.h"
+#include "raytracing_bvh.h"
+#include "raytracing_denoise.h"
+
+void MultiViewRenderer::Render(const std::vector<View>& views,
+                               const std::vector<Light>& light_sources,
+                               const std::vector<std::unique_ptr<Primitive>>& primitives,
+                               int depth,
+                               const Color& background,
+                               const Color& ambient,
+                               const RenderSettings& settings,
+                               RenderStats* stats
+) {
+    const double start = omp_get_wtime();
+    const Bvh bvh(primitives, settings.builder);
+    if (stats) {
+        stats->build = omp_get_wtime() - start;
+    }
+    Render(views, light_sources, primitives, bvh, depth, background, ambient, settings, stats);
+}
+
+void MultiViewRenderer::Render(const std::vector<View>& views,
+                               const std::vector<Light>& light_sources,
+                               const std::vector<std::unique_ptr<Primitive>>& primitives,
+                               const Bvh& bvh,
+                               int depth,
+                               const Color& background,
+                               const Color& ambient,
+                               const RenderSettings& settings,
+                               RenderStats* stats
+) {
+    const int view_count = (int) views.size();
+    const int samples_per_pixel = settings.samples_per_pixel();
+    const bool denoise = settings.denoise > 0;
+
+    // frames lie one after another in the buffers, which only grow between calls
+    std::vector<Camera> cameras;
+    std::vector<size_t> offsets(view_count + 1, 0);
+    for (int v = 0; v < view_count; v++) {
+        cameras.push_back(views[v].camera);
+        offsets[v + 1] = offsets[v] + (size_t) views[v].camera.sw * views[v].camera.sh;
+    }
+    const size_t pixel_count = offsets[view_count];
+    if (intensities.size() < pixel_count * samples_per_pixel) {
+        intensities.resize(pixel_count * samples_per_pixel);
+    }
+    if (denoise && hits.size() < pixel_count) {
+        hits.resize(pixel_count);
+    }
+    std::vector<Color*> view_intensities(view_count);
+    std::vector<PixelHit*> view_hits(view_count, nullptr);
+    for (int v = 0; v < view_count; v++) {
+        view_intensities[v] = intensities.data() + offsets[v] * samples_per_pixel;
+        if (denoise) {
+            view_hits[v] = hits.data() + offsets[v];
+        }
+    }
+
+    // tile i of every view comes before tile i + 1 of any view
+    std::vector<int> tiles_x(view_count), tiles_y(view_count);
+    int max_tiles = 0;
+    for (int v = 0; v < view_count; v++) {
+        tiles_x[v] = (cameras[v].sw + tile_size - 1) / tile_size;
+        tiles_y[v] = (cameras[v].sh + tile_size - 1) / tile_size;
+        max_tiles = std::max(max_tiles, tiles_x[v] * tiles_y[v]);
+    }
+    tiles.clear();
+    for (int i = 0; i < max_tiles; i++) {
+        for (int v = 0; v < view_count; v++) {
+            if (i >= tiles_x[v] * tiles_y[v]) continue;
+            const int x = i % tiles_x[v] * tile_size;
+            const int y = i / tiles_x[v] * tile_size;
+            tiles.push_back(ViewTile {v, Tile {
+                    x, y,
+                    std::min(tile_size, cameras[v].sw - x),
+                    std::min(tile_size, cameras[v].sh - y)
+            }});
+        }
+    }
+
+    const double start = omp_get_wtime();
+    TraceViewTiles(cameras, light_sources, primitives, bvh, tiles, view_intensities.data(),
+                   depth, ambient, settings, view_hits.data());
+    const double traced = omp_get_wtime();
+
+    // every frame is normalized by its own maximum like a single render
+    #pragma omp parallel for schedule(dynamic)
+    for (int v = 0; v < view_count; v++) {
+        const Camera& camera = cameras[v];
+        if (denoise) {
+            ResolveDenoisedImage(view_intensities[v], view_hits[v], camera.sw, camera.sh, samples_per_pixel,
+                                 views[v].image, background, settings.denoise, settings.integrator);
+        } else {
+            ResolveImage(view_intensities[v], camera.sw * camera.sh, samples_per_pixel, views[v].image, background,
+                         settings.integrator);
+        }
+    }
+
+    if (stats) {
+        stats->trace = traced - start;
+        stats->resolve = omp_get_wtime() - traced;
+        stats->nodes = (int) bvh.nodes().size();
+    }
+}
@@ -0,0 +1,168 @@
+//
+// Created by numi on 6/22/22.
+//
+
+#include <cmath>
+#include <algorithm>
+
+#include "raytracing_visibility.h"
+
+namespace {
+
+bool SameVec(const Vec3& a, const Vec3& b) {
+    return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+
+bool SameLight(const Light& a, const Light& b) {
+    return SameVec(a.position, b.position) && a.shape == b.shape && a.radius == b.radius
+        && SameVec(a.u, b.u) && SameVec(a.v, b.v);
+}
+
+// plane of flat primitives, the normal stays 0 for the rest
+void FlatPlane(const Primitive& primitive, Vec3* point, Vec3* normal) {
+    *point = Vec3 {};
+    *normal = Vec3 {};
+    if (const auto* triangle = dynamic_cast<const Triangle*>(&primitive)) {
+        *point = triangle->Corner(0);
+        *normal = (triangle->Corner(2) - triangle->Corner(0)).cross(triangle->Corner(1) - triangle->Corner(0)).norm();
+    } else if (const auto* plane = dynamic_cast<const Plane*>(&primitive)) {
+        float t;
+        *normal = plane->Normal(Vec3 {});
+        if (plane->Intersection(Vec3 {}, *normal, &t)) *point = *normal * t;
+    }
+}
+
+// true if the convex hull of base and light keeps to one side of the plane and light is off it,
+// the plane then meets shadow rays from base only where they start
+bool OnOneSide(const Aabb& base, const Vec3& light, const Vec3& point, const Vec3& normal, float eps) {
+    const float light_side = (light - point) * normal;
+    if (fabsf(light_side) <= eps) return false;
+    for (int corner = 0; corner < 8; corner++) {
+        const Vec3 position {corner & 1 ? base.max.x : base.min.x,
+                             corner & 2 ? base.max.y : base.min.y,
+                             corner & 4 ? base.max.z : base.min.z};
+        const float side = (position - point) * normal;
+        if (light_side > 0 ? side < -eps : side > eps) return false;
+    }
+    return true;
+}
+
+}
+
+VisibilityCache::VisibilityCache(const std::vector<Light>& light_sources,
+                                 const std::vector<std::unique_ptr<Primitive>>& primitives,
+                                 int resolution,
+                                 size_t capacity
+): lights {light_sources} {
+    Aabb scene;
+    for (const auto& primitive: primitives) {
+        bounds.push_back(primitive->Bounds());
+        if (bounds.back().Finite()) scene.Extend(bounds.back());
+        plane_points.emplace_back();
+        plane_normals.emplace_back();
+        FlatPlane(*primitive, &plane_points.back(), &plane_normals.back());
+    }
+    occluders = Bvh(bounds);
+    for (int i = 0; i < (int) lights.size() && i < max_lights; i++) {
+        if (lights[i].shape == LightShape::Point) point_lights |= 1ull << i;
+    }
+
+    size_t slots = 1;
+    while (slots < capacity) slots <<= 1;
+    slot_mask = slots - 1;
+    keys = std::make_unique<std::atomic<uint64_t>[]>(slots);
+    values = std::make_unique<std::atomic<uint64_t>[]>(slots);
+    for (size_t i = 0; i < slots; i++) {
+        keys[i].store(0, std::memory_order_relaxed);
+        values[i].store(0, std::memory_order_relaxed);
+    }
+
+    if (scene.Empty()) return;
+    // corners of the last cells lie on the far side, coordinates have to fit their bits with them
+    this->resolution = std::clamp(resolution, 1, (1 << coordinate_bits) - 2);
+    const Vec3 size = scene.max - scene.min;
+    const float extent = std::max(size.x, std::max(size.y, size.z));
+    // padding keeps surfaces on the sides of the bounds inside the grid
+    const float cell = std::max(extent, 1e-3f) * 1.01f / (float) this->resolution;
+    origin = scene.min - Vec3 {cell, cell, cell} * 0.5f;
+    inv_cell = 1 / cell;
+}
+
+bool VisibilityCache::Matches(const std::vector<Light>& light_sources,
+                              const std::vector<std::unique_ptr<Primitive>>& primitives) const {
+    if (light_sources.size() != lights.size() || primitives.size() != bounds.size()) return false;
+    for (size_t i = 0; i < lights.size(); i++) {
+        if (!SameLight(light_sources[i], lights[i])) return false;
+    }
+    for (size_t i = 0; i < bounds.size(); i++) {
+        const Aabb box = primitives[i]->Bounds();
+        if (!SameVec(box.min, bounds[i].min) || !SameVec(box.max, bounds[i].max)) return false;
+        // planes are unbounded, their boxes don't tell if they moved
+        Vec3 point, normal;
+        FlatPlane(*primitives[i], &point, &normal);
+        if (!SameVec(point, plane_points[i]) || !SameVec(normal, plane_normals[i])) return false;
+    }
+    return true;
+}
+
+uint64_t VisibilityCache::ClearLights(uint64_t x, uint64_t y, uint64_t z, int primitive) const {
+    const float cell = 1 / inv_cell;
+    const Vec3 corner = origin + Vec3 {(float) x, (float) y, (float) z} * cell;
+    // points of primitive in the cell lie in both boxes
+    Aabb base {corner, corner + Vec3 {cell, cell, cell}};
+    const Aabb& own = bounds[primitive];
+    base.min = Vec3 {std::max(base.min.x, own.min.x), std::max(base.min.y, own.min.y), std::max(base.min.z, own.min.z)};
+    base.max = Vec3 {std::min(base.max.x, own.max.x), std::min(base.max.y, own.max.y), std::min(base.max.z, own.max.z)};
+    if (base.Empty()) return 0;
+    const float eps = cell * 1e-3f;
+
+    const std::vector<BvhNode>& nodes = occluders.nodes();
+    const std::vector<int>& items = occluders.items();
+    uint64_t clear = 0;
+    for (int l = 0; l < (int) lights.size() && l < max_lights; l++) {
+        if (!(point_lights >> l & 1)) continue;
+        const Vec3& light = lights[l].position;
+        const auto blocks = [&](int item) {
+            if (item == primitive) return false;
+            if (plane_normals[item] * plane_normals[item] == 0) return true;
+            return !OnOneSide(base, light, plane_points[item], plane_normals[item], eps);
+        };
+
+        bool blocked = false;
+        for (int item: occluders.unbounded()) {
+            if (blocks(item)) {
+                blocked = true;
+                break;
+            }
+        }
+        // the hull of base and light is covered by boxes around pieces of base shrunk toward the light
+        for (int step = 0; step < sweep_steps && !blocked && !nodes.empty(); step++) {
+            const float s0 = (float) step / sweep_steps, s1 = (float) (step + 1) / sweep_steps;
+            Aabb swept;
+            swept.Extend(base.min + (light - base.min) * s0);
+            swept.Extend(base.max + (light - base.max) * s0);
+            swept.Extend(base.min + (light - base.min) * s1);
+            swept.Extend(base.max + (light - base.max) * s1);
+
+            int stack[64];
+            int size = 0;
+            stack[size++] = 0;
+            while (size > 0 && !blocked) {
+                const BvhNode& node = nodes[stack[--size]];
+                if (!node.bounds.Overlaps(swept)) continue;
+                if (node.count > 0) {
+                    for (int i = node.first; i < node.first + node.count && !blocked; i++) {
+                        blocked = bounds[items[i]].Overlaps(swept) && blocks(items[i]);
+                    }
+                } else if (size + 2 <= 64) {
+                    stack[size++] = node.first;
+                    stack[size++] = node.first + 1;
+                } else {
+                    blocked = true;
+                }
+            }
+        }
+        if (!blocked) clear |= 1ull << l;
+    }
+    return clear;
+}
@@ -0,0 +1,292 @@
+//
+// Created by numi on 6/23/22.
+//
+
+// Checks of the renderer that run without a window, registered with ctest
+
+#include <iostream>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "raytracing.h"
+#include "raytracing_bvh.h"
+#include "raytracing_instance.h"
+#include "raytracing_sphere_cloud.h"
+#include "raytracing_streaming.h"
+#include "raytracing_scene_io.h"
+#include "raytracing_service.h"
+
+namespace {
+
+int failures = 0;
+
+void Check(bool condition, const std::string& what) {
+    if (!condition) {
+        std::cerr << "FAILED: " << what << '\n';
+        failures++;
+    }
+}
+
+bool Near(float a, float b, float eps) {
+    return fabsf(a - b) <= eps * std::max(1.0f, std::max(fabsf(a), fabsf(b)));
+}
+
+// fixed generator, so that failures reproduce
+struct TestRng {
+    uint32_t state = 1;
+    float Next() {
+        state = state * 1664525u + 1013904223u;
+        return (float) (state >> 8) / (float) (1u << 24);
+    }
+    float Range(float min, float max) { return min + (max - min) * Next(); }
+    Vec3 Point(float extent) { return Vec3 {Range(-extent, extent), Range(-extent, extent), Range(-extent, extent)}; }
+};
+
+const Material material {Color {0.5, 0.5, 0.5}, Color {0.2, 0.2, 0.2}, 10};
+
+std::vector<std::unique_ptr<Primitive>> RandomScene(TestRng& rng, int count) {
+    std::vector<std::unique_ptr<Primitive>> primitives;
+    for (int i = 0; i < count; i++) {
+        const Vec3 center = rng.Point(100);
+        if (i % 2 == 0) {
+            primitives.push_back(std::make_unique<Sphere>(center, rng.Range(0.5f, 5), material));
+        } else {
+            primitives.push_back(std::make_unique<Triangle>(center, center + rng.Point(8), center + rng.Point(8), material));
+        }
+    }
+    primitives.push_back(std::make_unique<Plane>(Vec3 {0, -120, 0}, Vec3 {0, 1, 0}, material));
+    return primitives;
+}
+
+// closest t >= 0 over all primitives, INFINITY for a miss
+float BruteForceClosest(const std::vector<std::unique_ptr<Primitive>>& primitives, const Vec3& start, const Vec3& ray) {
+    float closest = INFINITY;
+    for (const auto& primitive: primitives) {
+        float t;
+        if (primitive->Intersection(start, ray, &t) && t >= 0 && t < closest) closest = t;
+    }
+    return closest;
+}
+
+float BvhClosest(const std::vector<std::unique_ptr<Primitive>>& primitives, const Bvh& bvh,
+                 const Vec3& start, const Vec3& ray) {
+    float closest = INFINITY;
+    bvh.Traverse(start, ray, 0, INFINITY, [&](int i, float* t_max) {
+        Hit hit;
+        if (primitives[i]->Intersect(start, ray, &hit) && hit.t >= 0 && hit.t < closest) {
+            closest = hit.t;
+            *t_max = closest;
+        }
+        return true;
+    });
+    return closest;
+}
+
+void TestBvhBuilders() {
+    for (BvhBuilder builder: {BvhBuilder::Sah, BvhBuilder::Lbvh}) {
+        const std::string name = builder == BvhBuilder::Sah ? "sah" : "lbvh";
+        for (int scene = 0; scene < 4; scene++) {
+            TestRng rng {(uint32_t) scene + 1};
+            const auto primitives = RandomScene(rng, 50 + scene * 400);
+            const Bvh bvh(primitives, builder);
+            int mismatches = 0;
+            for (int i = 0; i < 2000; i++) {
+                const Vec3 start = rng.Point(150);
+                const Vec3 ray = rng.Point(1);
+                const float expected = BruteForceClosest(primitives, start, ray);
+                const float found = BvhClosest(primitives, bvh, start, ray);
+                if (std::isinf(expected) != std::isinf(found) || (!std::isinf(expected) && !Near(expected, found, 1e-5f))) {
+                    mismatches++;
+                }
+            }
+            Check(mismatches == 0, name + " closest hits of scene " + std::to_string(scene) + " differ from brute force in "
+                                   + std::to_string(mismatches) + " rays");
+        }
+    }
+}
+
+void TestRenderRequests() {
+    const auto parses = [](const std::string& line) {
+        RenderRequest request;
+        std::string error;
+        return ParseRenderRequest(line, &request, &error);
+    };
+    const char* accepted[] = {
+            "render scene=a.scene out=a.ppm",
+            "render scene=a.scene out=a.ppm width=16384 height=1 depth=32 samples=64 denoise=8",
+            "render scene=a.scene out=a.ppm eye=1,2,3 view=0,0,1 up=0,1,0 zn=100 zf=1000 background=0,0,0.5",
+            "render scene=a.scene out=a.ppm pattern=sobol builder=lbvh numa=local math=fast integrator=path",
+    };
+    for (const char* line: accepted) {
+        Check(parses(line), std::string("accepts ") + line);
+    }
+    const char* rejected[] = {
+            "",
+            "draw scene=a.scene out=a.ppm",
+            "render out=a.ppm",
+            "render scene=a.scene",
+            "render scene=a.scene out=a.ppm size=3",
+            "render scene=a.scene out=a.ppm width",
+            "render scene=a.scene out=a.ppm width=0",
+            "render scene=a.scene out=a.ppm width=16385",
+            "render scene=a.scene out=a.ppm height=-1",
+            "render scene=a.scene out=a.ppm depth=-1",
+            "render scene=a.scene out=a.ppm depth=33",
+            "render scene=a.scene out=a.ppm depth=1000000000",
+            "render scene=a.scene out=a.ppm samples=0",
+            "render scene=a.scene out=a.ppm samples=65",
+            "render scene=a.scene out=a.ppm denoise=9",
+            "render scene=a.scene out=a.ppm zn=0",
+            "render scene=a.scene out=a.ppm eye=1,2",
+            "render scene=a.scene out=a.ppm pattern=halton",
+    };
+    for (const char* line: rejected) {
+        Check(!parses(line), std::string("rejects \"") + line + '"');
+    }
+}
+
+// Primary rays of the grid pattern still go where they went before sample patterns were added:
+// a 4 x 2 camera with 2 x 2 samples looking at a plane at twice the image plane depth
+void TestGridSampling() {
+    std::vector<std::unique_ptr<Primitive>> primitives;
+    primitives.push_back(std::make_unique<Plane>(Vec3 {0, 0, 8}, Vec3 {0, 0, -1}, material));
+    const std::vector<Light> lights {Light {Vec3 {0, 0, 0}, Color {1, 1, 1}}};
+    const Camera camera(Vec3 {0, 0, 0}, Vec3 {0, 0, 1}, Vec3 {0, 1, 0}, 4, 0, 4, 2);
+    const Bvh bvh(primitives);
+    RenderSettings settings;
+    settings.samples = 2;
+    std::vector<Color> intensities(camera.sw * camera.sh * settings.samples_per_pixel());
+    std::vector<PixelHit> hits(camera.sw * camera.sh);
+    TraceRows(camera, lights, primitives, bvh, 0, camera.sh, intensities.data(), 1, Color {}, settings, hits.data());
+
+    // hits of the first sample of pixels (0, 0), (3, 0) and (3, 1)
+    const struct { int pixel; Vec3 position; } expected[] = {
+            {0, Vec3 {3.5f, 2.5f, 8}},
+            {3, Vec3 {-2.5f, 2.5f, 8}},
+            {7, Vec3 {-2.5f, 0.5f, 8}},
+    };
+    for (const auto& e: expected) {
+        const Vec3& position = hits[e.pixel].position;
+        Check(Near(position.x, e.position.x, 1e-5f) && Near(position.y, e.position.y, 1e-5f)
+              && Near(position.z, e.position.z, 1e-5f),
+              "grid sample 0 of pixel " + std::to_string(e.pixel) + " hits " + std::to_string(position.x) + ", "
+              + std::to_string(position.y) + ", " + std::to_string(position.z));
+    }
+}
+
+std::vector<char> Serialized(const Primitive& primitive) {
+    ByteWriter out;
+    primitive.Serialize(out);
+    return out.data();
+}
+
+// primitive read back from its bytes writes the same bytes and consumes all of them
+void CheckRoundTrip(const Primitive& primitive, const std::string& name) {
+    const std::vector<char> bytes = Serialized(primitive);
+    ByteReader in(bytes.data(), bytes.size());
+    const auto copy = DeserializePrimitive(in);
+    Check(copy != nullptr, name + " deserializes");
+    if (!copy) return;
+    Check(in.at_end(), name + " is read to the end");
+    Check(Serialized(*copy) == bytes, name + " writes the same bytes after a round trip");
+}
+
+void TestRoundTrips() {
+    CheckRoundTrip(Sphere(Vec3 {1, 2, 3}, 4, material), "Sphere");
+    CheckRoundTrip(Triangle(Vec3 {0, 0, 0}, Vec3 {0, 1, 0}, Vec3 {1, 0, 0}, material, true), "Triangle");
+    CheckRoundTrip(Plane(Vec3 {0, -1, 0}, Vec3 {0, 1, 0}, material), "Plane");
+    CheckRoundTrip(Quad(Vec3 {0, 0, 0}, Vec3 {2, 0, 0}, Vec3 {0, 0, 3}, material), "Quad");
+    CheckRoundTrip(AABox(Vec3 {-1, -2, -3}, Vec3 {1, 2, 3}, material), "AABox");
+
+    TestRng rng;
+    std::vector<Vec3> centers;
+    std::vector<float> radii;
+    std::vector<uint16_t> material_indices;
+    for (int i = 0; i < 100; i++) {
+        centers.push_back(rng.Point(50));
+        radii.push_back(rng.Range(0.1f, 2));
+        material_indices.push_back((uint16_t) (i % 2));
+    }
+    CheckRoundTrip(SphereCloud(centers, radii, material_indices, {material, material}, CloudStorage::Float),
+                   "SphereCloud with floats");
+    CheckRoundTrip(SphereCloud(centers, radii, material_indices, {material, material}, CloudStorage::Quantized),
+                   "quantized SphereCloud");
+
+    // geometry large enough that generating levels on load would change the bytes
+    std::vector<std::unique_ptr<Primitive>> parts = RandomScene(rng, 2000);
+    parts.pop_back();
+    parts.push_back(std::make_unique<Instance>(std::make_shared<const Geometry>(RandomScene(rng, 10)),
+                                               Transform::Scale(2), material));
+    CheckRoundTrip(Instance(std::make_shared<const Geometry>(std::move(parts)),
+                            Transform::Translation(Vec3 {1, 2, 3}), material), "Instance");
+
+    std::vector<StreamedTriangle> triangles;
+    for (int i = 0; i < 100; i++) {
+        const Vec3 a = rng.Point(10);
+        triangles.push_back(StreamedTriangle {a, a + rng.Point(1), a + rng.Point(1), (uint32_t) (i % 2)});
+    }
+    const std::string mesh_path = "raytracing_tests_mesh.bin";
+    Check(WriteStreamedMesh(mesh_path, triangles, {material, material}, 16), "streamed mesh is written");
+    const auto mesh = OpenStreamedMesh(mesh_path);
+    Check(mesh != nullptr, "streamed mesh opens");
+    if (mesh) CheckRoundTrip(*mesh, "StreamedMesh");
+    std::remove(mesh_path.c_str());
+
+    // instances sharing geometry are read back sharing it
+    std::vector<Light> lights {Light {Vec3 {0, 10, 0}, Color {1, 1, 1}}};
+    std::vector<std::unique_ptr<Primitive>> scene;
+    const auto shared = std::make_shared<const Geometry>(RandomScene(rng, 10));
+    scene.push_back(std::make_unique<Instance>(shared, Transform::Scale(1), material));
+    scene.push_back(std::make_unique<Instance>(shared, Transform::Scale(3), material));
+    ByteWriter out;
+    SerializeScene(out, lights, scene);
+    ByteReader in(out.data().data(), out.data().size());
+    std::vector<Light> read_lights;
+    std::vector<std::unique_ptr<Primitive>> read;
+    Check(DeserializeScene(in, &read_lights, &read) && in.at_end() && read.size() == 2, "scene round trip");
+    if (read.size() == 2) {
+        Check(static_cast<const Instance&>(*read[0]).geometry() == static_cast<const Instance&>(*read[1]).geometry(),
+              "instances share geometry after a round trip");
+    }
+}
+
+void TestCorruptData() {
+    // geometry id far past the objects of the stream
+    ByteWriter instance;
+    instance.Write(PrimitiveTag::Instance);
+    instance.Write(Transform::Scale(1));
+    instance.Write(material);
+    instance.Write((uint32_t) 0xFFFFFFF0u);
+    instance.Write(true);
+    instance.Write((uint32_t) 0);
+    instance.Write((uint32_t) 0);
+    ByteReader instance_in(instance.data().data(), instance.data().size());
+    Check(DeserializePrimitive(instance_in) == nullptr, "rejects a shared id that wasn't given out");
+
+    // length of an array far past the end of the data
+    ByteWriter cloud;
+    cloud.Write(PrimitiveTag::SphereCloud);
+    cloud.Write(CloudStorage::Float);
+    cloud.Write((uint32_t) 0xF0000000u);
+    ByteReader cloud_in(cloud.data().data(), cloud.data().size());
+    Check(DeserializePrimitive(cloud_in) == nullptr, "rejects an array longer than the data");
+}
+
+}
+
+int main() {
+    TestBvhBuilders();
+    TestRenderRequests();
+    TestGridSampling();
+    TestRoundTrips();
+    TestCorruptData();
+    if (failures > 0) {
+        std::cerr << failures << " checks failed\n";
+        return EXIT_FAILURE;
+    }
+    std::cout << "all checks passed\n";
+    return EXIT_SUCCESS;
+}
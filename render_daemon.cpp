@@ -0,0 +1,26 @@
+//
+// Created by numi on 6/14/22.
+//
+
+#include <iostream>
+#include <cstring>
+#include <omp.h>
+
+#include "raytracing_service.h"
+
+// render_daemon [--socket <path>] [--threads <count>]
+// Scene files are written by `untitled --save-scene <path>`, try it with
+//   echo "render scene=scene.bin out=out.ppm width=320 height=240" | socat - UNIX-CONNECT:/tmp/raytracing.sock
+int main(int argc, char** argv) {
+    std::string socket_path = "/tmp/raytracing.sock";
+    int threads = omp_get_max_threads();
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "--socket") == 0) {
+            socket_path = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            threads = atoi(argv[++i]);
+        }
+    }
+    std::cout << "listening on " << socket_path << " with " << threads << " threads\n";
+    return RunRenderDaemon(socket_path, threads);
+}